@@ -0,0 +1,254 @@
+/*
+  Benchmark support for the producer-consumer examples
+
+  Normally each example is built as a demonstration: the producer and
+  consumer sleep for a few seconds per item to simulate doing some
+  work and print what they are doing along the way.  That makes the
+  interleavings easy to follow, but makes it impossible to compare
+  the synchronization mechanisms on speed.
+
+  When an example is compiled with -DBENCH instead
+
+  - LOG() compiles to nothing, so there is no output during the run
+    (with -DEVENTLOG too, it records a binary event for the end of the
+    run instead, see eventlog.h)
+  - PRODUCER_WORK() and CONSUMER_WORK() busy-wait for WORK_NS
+    nanoseconds (possibly 0) instead of sleeping
+  - each slot of the buffer has a timestamp next to it, set when the
+    item is added (BENCH_ENQUEUED) and used by the consumer when it
+    removes the item (BENCH_DEQUEUED) to record the latency from
+    enqueue to dequeue in a histogram (see histogram.h)
+  - the time the producer spends waiting for an open slot and the
+    consumer spends waiting for an item go in histograms of their own,
+    between BENCH_WAITING() when a wait starts and
+    BENCH_PRODUCER_WAITED() or BENCH_CONSUMER_WAITED() when it ends
+    (waits that did not have to happen are not counted)
+  - when the consumer is done it prints a single CSV line:
+
+    variant,items,buffer_size,work_ns,items_per_sec,cpu_ns_per_item,p50_ns,p99_ns,p999_ns,first_ns,steady_ns_per_item
+
+    where first_ns is the time from the start of the run until the
+    first item was consumed, and steady_ns_per_item is the time per
+    item for the rest of the run, so start-up costs (such as faulting
+    in a fresh buffer) show up in the first and not the second
+
+  At the end the producer and consumer each print percentiles of their
+  histograms to stderr, and if BENCH_HISTOGRAMS names a file, append
+  every bucket of them to it as CSV lines:
+
+    variant,histogram,low_ns,high_ns,count
+
+  Timestamps come from CLOCK_MONOTONIC_RAW, which is read without a
+  system call and is not slewed by NTP.
+
+  The producer and consumer each measure their own CPU time, and the
+  producer leaves its total in a struct bench_shared for the consumer
+  to pick up, so this works the same whether the two are threads,
+  forked processes or independent programs, as long as the struct is
+  somewhere they can both see (and starts out zeroed).  There can be
+  several producers: the clock starts when the first one does, their
+  CPU times are added up, and the consumer waits for all of them to
+  report.
+
+  The items, buffer size and work come from the usual NUMBER_OF_ITEMS
+  and BUFFER_SIZE macros (or command line, for the programs that take
+  one) and WORK_NS, all of which the bench targets in the Makefiles
+  set with -D.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef BENCH
+
+#include "histogram.h"
+
+#ifndef WORK_NS
+#define WORK_NS 0
+#endif
+
+/* name printed in the first column -- the Makefiles pass the program
+   name, but the source file name will do otherwise.  A BENCH_VARIANT
+   environment variable overrides both, for runs of the same program
+   with different settings */
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT __BASE_FILE__
+#endif
+
+struct bench_shared {
+  _Atomic long long start_ns;
+  _Atomic long long producer_cpu_ns;
+  atomic_int producers_started;
+  atomic_int producers_done;
+};
+
+static inline long long bench_clock(clockid_t clock) {
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline long long bench_now() {
+
+  return bench_clock(CLOCK_MONOTONIC_RAW);
+}
+
+/* simulated work: spin (rather than sleep) for ns nanoseconds */
+static inline void bench_work(long long ns) {
+  long long until;
+
+  if (ns <= 0) return;
+  until = bench_now() + ns;
+  while (bench_now() < until);
+}
+
+/* latencies seen by the consumer, which is the only one to touch them */
+static struct histogram bench_transit;
+/* when the first item was consumed */
+static long long bench_first_ns;
+/* how long the producer and consumer waited: one histogram for each
+   producer thread, since several can share a process, each printed by
+   its own thread at the end */
+static _Thread_local struct histogram bench_producer_wait;
+static struct histogram bench_consumer_wait;
+/* when the current wait of this thread started */
+static _Thread_local long long bench_wait_start;
+
+static inline void bench_waited(struct histogram *h) {
+
+  hist_record(h, bench_now() - bench_wait_start);
+}
+
+/* print a histogram's percentiles, and dump it if asked to */
+static inline void bench_histogram(const char *name, struct histogram *h) {
+  char *dump = getenv("BENCH_HISTOGRAMS");
+  char *variant = getenv("BENCH_VARIANT");
+  FILE *f;
+
+  fprintf(stderr, "%s ", variant != NULL ? variant : BENCH_VARIANT);
+  hist_print(stderr, name, h);
+  if (dump != NULL && dump[0] != '\0') {
+    if ((f = fopen(dump, "a")) == NULL) {
+      perror(dump);
+      return;
+    }
+    hist_dump(f, variant != NULL ? variant : BENCH_VARIANT, name, h);
+    fclose(f);
+  }
+}
+
+static inline void bench_producer_begin(struct bench_shared *b) {
+  long long unset = 0;
+
+  atomic_fetch_add(&b->producers_started, 1);
+  atomic_compare_exchange_strong(&b->start_ns, &unset, bench_now());
+}
+
+static inline void bench_producer_end(struct bench_shared *b) {
+
+  atomic_fetch_add(&b->producer_cpu_ns,
+		   bench_clock(CLOCK_THREAD_CPUTIME_ID));
+  bench_histogram("producer_wait", &bench_producer_wait);
+  atomic_fetch_add(&b->producers_done, 1);
+}
+
+static inline void bench_consumer_begin(long items) {
+
+  hist_init(&bench_transit);
+  hist_init(&bench_consumer_wait);
+}
+
+static inline void bench_record(long long stamp) {
+  long long now = bench_now();
+
+  if (bench_transit.count == 0) bench_first_ns = now;
+  hist_record(&bench_transit, now - stamp);
+}
+
+static inline void bench_consumer_end(struct bench_shared *b, long items,
+				      int buffer_size) {
+  long long end, elapsed, cpu;
+  char *variant = getenv("BENCH_VARIANT");
+
+  end = bench_now();
+  elapsed = end - b->start_ns;
+  cpu = bench_clock(CLOCK_THREAD_CPUTIME_ID);
+
+  /* every producer finished its last item before we could consume it
+     (so they have all started), and will be done any moment */
+  while (atomic_load(&b->producers_done) <
+	 atomic_load(&b->producers_started)) {
+    usleep(1000);
+  }
+  cpu += b->producer_cpu_ns;
+
+  printf("%s,%ld,%d,%lld,%.0f,%.1f,%lld,%lld,%lld,%lld,%.1f\n",
+	 variant != NULL ? variant : BENCH_VARIANT,
+	 items, buffer_size, (long long)WORK_NS, items * 1e9 / elapsed,
+	 (double)cpu / items, hist_percentile(&bench_transit, 0.5),
+	 hist_percentile(&bench_transit, 0.99),
+	 hist_percentile(&bench_transit, 0.999),
+	 bench_first_ns - b->start_ns,
+	 items > 1 ? (double)(end - bench_first_ns) / (items - 1) : 0.0);
+  fflush(stdout);
+  bench_histogram("transit", &bench_transit);
+  bench_histogram("consumer_wait", &bench_consumer_wait);
+}
+
+/* the if (0) keeps the arguments "used" as far as the compiler's
+   warnings are concerned, but no code is generated */
+#define LOG(...) do { if (0) printf(__VA_ARGS__); } while (0)
+#define PRODUCER_WORK() bench_work(WORK_NS)
+#define CONSUMER_WORK() bench_work(WORK_NS)
+
+#define BENCH_SHARED(name) struct bench_shared name;
+#define BENCH_STAMPS(name, n) long long name[n];
+#define BENCH_ENQUEUED(stamp) ((stamp) = bench_now())
+#define BENCH_DEQUEUED(stamp) bench_record(stamp)
+#define BENCH_PRODUCER_BEGIN(b) bench_producer_begin(b)
+#define BENCH_PRODUCER_END(b) bench_producer_end(b)
+#define BENCH_CONSUMER_BEGIN(items) bench_consumer_begin(items)
+#define BENCH_CONSUMER_END(b, items, size) bench_consumer_end(b, items, size)
+#define BENCH_WAITING() (bench_wait_start = bench_now())
+#define BENCH_PRODUCER_WAITED() bench_waited(&bench_producer_wait)
+#define BENCH_CONSUMER_WAITED() bench_waited(&bench_consumer_wait)
+
+#else
+
+#define LOG(...) printf(__VA_ARGS__)
+/* simulate the cost of producing the item by sleeping for a small
+   random number of seconds, and make the consumer slightly slower to
+   increase the chances of filling up the buffer */
+#define PRODUCER_WORK() sleep(rand()%4+1)
+#define CONSUMER_WORK() sleep(rand()%5+1)
+
+#define BENCH_SHARED(name)
+#define BENCH_STAMPS(name, n)
+#define BENCH_ENQUEUED(stamp)
+#define BENCH_DEQUEUED(stamp)
+#define BENCH_PRODUCER_BEGIN(b)
+#define BENCH_PRODUCER_END(b)
+#define BENCH_CONSUMER_BEGIN(items)
+#define BENCH_CONSUMER_END(b, items, size)
+#define BENCH_WAITING()
+#define BENCH_PRODUCER_WAITED()
+#define BENCH_CONSUMER_WAITED()
+
+#endif
+
+/* with -DEVENTLOG (in either mode), LOG() records a binary event to be
+   printed at exit instead (see eventlog.h) */
+#ifdef EVENTLOG
+#include "eventlog.h"
+#undef LOG
+#define LOG(...) EVLOG(__VA_ARGS__)
+#endif
+
+#endif
@@ -0,0 +1,386 @@
+/*
+  Binary event log, to replace printf in the hot paths
+
+  Printing what the producer and consumer are doing takes the stdio
+  lock and formats text right in the middle of the code we are trying
+  to watch, and without the sleep() pacing the printing takes longer
+  than everything else put together.
+
+  When an example is compiled with -DEVENTLOG, LOG() (see bench.h)
+  does not print anything.  It appends a fixed-size record to a ring
+  that belongs to the calling thread: a timestamp, the format string
+  (which serves as the event type) and the arguments (item, slot,
+  counter and so on) -- 64 bytes, whose types were worked out at
+  compile time.  No locks, no formatting, no system calls and, after a
+  thread's first event, no allocation.
+
+  When the process exits, the records of all of its threads are merged
+  in time order, formatted with their format strings, and written out
+  in one piece, so the output reads just like the printf version, with
+  the CLOCK_MONOTONIC_RAW time of each event in front.  That goes to
+  stdout, or is appended to the file named by the EVENTLOG_FILE
+  environment variable; since the times are the same clock in every
+  process, sorting a file that several processes appended to puts it
+  all in order.
+
+  Each ring keeps the last EVLOG_EVENTS events of its thread; if more
+  were logged, the dump says how many of the oldest were lost.
+
+  Arguments are stored by value, except strings, which are stored as
+  pointers: only pass strings that will still be there at exit (such
+  as string literals or argv[0]).  At most EVLOG_MAX_ARGS arguments
+  (not counting the format) can be logged at once, and the format may
+  not use * for a width or precision.
+*/
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/* events kept per thread */
+#ifndef EVLOG_EVENTS
+#define EVLOG_EVENTS 65536
+#endif
+#define EVLOG_MAX_ARGS 6
+
+enum evlog_type { EVLOG_INT, EVLOG_UINT, EVLOG_DOUBLE, EVLOG_STRING };
+
+union evlog_value {
+  long long i;
+  unsigned long long u;
+  double d;
+  const char *s;
+};
+
+/* what is the same every time a given LOG() is reached: one of these
+   is set up at compile time for each call */
+struct evlog_site {
+  const char *format;
+  int nargs;
+  unsigned char type[EVLOG_MAX_ARGS];
+};
+
+/* what is different: one cache line per event */
+struct evlog_event {
+  uint64_t ticks;
+  const struct evlog_site *site;
+  union evlog_value arg[EVLOG_MAX_ARGS];
+};
+
+/* one thread's ring */
+struct evlog {
+  struct evlog *next;
+  pid_t pid;
+  long long logged;
+  _Alignas(64) struct evlog_event event[EVLOG_EVENTS];
+};
+
+/* every ring in the process, newest first */
+static _Atomic(struct evlog *) evlog_all;
+static _Thread_local struct evlog *evlog_mine;
+
+/* on x86 the time stamp counter is read in a few cycles, where even
+   the vDSO clock_gettime takes a few dozen nanoseconds; the dump
+   converts ticks to CLOCK_MONOTONIC_RAW nanoseconds using the two
+   clocks read together when the first ring was made and at exit */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define evlog_ticks() __rdtsc()
+#else
+#define evlog_ticks() ((uint64_t)evlog_ns())
+#endif
+static uint64_t evlog_base_ticks;
+static long long evlog_base_ns;
+
+static inline long long evlog_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void evlog_dump(void);
+
+/* a child made with fork() inherits the parent's rings, which its dump
+   skips, so it must not go on logging into the forking thread's one */
+static void evlog_forked(void) {
+
+  evlog_mine = NULL;
+}
+
+static struct evlog *evlog_new(void) {
+  static atomic_int registered;
+  struct evlog *log;
+
+  log = (struct evlog *)aligned_alloc(64, sizeof(struct evlog));
+  if (log == NULL) {
+    perror("evlog malloc");
+    exit(1);
+  }
+  log->pid = getpid();
+  log->logged = 0;
+  if (atomic_exchange(&registered, 1) == 0) {
+    evlog_base_ns = evlog_ns();
+    evlog_base_ticks = evlog_ticks();
+    atexit(evlog_dump);
+    pthread_atfork(NULL, NULL, evlog_forked);
+  }
+  log->next = atomic_load(&evlog_all);
+  while (!atomic_compare_exchange_weak(&evlog_all, &log->next, log));
+  return log;
+}
+
+/* the slot for the calling thread's next event, with the time and
+   site filled in */
+static inline struct evlog_event *evlog_next(const struct evlog_site *site) {
+  struct evlog *log = evlog_mine;
+  struct evlog_event *e;
+
+  if (log == NULL) log = evlog_mine = evlog_new();
+  e = &log->event[log->logged++ % EVLOG_EVENTS];
+  e->ticks = evlog_ticks();
+  e->site = site;
+  return e;
+}
+
+static inline union evlog_value evlog_int(long long x) {
+  union evlog_value v = { .i = x };
+  return v;
+}
+
+static inline union evlog_value evlog_uint(unsigned long long x) {
+  union evlog_value v = { .u = x };
+  return v;
+}
+
+static inline union evlog_value evlog_double(double x) {
+  union evlog_value v = { .d = x };
+  return v;
+}
+
+static inline union evlog_value evlog_string(const char *x) {
+  union evlog_value v = { .s = x };
+  return v;
+}
+
+/* EVLOG(format, args...) records an event.  _Generic picks the type
+   of each argument at compile time, for the site, and how to store
+   it, and the count of arguments picks which of the numbered macros
+   to apply */
+#define EVLOG_TYPE(x) _Generic((x),					\
+    float: EVLOG_DOUBLE, double: EVLOG_DOUBLE,				\
+    char *: EVLOG_STRING, const char *: EVLOG_STRING,			\
+    unsigned: EVLOG_UINT, unsigned long: EVLOG_UINT,			\
+    unsigned long long: EVLOG_UINT,					\
+    default: EVLOG_INT)
+#define EVLOG_VALUE(x) _Generic((x),					\
+    float: evlog_double, double: evlog_double,				\
+    char *: evlog_string, const char *: evlog_string,			\
+    unsigned: evlog_uint, unsigned long: evlog_uint,			\
+    unsigned long long: evlog_uint,					\
+    default: evlog_int)(x)
+#define EVLOG_COUNT(...) EVLOG_COUNT_(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0, -)
+#define EVLOG_COUNT_(f, a, b, c, d, e, g, n, ...) n
+#define EVLOG_FORMAT(f, ...) f
+#define EVLOG_CAT(a, b) EVLOG_CAT_(a, b)
+#define EVLOG_CAT_(a, b) a##b
+
+#define EVLOG_TYPES_0(f) 0
+#define EVLOG_TYPES_1(f, a) EVLOG_TYPE(a)
+#define EVLOG_TYPES_2(f, a, ...) EVLOG_TYPE(a), EVLOG_TYPES_1(f, __VA_ARGS__)
+#define EVLOG_TYPES_3(f, a, ...) EVLOG_TYPE(a), EVLOG_TYPES_2(f, __VA_ARGS__)
+#define EVLOG_TYPES_4(f, a, ...) EVLOG_TYPE(a), EVLOG_TYPES_3(f, __VA_ARGS__)
+#define EVLOG_TYPES_5(f, a, ...) EVLOG_TYPE(a), EVLOG_TYPES_4(f, __VA_ARGS__)
+#define EVLOG_TYPES_6(f, a, ...) EVLOG_TYPE(a), EVLOG_TYPES_5(f, __VA_ARGS__)
+
+#define EVLOG_STORE_0(e, f) (void)(e);
+#define EVLOG_STORE_1(e, f, a)						\
+  (e)->arg[0] = EVLOG_VALUE(a);
+#define EVLOG_STORE_2(e, f, a, b)					\
+  EVLOG_STORE_1(e, f, a) (e)->arg[1] = EVLOG_VALUE(b);
+#define EVLOG_STORE_3(e, f, a, b, c)					\
+  EVLOG_STORE_2(e, f, a, b) (e)->arg[2] = EVLOG_VALUE(c);
+#define EVLOG_STORE_4(e, f, a, b, c, d)				\
+  EVLOG_STORE_3(e, f, a, b, c) (e)->arg[3] = EVLOG_VALUE(d);
+#define EVLOG_STORE_5(e, f, a, b, c, d, g)				\
+  EVLOG_STORE_4(e, f, a, b, c, d) (e)->arg[4] = EVLOG_VALUE(g);
+#define EVLOG_STORE_6(e, f, a, b, c, d, g, h)				\
+  EVLOG_STORE_5(e, f, a, b, c, d, g) (e)->arg[5] = EVLOG_VALUE(h);
+
+#define EVLOG(...) do {							\
+    static const struct evlog_site evlog_site = {			\
+      EVLOG_FORMAT(__VA_ARGS__, -), EVLOG_COUNT(__VA_ARGS__),		\
+      { EVLOG_CAT(EVLOG_TYPES_, EVLOG_COUNT(__VA_ARGS__))(__VA_ARGS__) } \
+    };									\
+    struct evlog_event *evlog_e = evlog_next(&evlog_site);		\
+    EVLOG_CAT(EVLOG_STORE_, EVLOG_COUNT(__VA_ARGS__))(evlog_e, __VA_ARGS__) \
+  } while (0)
+
+/* print one event the way printf would have: each conversion gets the
+   flags, width and precision from the format, but the length and type
+   the argument was recorded with */
+static void evlog_print(FILE *out, struct evlog_event *e, long long ns) {
+  const struct evlog_site *site = e->site;
+  const char *p = site->format;
+  char spec[32];
+  union evlog_value *v;
+  int n = 0, len, type;
+
+  fprintf(out, "[%lld.%09lld] ", ns / 1000000000LL, ns % 1000000000LL);
+  while (*p != '\0') {
+    if (*p != '%') {
+      fputc(*p++, out);
+      continue;
+    }
+    if (p[1] == '%') {
+      fputc('%', out);
+      p += 2;
+      continue;
+    }
+
+    len = 0;
+    spec[len++] = *p++;
+    while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL &&
+	   len < (int)sizeof(spec) - 4) {
+      spec[len++] = *p++;
+    }
+    while (*p != '\0' && strchr("hlLqjzt", *p) != NULL) p++;
+    if (*p == '\0') break;
+    if (n == site->nargs) {
+      fputs("(missing)", out);
+      p++;
+      continue;
+    }
+    v = &e->arg[n];
+    type = site->type[n++];
+
+    switch (*p) {
+    case 'd': case 'i':
+    case 'u': case 'o': case 'x': case 'X':
+      spec[len++] = 'l';
+      spec[len++] = 'l';
+      spec[len++] = *p;
+      spec[len] = '\0';
+      if (type == EVLOG_DOUBLE) fprintf(out, spec, (long long)v->d);
+      else if (type == EVLOG_STRING) fputs("(string)", out);
+      else fprintf(out, spec, v->i);
+      break;
+    case 'c':
+      spec[len++] = 'c';
+      spec[len] = '\0';
+      fprintf(out, spec, (int)v->i);
+      break;
+    case 's':
+      spec[len++] = 's';
+      spec[len] = '\0';
+      fprintf(out, spec, type == EVLOG_STRING ? v->s : "(not a string)");
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+    case 'a': case 'A':
+      spec[len++] = *p;
+      spec[len] = '\0';
+      fprintf(out, spec, type == EVLOG_DOUBLE ? v->d
+	      : type == EVLOG_UINT ? (double)v->u : (double)v->i);
+      break;
+    default:
+      fputc('%', out);
+      fputc(*p, out);
+      break;
+    }
+    p++;
+  }
+}
+
+/* at exit: format the events of all of this process's threads, oldest
+   first, and write them out with a single write() so that processes
+   appending to the same file do not split each other's lines */
+static void evlog_dump(void) {
+  struct evlog *log, **mine;
+  struct evlog_event *e;
+  long long *next, lost;
+  uint64_t ticks = evlog_ticks();
+  double scale = 1.0;
+  pid_t pid = getpid();
+  char *text = NULL, *name;
+  size_t size = 0, done;
+  ssize_t wrote;
+  FILE *out;
+  int nlogs = 0, fd, i, oldest;
+
+  /* a forked child inherits its parent's rings too: skip those */
+  for (log = atomic_load(&evlog_all); log != NULL; log = log->next) {
+    if (log->pid == pid) nlogs++;
+  }
+  mine = (struct evlog **)malloc(nlogs * sizeof(struct evlog *));
+  next = (long long *)malloc(nlogs * sizeof(long long));
+  if (nlogs == 0 || mine == NULL || next == NULL ||
+      (out = open_memstream(&text, &size)) == NULL) {
+    free(mine);
+    free(next);
+    return;
+  }
+
+  /* nanoseconds per tick */
+  if (ticks != evlog_base_ticks) {
+    scale = (double)(evlog_ns() - evlog_base_ns) / (ticks - evlog_base_ticks);
+  }
+
+  i = 0;
+  for (log = atomic_load(&evlog_all); log != NULL; log = log->next) {
+    if (log->pid != pid) continue;
+    lost = log->logged > EVLOG_EVENTS ? log->logged - EVLOG_EVENTS : 0;
+    if (lost > 0) {
+      fprintf(out, "[%d: %lld earlier events lost]\n", (int)pid, lost);
+    }
+    mine[i] = log;
+    next[i++] = lost;
+  }
+
+  for (;;) {
+    oldest = -1;
+    for (i=0; i<nlogs; i++) {
+      if (next[i] == mine[i]->logged) continue;
+      if (oldest == -1 || mine[i]->event[next[i] % EVLOG_EVENTS].ticks <
+	  mine[oldest]->event[next[oldest] % EVLOG_EVENTS].ticks) {
+	oldest = i;
+      }
+    }
+    if (oldest == -1) break;
+    e = &mine[oldest]->event[next[oldest]++ % EVLOG_EVENTS];
+    evlog_print(out, e, evlog_base_ns +
+		(long long)((double)(e->ticks - evlog_base_ticks) * scale));
+  }
+  fclose(out);
+  free(mine);
+  free(next);
+
+  name = getenv("EVENTLOG_FILE");
+  if (name != NULL && name[0] != '\0') {
+    if ((fd = open(name, O_WRONLY|O_CREAT|O_APPEND, 0644)) == -1) {
+      perror(name);
+      free(text);
+      return;
+    }
+  }
+  else {
+    /* anything already printf'ed comes first */
+    fflush(stdout);
+    fd = STDOUT_FILENO;
+  }
+  for (done=0; done<size; done+=wrote) {
+    if ((wrote = write(fd, text + done, size - done)) <= 0) break;
+  }
+  if (fd != STDOUT_FILENO) close(fd);
+  free(text);
+}
+
+#endif
@@ -0,0 +1,253 @@
+/*
+  Queue with an eventfd doorbell, for consumers that serve many queues
+
+  A consumer that blocks in semop() or a futex on one queue cannot
+  serve any other while it waits.  An evq is a single-producer/single-
+  consumer ring (see spscring.h) with a count of the items in it, and
+  optionally an eventfd, the doorbell: the producer rings it only when
+  its commit takes the count up from zero, that is when the queue goes
+  from empty to not empty, so a busy queue costs no system calls at
+  all, and one consumer can sleep in epoll_wait (or poll, or select) on
+  the doorbells of any number of queues at once.
+
+  The consumer side goes
+
+    epoll says the doorbell is readable:   evq_ack(fd)
+    then, as many times as it likes:       spsc_peek, take up to a
+                                           batch, spsc_release,
+                                           left = evq_consumed(q, n)
+
+  and once left is 0 it stops looking at the queue until the doorbell
+  rings again.  While left is not 0 it must come back to the queue by
+  itself, because the doorbell will not ring for items that were
+  already there.  evq_ack has to come before the items are taken, so
+  that a ring for items committed after the queue emptied is never
+  cleared without being seen.
+
+  A producer that finds the ring full waits as its WAIT_POLICY says
+  (see waitstrategy.h) on not_full, which the consumer notifies.
+
+  Everything is in the struct and the ring after it, with no pointers,
+  so an evq can live in memory shared between processes.  evq_create
+  makes one in a memfd, which can be handed to another process, along
+  with the doorbell, over a UNIX socket (evq_send and evq_recv, with
+  SCM_RIGHTS), and evq_attach maps a memfd received that way.
+*/
+
+#ifndef EVQUEUE_H
+#define EVQUEUE_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/memfd.h>
+
+#include "spscring.h"
+#include "waitstrategy.h"
+
+struct evq {
+  /* items committed and not yet consumed: the doorbell rings when a
+     commit takes this up from 0 */
+  _Alignas(CACHE_LINE_SIZE) _Atomic long pending;
+  /* the producer waits here for room */
+  _Alignas(CACHE_LINE_SIZE) struct wait_queue not_full;
+  /* the ring follows, on the next cache line */
+};
+
+static inline struct spsc_ring *evq_ring(struct evq *q) {
+
+  return (struct spsc_ring *)(q + 1);
+}
+
+/* bytes needed for a queue of capacity slots */
+static inline size_t evq_size(unsigned capacity) {
+
+  return sizeof(struct evq) + spsc_ring_size(capacity);
+}
+
+/* returns 0 on success, -1 if capacity is not a power of two */
+static inline int evq_init(struct evq *q, unsigned capacity,
+			   enum wait_policy policy) {
+
+  atomic_init(&q->pending, 0);
+  wait_queue_init(&q->not_full, policy);
+  return spsc_ring_init(evq_ring(q), capacity);
+}
+
+/* a doorbell for a queue, or -1 (having said why) */
+static inline int evq_doorbell(void) {
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (fd == -1) perror("eventfd");
+  return fd;
+}
+
+/* producer: the last n items were committed, so ring the doorbell fd
+   (if there is one, fd -1 means none) if the queue was empty.  Returns
+   1 if the queue was empty, 0 if not */
+static inline int evq_committed(struct evq *q, int fd, unsigned n) {
+  uint64_t one = 1;
+
+  if (atomic_fetch_add(&q->pending, n) != 0) return 0;
+  if (fd != -1 && write(fd, &one, sizeof(one)) == -1) {
+    perror("evq doorbell");
+  }
+  return 1;
+}
+
+/* consumer: the doorbell rang, quiet it before taking items */
+static inline void evq_ack(int fd) {
+  uint64_t count;
+
+  /* EAGAIN just means someone already read it */
+  if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+    perror("evq ack");
+  }
+}
+
+/* consumer: n items were released.  Returns how many are left, and
+   the doorbell will not ring again until that is 0 */
+static inline long evq_consumed(struct evq *q, unsigned n) {
+  long left = atomic_fetch_sub(&q->pending, n) - n;
+
+  wait_notify(&q->not_full);
+  return left;
+}
+
+/* a queue of capacity slots in a new memfd, mapped shared.  Returns it
+   and the memfd in *memfd, or NULL (having said why) */
+static inline struct evq *evq_create(unsigned capacity,
+				     enum wait_policy policy, int *memfd) {
+  struct evq *q;
+  size_t size = evq_size(capacity);
+
+  *memfd = syscall(SYS_memfd_create, "evq", MFD_CLOEXEC);
+  if (*memfd == -1) {
+    perror("memfd_create");
+    return NULL;
+  }
+  if (ftruncate(*memfd, size) == -1) {
+    perror("ftruncate");
+    close(*memfd);
+    return NULL;
+  }
+  q = (struct evq *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 *memfd, 0);
+  if (q == (struct evq *)MAP_FAILED) {
+    perror("mmap");
+    close(*memfd);
+    return NULL;
+  }
+  if (evq_init(q, capacity, policy) == -1) {
+    fprintf(stderr, "evq: capacity must be a power of two\n");
+    munmap(q, size);
+    close(*memfd);
+    return NULL;
+  }
+  return q;
+}
+
+/* map the queue in memfd, as made by evq_create, and say how big the
+   mapping is in *size.  Returns NULL (having said why) if it cannot */
+static inline struct evq *evq_attach(int memfd, size_t *size) {
+  struct evq *q;
+  struct stat st;
+
+  if (fstat(memfd, &st) == -1) {
+    perror("fstat");
+    return NULL;
+  }
+  q = (struct evq *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, memfd, 0);
+  if (q == (struct evq *)MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+  *size = st.st_size;
+  return q;
+}
+
+/* send queue id, its memfd and its doorbell (or -1 for none) down the
+   UNIX socket sock.  Returns 0, or -1 (having said why) */
+static inline int evq_send(int sock, int id, int memfd, int doorbell) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  int fds[2] = { memfd, doorbell };
+  int nfds = doorbell == -1 ? 1 : 2;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &id;
+  iov.iov_len = sizeof(id);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+  if (sendmsg(sock, &msg, 0) != sizeof(id)) {
+    perror("sendmsg");
+    return -1;
+  }
+  return 0;
+}
+
+/* receive what evq_send sent: the received descriptors are new ones in
+   this process.  Returns 1, 0 at end of file, or -1 (having said why) */
+static inline int evq_recv(int sock, int *id, int *memfd, int *doorbell) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  int fds[2] = { -1, -1 };
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = id;
+  iov.iov_len = sizeof(*id);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (n == 0) return 0;
+  if (n != sizeof(*id)) {
+    if (n == -1) perror("recvmsg");
+    else fprintf(stderr, "evq: short message\n");
+    return -1;
+  }
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len < CMSG_LEN(sizeof(int))) {
+    fprintf(stderr, "evq: message without a queue\n");
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len >= CMSG_LEN(2 * sizeof(int)) ?
+	 2 * sizeof(int) : sizeof(int));
+  *memfd = fds[0];
+  *doorbell = fds[1];
+  return 1;
+}
+
+#endif
@@ -0,0 +1,142 @@
+/*
+  Log-bucketed histograms for latencies
+
+  Keeping every latency and sorting them at the end gives exact
+  percentiles, but costs memory in proportion to the run and a big
+  sort.  This histogram instead has a fixed set of buckets, in the
+  style of HdrHistogram: values below HIST_SUB are counted exactly,
+  and above that each power of two is split into HIST_SUB equal
+  buckets, so a value is always counted in a bucket no wider than
+  1/HIST_SUB of the value (about 3% with the default 32).  That covers
+  everything from 1ns to centuries in under 2000 buckets.
+
+  Recording a value is a few arithmetic instructions and one
+  increment, with no allocation, so it can be done for every item;
+  a struct histogram can just be a global or live in shared memory.
+  Only one thread may record into a given histogram.
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+/* each power of two is split into 2^HIST_SUB_BITS buckets */
+#ifndef HIST_SUB_BITS
+#define HIST_SUB_BITS 5
+#endif
+#define HIST_SUB (1 << HIST_SUB_BITS)
+/* enough for any non-negative 64-bit value */
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+  long long count;
+  long long min;
+  long long max;
+  long long sum;
+  uint64_t bucket[HIST_BUCKETS];
+};
+
+static inline void hist_init(struct histogram *h) {
+
+  memset(h, 0, sizeof(struct histogram));
+}
+
+static inline int hist_bucket(long long value) {
+  uint64_t v = value < 0 ? 0 : (uint64_t)value;
+  int msb, magnitude;
+
+  if (v < HIST_SUB) return (int)v;
+  msb = 63 - __builtin_clzll(v);
+  magnitude = msb - HIST_SUB_BITS + 1;
+  return (magnitude << HIST_SUB_BITS) +
+    (int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* smallest and largest values that land in bucket b */
+static inline long long hist_bucket_low(int b) {
+  int magnitude = b >> HIST_SUB_BITS, sub = b & (HIST_SUB - 1);
+
+  if (magnitude == 0) return sub;
+  return (long long)(HIST_SUB + sub) << (magnitude - 1);
+}
+
+static inline long long hist_bucket_high(int b) {
+  int magnitude = b >> HIST_SUB_BITS;
+
+  if (magnitude == 0) return hist_bucket_low(b);
+  return hist_bucket_low(b) + (1LL << (magnitude - 1)) - 1;
+}
+
+static inline void hist_record(struct histogram *h, long long value) {
+
+  if (h->count == 0 || value < h->min) h->min = value;
+  if (h->count == 0 || value > h->max) h->max = value;
+  h->count++;
+  h->sum += value;
+  h->bucket[hist_bucket(value)]++;
+}
+
+/* add everything recorded in from to into, for combining the
+   histograms of several threads once they are done */
+static inline void hist_merge(struct histogram *into, struct histogram *from) {
+  int b;
+
+  if (from->count == 0) return;
+  if (into->count == 0 || from->min < into->min) into->min = from->min;
+  if (into->count == 0 || from->max > into->max) into->max = from->max;
+  into->count += from->count;
+  into->sum += from->sum;
+  for (b=0; b<HIST_BUCKETS; b++) {
+    into->bucket[b] += from->bucket[b];
+  }
+}
+
+/* the value at or below which a fraction p of the values fall
+   (rounded up to the top of its bucket, but never above max) */
+static inline long long hist_percentile(struct histogram *h, double p) {
+  long long rank, seen = 0, high;
+  int b;
+
+  if (h->count == 0) return 0;
+  rank = (long long)(p * h->count);
+  if (rank >= h->count) rank = h->count - 1;
+  for (b=0; b<HIST_BUCKETS; b++) {
+    seen += h->bucket[b];
+    if (seen > rank) break;
+  }
+  high = hist_bucket_high(b);
+  return high < h->max ? high : h->max;
+}
+
+/* one line of percentiles */
+static inline void hist_print(FILE *f, const char *name,
+			      struct histogram *h) {
+
+  fprintf(f, "%s: %lld values", name, h->count);
+  if (h->count > 0) {
+    fprintf(f, ", min %lld, mean %.0f, p50 %lld, p90 %lld, p99 %lld, "
+	    "p99.9 %lld, p99.99 %lld, max %lld", h->min,
+	    (double)h->sum / h->count, hist_percentile(h, 0.5),
+	    hist_percentile(h, 0.9), hist_percentile(h, 0.99),
+	    hist_percentile(h, 0.999), hist_percentile(h, 0.9999), h->max);
+  }
+  fprintf(f, "\n");
+}
+
+/* every non-empty bucket as a CSV line: tag,name,low,high,count */
+static inline void hist_dump(FILE *f, const char *tag, const char *name,
+			     struct histogram *h) {
+  int b;
+
+  for (b=0; b<HIST_BUCKETS; b++) {
+    if (h->bucket[b] != 0) {
+      fprintf(f, "%s,%s,%lld,%lld,%llu\n", tag, name, hist_bucket_low(b),
+	      hist_bucket_high(b), (unsigned long long)h->bucket[b]);
+    }
+  }
+}
+
+#endif
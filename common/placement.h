@@ -0,0 +1,180 @@
+/*
+  Where the producers, consumers and buffer run
+
+  Left alone, the scheduler puts the producer and consumer wherever it
+  likes and moves them around while they run, and the buffer's pages
+  end up on whichever NUMA node first touched them.  Since every item
+  moves cache lines from the producer's core to the consumer's, that
+  decides a lot: going across sockets costs several times what going
+  between cores that share a cache does, and each migration is a
+  latency spike.  These environment variables take control of it:
+
+    PLACE_PRODUCER_CPUS=list   run producers on these CPUs, e.g. 2 or
+    PLACE_CONSUMER_CPUS=list   0-3,8: producer (consumer) number i is
+                               pinned to the ith CPU of the list,
+                               going around again if there are more
+                               threads than CPUs
+
+    PLACE_NODE=n               bind the buffer's memory to NUMA node n
+                               (moving any pages already there)
+
+    PLACE_REALTIME=priority    low-jitter mode: lock all of the
+                               process's memory (mlockall) and run the
+                               producers and consumers SCHED_FIFO at
+                               this priority (1-99), so that nothing
+                               but a higher priority task or an
+                               interrupt can take their CPU
+
+  Realtime threads that spin are only safe on CPUs of their own: a
+  SCHED_FIFO consumer spinning on the producer's CPU will not let the
+  producer run (apart from what the kernel's realtime throttling, see
+  /proc/sys/kernel/sched_rt_runtime_us, leaves over), so pin them
+  apart or use WAIT_POLICY=park.  Setting a realtime policy and
+  locking memory need privileges (or see ulimit -r and -l).
+
+  A program calls place_init once at the start, place_memory on the
+  buffer before the producer and consumer start on it, and
+  place_thread at the start of each producer and consumer, in its own
+  thread or process.  Anything that cannot be done is reported on
+  stderr and skipped.
+*/
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/* most CPUs in a list, and highest node number + 1 */
+#define PLACE_MAX_CPUS 1024
+#define PLACE_MAX_NODES 1024
+
+/* set bit n of a mask of unsigned longs, as the kernel reads them */
+#define PLACE_BITS (8 * sizeof(unsigned long))
+#define place_set_bit(mask, n)						\
+  ((mask)[(n) / PLACE_BITS] |= 1UL << ((n) % PLACE_BITS))
+
+enum place_role { PLACE_PRODUCER, PLACE_CONSUMER };
+
+static const char *const place_cpus_vars[] = {
+  "PLACE_PRODUCER_CPUS", "PLACE_CONSUMER_CPUS"
+};
+
+/* the SCHED_FIFO priority asked for, or 0 */
+static inline int place_realtime(void) {
+  char *value = getenv("PLACE_REALTIME");
+
+  if (value == NULL || value[0] == '\0') return 0;
+  return atoi(value);
+}
+
+/* a list like 0-3,8,10-11 into cpus, returning how many (at most max)
+   or -1 if it does not parse */
+static inline int place_parse_cpus(const char *list, int *cpus, int max) {
+  const char *p = list;
+  char *end;
+  long first, last;
+  int n = 0;
+
+  while (*p != '\0') {
+    first = strtol(p, &end, 10);
+    if (end == p || first < 0) return -1;
+    last = first;
+    p = end;
+    if (*p == '-') {
+      p++;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) return -1;
+      p = end;
+    }
+    for (; first <= last && n < max; first++) {
+      cpus[n++] = (int)first;
+    }
+    if (*p == ',') p++;
+    else if (*p != '\0') return -1;
+  }
+  return n;
+}
+
+/* lock the process's memory, now and as it grows, in realtime mode */
+static inline void place_init(void) {
+
+  if (place_realtime() <= 0) return;
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    fprintf(stderr, "place: cannot lock memory (%s)\n", strerror(errno));
+  }
+}
+
+/* bind the pages holding the size bytes at addr to PLACE_NODE.  Whole
+   pages are bound, so anything sharing the first or last page with
+   the buffer comes along */
+static inline void place_memory(void *addr, size_t size) {
+  char *value = getenv("PLACE_NODE");
+  unsigned long mask[PLACE_MAX_NODES / PLACE_BITS];
+  unsigned long page = (unsigned long)sysconf(_SC_PAGESIZE);
+  unsigned long start, end;
+  int node;
+
+  if (value == NULL || value[0] == '\0') return;
+  node = atoi(value);
+  if (node < 0 || node >= PLACE_MAX_NODES) {
+    fprintf(stderr, "place: bad PLACE_NODE %s\n", value);
+    return;
+  }
+  memset(mask, 0, sizeof(mask));
+  place_set_bit(mask, node);
+
+  start = (unsigned long)addr & ~(page - 1);
+  end = ((unsigned long)addr + size + page - 1) & ~(page - 1);
+  if (syscall(SYS_mbind, start, end - start, MPOL_BIND, mask,
+	      PLACE_MAX_NODES, MPOL_MF_MOVE) != 0) {
+    fprintf(stderr, "place: cannot bind %lu bytes to node %d (%s)\n",
+	    end - start, node, strerror(errno));
+  }
+}
+
+/* pin the calling thread as producer or consumer number index, and
+   make it realtime if asked to.  The system calls are made directly,
+   since the cpu_set_t macros need _GNU_SOURCE defined before the
+   first #include of the program; on Linux, pid 0 means just the
+   calling thread, not the whole process */
+static inline void place_thread(enum place_role role, int index) {
+  char *list = getenv(place_cpus_vars[role]);
+  int cpus[PLACE_MAX_CPUS];
+  unsigned long mask[PLACE_MAX_CPUS / PLACE_BITS];
+  struct sched_param param;
+  int n, cpu;
+
+  if (list != NULL && list[0] != '\0') {
+    n = place_parse_cpus(list, cpus, PLACE_MAX_CPUS);
+    if (n <= 0) {
+      fprintf(stderr, "place: bad %s %s\n", place_cpus_vars[role], list);
+    }
+    else {
+      cpu = cpus[index % n];
+      memset(mask, 0, sizeof(mask));
+      if (cpu < PLACE_MAX_CPUS) place_set_bit(mask, cpu);
+      if (cpu >= PLACE_MAX_CPUS ||
+	  syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) != 0) {
+	fprintf(stderr, "place: cannot run on CPU %d (%s)\n", cpu,
+		strerror(cpu >= PLACE_MAX_CPUS ? EINVAL : errno));
+      }
+    }
+  }
+
+  if ((param.sched_priority = place_realtime()) > 0) {
+    if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+      fprintf(stderr, "place: cannot use SCHED_FIFO priority %d (%s)\n",
+	      param.sched_priority, strerror(errno));
+    }
+  }
+}
+
+#endif
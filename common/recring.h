@@ -0,0 +1,183 @@
+/*
+  Single-producer/single-consumer ring of variable-length records
+
+  The rings in spscring.h and the examples move one int per slot, so
+  every slot has to be as big as the biggest item.  This ring is just
+  capacity bytes, and each item is a record of however many bytes it
+  needs: an 8-byte header holding the length, then the bytes
+  themselves, padded so the next header is 8-byte aligned.
+
+    in, out     ever-increasing 64-bit byte positions (the offset into
+                the ring is the low bits, so capacity must be a power
+                of two); in-out is the number of bytes in use
+
+  A record never wraps around the end of the ring.  When the producer
+  needs more room than is left before the end, it fills the rest with
+  a skip record (length RECRING_SKIP) and starts its record at offset
+  0; the consumer steps over skip records without showing them to the
+  caller.  So a record (header included) can take at most half of the
+  ring, see recring_max_record.
+
+  Nothing is copied on the way through:
+
+  - the producer asks recring_reserve for room for a record of up to
+    len bytes, builds the record right there, then publishes it with
+    recring_commit, giving its actual length (which may be shorter
+    than what was reserved)
+
+  - the consumer asks recring_peek for the next record, uses it where
+    it sits, then frees its bytes with recring_release
+
+  As in spscring.h, in and out are on separate cache lines, updates
+  are release stores read with acquire loads, and the producer keeps a
+  cached copy of out so it only reads the consumer's line when its
+  copy says there might not be room.
+
+  Everything is stored inside the struct, so a ring can be placed in
+  memory shared between processes.  Allocate recring_size(capacity)
+  bytes (cache line aligned) and call recring_init.
+*/
+
+#ifndef RECRING_H
+#define RECRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+/* records are aligned to this, and capacity must be a multiple of it */
+#define RECRING_ALIGN 8
+/* length of a padding record at the end of the ring */
+#define RECRING_SKIP UINT32_MAX
+
+struct recring_header {
+  uint32_t len;
+  uint32_t unused;
+};
+
+struct recring {
+  /* written only by the producer */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t in;
+  uint64_t out_cache;
+  /* start of the record the producer has reserved */
+  uint64_t reserved;
+  /* written only by the consumer */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t out;
+  /* read-only after recring_init */
+  _Alignas(CACHE_LINE_SIZE) uint64_t mask;
+  _Alignas(CACHE_LINE_SIZE) unsigned char data[];
+};
+
+/* bytes a record of len bytes takes up in the ring, header included */
+static inline uint64_t recring_footprint(uint64_t len) {
+
+  return sizeof(struct recring_header) +
+    (len + RECRING_ALIGN - 1) / RECRING_ALIGN * RECRING_ALIGN;
+}
+
+/* bytes needed for a ring of capacity bytes, rounded up to a whole
+   number of cache lines */
+static inline size_t recring_size(size_t capacity) {
+  size_t size = sizeof(struct recring) + capacity;
+
+  return (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+/* returns 0 on success, -1 if capacity is not a power of two of at
+   least 2 * RECRING_ALIGN */
+static inline int recring_init(struct recring *r, size_t capacity) {
+
+  if (capacity < 2 * RECRING_ALIGN || (capacity & (capacity - 1)) != 0)
+    return -1;
+  atomic_init(&r->in, 0);
+  atomic_init(&r->out, 0);
+  r->out_cache = 0;
+  r->reserved = 0;
+  r->mask = capacity - 1;
+  return 0;
+}
+
+/* longest record that can ever be reserved */
+static inline size_t recring_max_record(struct recring *r) {
+
+  return (r->mask + 1) / 2 - sizeof(struct recring_header);
+}
+
+static inline struct recring_header *recring_header_at(struct recring *r,
+						       uint64_t pos) {
+
+  return (struct recring_header *)&r->data[pos & r->mask];
+}
+
+/* producer: get room for a record of up to len bytes, returns where to
+   build it, or NULL if there is not enough room right now (or ever, if
+   len is more than recring_max_record) */
+static inline void *recring_reserve(struct recring *r, size_t len) {
+  uint64_t in = atomic_load_explicit(&r->in, memory_order_relaxed);
+  uint64_t capacity = r->mask + 1;
+  uint64_t to_end = capacity - (in & r->mask);
+  uint64_t need = recring_footprint(len);
+  uint64_t skip = 0;
+
+  if (len > recring_max_record(r)) return NULL;
+
+  /* the record cannot wrap, so it may have to start back at offset 0 */
+  if (need > to_end) skip = to_end;
+
+  /* only look at the consumer's line if our cached copy of out does
+     not already show enough room */
+  if (capacity - (in - r->out_cache) < skip + need) {
+    r->out_cache = atomic_load_explicit(&r->out, memory_order_acquire);
+    if (capacity - (in - r->out_cache) < skip + need) return NULL;
+  }
+
+  /* the skip record becomes visible along with the real one, in
+     recring_commit */
+  if (skip > 0) recring_header_at(r, in)->len = RECRING_SKIP;
+  r->reserved = in + skip;
+  return recring_header_at(r, r->reserved) + 1;
+}
+
+/* producer: publish the reserved record, which turned out to be len
+   bytes long (no more than were reserved) */
+static inline void recring_commit(struct recring *r, size_t len) {
+
+  recring_header_at(r, r->reserved)->len = (uint32_t)len;
+  atomic_store_explicit(&r->in, r->reserved + recring_footprint(len),
+			memory_order_release);
+}
+
+/* consumer: get the next record and its length, or NULL if the ring
+   is empty */
+static inline void *recring_peek(struct recring *r, size_t *len) {
+  uint64_t out = atomic_load_explicit(&r->out, memory_order_relaxed);
+  uint64_t in = atomic_load_explicit(&r->in, memory_order_acquire);
+  struct recring_header *h;
+
+  if (in == out) return NULL;
+  h = recring_header_at(r, out);
+  if (h->len == RECRING_SKIP) {
+    /* padding up to the end of the ring: give it back now, and the
+       real record is at offset 0 */
+    out += r->mask + 1 - (out & r->mask);
+    atomic_store_explicit(&r->out, out, memory_order_release);
+    h = recring_header_at(r, out);
+  }
+  *len = h->len;
+  return h + 1;
+}
+
+/* consumer: free the record returned by the last recring_peek */
+static inline void recring_release(struct recring *r) {
+  uint64_t out = atomic_load_explicit(&r->out, memory_order_relaxed);
+
+  atomic_store_explicit(&r->out,
+			out + recring_footprint(recring_header_at(r, out)->len),
+			memory_order_release);
+}
+
+#endif
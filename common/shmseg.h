@@ -0,0 +1,102 @@
+/*
+  Options for how the shared memory segments are set up
+
+  By default the examples get their segments with a plain shmget and
+  let the pages be faulted in one at a time the first time the
+  producer or consumer touches them, which for a big ring means lots
+  of page faults and TLB misses while items are moving.  Two
+  environment variables change that:
+
+    SHMSEG_HUGEPAGES=1   ask for the segment on huge pages
+                         (SHM_HUGETLB), rounding its size up to a
+                         whole number of them.  If the system has none
+                         to give (see /proc/sys/vm/nr_hugepages), say
+                         so and use normal pages.
+
+    SHMSEG_PREFAULT=1    fault in every page of the segment and lock it
+                         into memory (mlock) as soon as it is attached,
+                         so the producer and consumer never take a
+                         page fault on it.  If the pages cannot be
+                         locked (see ulimit -l), say so and just fault
+                         them in.
+
+  shmseg_get replaces the shmget that creates a segment, and
+  shmseg_prefault goes after every shmat.  Page tables and locks are
+  per process, so that includes a child that inherits the attachment
+  across a fork.
+*/
+
+#ifndef SHMSEG_H
+#define SHMSEG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+
+#ifndef SHM_HUGETLB
+#define SHM_HUGETLB 04000
+#endif
+
+static inline int shmseg_option(const char *name) {
+  char *value = getenv(name);
+
+  return value != NULL && value[0] != '\0' && strcmp(value, "0") != 0;
+}
+
+/* huge page size from /proc/meminfo, or the usual 2MB */
+static inline size_t shmseg_huge_page_size(void) {
+  FILE *meminfo;
+  char line[128];
+  unsigned long kb = 2048;
+
+  if ((meminfo = fopen("/proc/meminfo", "r")) != NULL) {
+    while (fgets(line, sizeof(line), meminfo) != NULL) {
+      if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) break;
+    }
+    fclose(meminfo);
+  }
+  return kb * 1024;
+}
+
+/* shmget(key, size, flags), on huge pages if SHMSEG_HUGEPAGES is set
+   and there are enough of them */
+static inline int shmseg_get(key_t key, size_t size, int flags) {
+  size_t huge;
+  int id;
+
+  if (shmseg_option("SHMSEG_HUGEPAGES")) {
+    huge = shmseg_huge_page_size();
+    id = shmget(key, (size + huge - 1) / huge * huge, flags | SHM_HUGETLB);
+    if (id != -1) return id;
+    fprintf(stderr, "shmseg: no huge pages for %lu bytes (%s), "
+	    "using normal pages\n", (unsigned long)size, strerror(errno));
+  }
+  return shmget(key, size, flags);
+}
+
+/* if SHMSEG_PREFAULT is set, bring in and lock the size bytes at addr */
+static inline void shmseg_prefault(void *addr, size_t size) {
+  volatile char *p = (volatile char *)addr;
+  long page = sysconf(_SC_PAGESIZE);
+  size_t i;
+
+  if (!shmseg_option("SHMSEG_PREFAULT")) return;
+
+  /* locking faults everything in as well */
+  if (mlock(addr, size) == 0) return;
+  fprintf(stderr, "shmseg: cannot lock %lu bytes (%s), "
+	  "faulting them in instead\n", (unsigned long)size, strerror(errno));
+
+  /* a read is enough to get a shared memory page allocated and
+     mapped, and does not disturb what the other process wrote */
+  for (i=0; i<size; i+=page) {
+    (void)p[i];
+  }
+}
+
+#endif
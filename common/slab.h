@@ -0,0 +1,254 @@
+/*
+  Slab allocator for memory shared between processes
+
+  The buffers only carry ints.  To send an item of a few kilobytes,
+  copying it through the ring would make every slot that big and cost
+  a copy going in and another coming out.  Instead the producer takes
+  a block from a slab in the shared segment, builds the item right
+  there, and sends only the block's handle, its byte offset from the
+  start of the slab (the segment is mapped at a different address in
+  every process, so a pointer would mean nothing to the consumer).  The
+  consumer turns the handle back into a pointer with slab_ptr, uses
+  the item where it is, and frees the block.
+
+  The blocks come in SLAB_CLASSES size classes, SLAB_MIN_BLOCK bytes
+  and then each four times the one before (256 bytes to 16K by
+  default), with SLAB_BLOCKS blocks of each.  slab_alloc takes a block
+  from the smallest class the size fits in.
+
+    struct slab  the free list of each class, then the blocks, all in
+                 SLAB_SIZE bytes (cache line aligned) that slab_init
+                 sets up once, in the process that makes the segment
+
+  A class's free list is a lock-free stack (a Treiber stack): the head
+  is one 64-bit word holding the index of the top block (plus one, 0
+  for empty) and a tag that every push and pop increments, so that a
+  compare and exchange that read the head before another process
+  popped that block and pushed it back fails instead of corrupting the
+  list.  The link from each block to the one below it is kept in the
+  class's next array rather than in the block, so a process can read
+  it at any time without touching the blocks themselves.
+
+  Going to the free list for every block would still have the
+  producer and consumer bouncing its cache line between them, so each
+  process also keeps a slab_cache of its own (in its own memory, not
+  the segment) of up to SLAB_CACHE free blocks per class.  slab_alloc
+  takes from the cache, and refills it half way from the free list
+  when it is empty; slab_free puts the block in the cache, and gives
+  half back to the free list when it is full.  A process that
+  only frees, like the consumer, hands blocks back SLAB_CACHE/2 at a
+  time, and one that only allocates takes them that many at a time.
+
+  A process must call slab_cache_flush before it exits, or the blocks
+  in its cache are lost until the segment is made again, and so are
+  blocks allocated by a process that is killed before they are freed.
+  SLAB_BLOCKS has to be enough for everything that can be in use at
+  once: a buffer full of items, what each process is holding, and up
+  to SLAB_CACHE blocks of each class in each process's cache.
+*/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+#ifndef SLAB_CLASSES
+#define SLAB_CLASSES 4
+#endif
+/* the smallest block, a multiple of CACHE_LINE_SIZE */
+#ifndef SLAB_MIN_BLOCK
+#define SLAB_MIN_BLOCK 256
+#endif
+/* blocks in each class */
+#ifndef SLAB_BLOCKS
+#define SLAB_BLOCKS 256
+#endif
+/* free blocks of each class a process keeps for itself */
+#ifndef SLAB_CACHE
+#define SLAB_CACHE 16
+#endif
+
+/* an offset from the start of the slab, never 0 for a block */
+typedef uint64_t slab_handle;
+#define SLAB_NONE 0
+
+struct slab_class {
+  /* tag in the high 32 bits, top block + 1 in the low ones */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head;
+  uint64_t block_size;
+  /* of the first block, from the start of the slab */
+  uint64_t offset;
+  /* the block below each one on the stack, + 1 (0 for none) */
+  atomic_uint next[SLAB_BLOCKS];
+};
+
+struct slab {
+  struct slab_class classes[SLAB_CLASSES];
+  /* the blocks follow, the smallest class first */
+  _Alignas(CACHE_LINE_SIZE) char blocks[];
+};
+
+/* each class's blocks add up to SLAB_BLOCKS * SLAB_MIN_BLOCK * 4^c
+   bytes, and 1 + 4 + ... + 4^(n-1) is (4^n - 1) / 3 */
+#define SLAB_SIZE (sizeof(struct slab) + (size_t)SLAB_BLOCKS *		\
+		   SLAB_MIN_BLOCK * (((size_t)1 << (2 * SLAB_CLASSES)) - 1) / 3)
+
+_Static_assert(SLAB_CACHE >= 2 && SLAB_CACHE % 2 == 0,
+	       "SLAB_CACHE must be even and at least 2");
+_Static_assert(SLAB_MIN_BLOCK % CACHE_LINE_SIZE == 0,
+	       "SLAB_MIN_BLOCK must be a multiple of CACHE_LINE_SIZE");
+
+struct slab_cache {
+  unsigned count[SLAB_CLASSES];
+  uint32_t blocks[SLAB_CLASSES][SLAB_CACHE];
+};
+
+static inline uint64_t slab_class_size(int c) {
+
+  return (uint64_t)SLAB_MIN_BLOCK << (2 * c);
+}
+
+/* set up a slab of SLAB_SIZE bytes, with every block free */
+static inline void slab_init(struct slab *s) {
+  struct slab_class *k;
+  uint64_t offset = offsetof(struct slab, blocks);
+  int c;
+  uint32_t b;
+
+  for (c=0; c<SLAB_CLASSES; c++) {
+    k = &s->classes[c];
+    k->block_size = slab_class_size(c);
+    k->offset = offset;
+    offset += SLAB_BLOCKS * k->block_size;
+    /* block b sits on block b+1, so block 0 is on top */
+    for (b=0; b<SLAB_BLOCKS; b++) {
+      atomic_init(&k->next[b], b + 1 < SLAB_BLOCKS ? b + 2 : 0);
+    }
+    atomic_init(&k->head, 1);
+  }
+}
+
+static inline void slab_cache_init(struct slab_cache *cache) {
+  int c;
+
+  for (c=0; c<SLAB_CLASSES; c++) {
+    cache->count[c] = 0;
+  }
+}
+
+/* pop a block off class k's free list: its index, or -1 if it is empty */
+static inline int64_t slab_pop(struct slab_class *k) {
+  uint64_t head, top, next;
+
+  head = atomic_load_explicit(&k->head, memory_order_acquire);
+  do {
+    top = head & UINT32_MAX;
+    if (top == 0) return -1;
+    next = atomic_load_explicit(&k->next[top - 1], memory_order_relaxed);
+    /* a new tag, so that this fails if top was popped and pushed back
+       since head was read, even though head would point at it again */
+  } while (!atomic_compare_exchange_weak_explicit(&k->head, &head,
+						  ((head >> 32) + 1) << 32 |
+						  next, memory_order_acquire,
+						  memory_order_acquire));
+  return (int64_t)(top - 1);
+}
+
+/* push n blocks onto class k's free list at once */
+static inline void slab_push(struct slab_class *k, uint32_t *blocks,
+			     unsigned n) {
+  uint64_t head;
+  unsigned i;
+
+  /* chain them together first, where nobody else can see them */
+  for (i=0; i+1<n; i++) {
+    atomic_store_explicit(&k->next[blocks[i]], blocks[i + 1] + 1,
+			  memory_order_relaxed);
+  }
+  head = atomic_load_explicit(&k->head, memory_order_relaxed);
+  do {
+    atomic_store_explicit(&k->next[blocks[n - 1]], head & UINT32_MAX,
+			  memory_order_relaxed);
+  } while (!atomic_compare_exchange_weak_explicit(&k->head, &head,
+						  ((head >> 32) + 1) << 32 |
+						  (blocks[0] + 1),
+						  memory_order_release,
+						  memory_order_relaxed));
+}
+
+/* a block of at least size bytes, or SLAB_NONE if size is too big for
+   any class or every block of its class is in use */
+static inline slab_handle slab_alloc(struct slab *s, struct slab_cache *cache,
+				     size_t size) {
+  struct slab_class *k;
+  int64_t b;
+  int c;
+
+  for (c=0; c<SLAB_CLASSES && slab_class_size(c) < size; c++);
+  if (c == SLAB_CLASSES) return SLAB_NONE;
+  k = &s->classes[c];
+
+  /* refill the cache half way if it is empty */
+  if (cache->count[c] == 0) {
+    while (cache->count[c] < SLAB_CACHE / 2 && (b = slab_pop(k)) != -1) {
+      cache->blocks[c][cache->count[c]++] = (uint32_t)b;
+    }
+    if (cache->count[c] == 0) return SLAB_NONE;
+  }
+  b = cache->blocks[c][--cache->count[c]];
+  return k->offset + (uint64_t)b * k->block_size;
+}
+
+static inline void *slab_ptr(struct slab *s, slab_handle h) {
+
+  return (char *)s + h;
+}
+
+/* the class a handle's block is in */
+static inline int slab_class_of(struct slab *s, slab_handle h) {
+  int c;
+
+  for (c=SLAB_CLASSES-1; c>0 && h<s->classes[c].offset; c--);
+  return c;
+}
+
+/* the size of a handle's block, which may be more than was asked for */
+static inline size_t slab_block_size(struct slab *s, slab_handle h) {
+
+  return s->classes[slab_class_of(s, h)].block_size;
+}
+
+static inline void slab_free(struct slab *s, struct slab_cache *cache,
+			     slab_handle h) {
+  struct slab_class *k;
+  int c = slab_class_of(s, h);
+
+  k = &s->classes[c];
+  /* give half back if the cache is full */
+  if (cache->count[c] == SLAB_CACHE) {
+    cache->count[c] -= SLAB_CACHE / 2;
+    slab_push(k, &cache->blocks[c][cache->count[c]], SLAB_CACHE / 2);
+  }
+  cache->blocks[c][cache->count[c]++] =
+    (uint32_t)((h - k->offset) / k->block_size);
+}
+
+/* give every block in the cache back, before the process exits */
+static inline void slab_cache_flush(struct slab *s, struct slab_cache *cache) {
+  int c;
+
+  for (c=0; c<SLAB_CLASSES; c++) {
+    if (cache->count[c] > 0) {
+      slab_push(&s->classes[c], cache->blocks[c], cache->count[c]);
+      cache->count[c] = 0;
+    }
+  }
+}
+
+#endif
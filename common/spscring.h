@@ -0,0 +1,139 @@
+/*
+  Single-producer/single-consumer ring with a batch (span) interface
+
+  The same lock-free ring as prodcons-pthreads-spsc.c (64-bit
+  ever-increasing in and out, release/acquire ordering, in and out on
+  separate cache lines, the producer caching the consumer's index), but
+  instead of moving one item per synchronization, each side works on
+  as many slots at once as it can:
+
+  - the producer asks spsc_reserve for up to max free slots and gets
+    back a span of contiguous writable slots.  Since the free slots may
+    wrap around the end of the buffer, a span is really two pieces,
+    first and second (second_len is 0 when there was no wrap).  The
+    producer writes its items directly into the span, then makes them
+    all visible to the consumer with a single spsc_commit.
+
+  - the consumer asks spsc_peek for everything that is currently in
+    the buffer, again as a two-piece span, uses the items where they
+    sit, then gives all of the slots back with a single spsc_release.
+
+  Each reserve/commit or peek/release pair costs at most one read of
+  the other side's cache line and one release store, however many
+  items it covers.
+
+  Everything is stored inside the struct, with no pointers, so a ring
+  can be placed in memory shared between processes.  Allocate
+  spsc_ring_size(capacity) bytes (cache line aligned) and call
+  spsc_ring_init.  capacity must be a power of two.
+*/
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+struct spsc_span {
+  int *first;
+  unsigned first_len;
+  int *second;
+  unsigned second_len;
+};
+
+struct spsc_ring {
+  /* written only by the producer */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t in;
+  uint64_t out_cache;
+  /* written only by the consumer */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t out;
+  /* read-only after spsc_ring_init */
+  _Alignas(CACHE_LINE_SIZE) uint64_t mask;
+  _Alignas(CACHE_LINE_SIZE) int slots[];
+};
+
+/* bytes needed for a ring of capacity slots, rounded up to a whole
+   number of cache lines */
+static inline size_t spsc_ring_size(unsigned capacity) {
+  size_t size = sizeof(struct spsc_ring) + capacity * sizeof(int);
+
+  return (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+/* returns 0 on success, -1 if capacity is not a power of two */
+static inline int spsc_ring_init(struct spsc_ring *r, unsigned capacity) {
+
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) return -1;
+  atomic_init(&r->in, 0);
+  atomic_init(&r->out, 0);
+  r->out_cache = 0;
+  r->mask = capacity - 1;
+  return 0;
+}
+
+/* slot index of a pointer into a span, for keeping parallel arrays */
+static inline unsigned spsc_slot(struct spsc_ring *r, int *p) {
+
+  return (unsigned)(p - r->slots);
+}
+
+/* describe n slots starting at position pos as a span */
+static inline unsigned spsc_span_at(struct spsc_ring *r, uint64_t pos,
+				    unsigned n, struct spsc_span *span) {
+  unsigned start = (unsigned)(pos & r->mask);
+  unsigned to_end = (unsigned)(r->mask + 1) - start;
+
+  span->first = &r->slots[start];
+  span->first_len = n < to_end ? n : to_end;
+  span->second = &r->slots[0];
+  span->second_len = n - span->first_len;
+  return n;
+}
+
+/* producer: get up to max free slots, returns how many (0 if full) */
+static inline unsigned spsc_reserve(struct spsc_ring *r, unsigned max,
+				    struct spsc_span *span) {
+  uint64_t in = atomic_load_explicit(&r->in, memory_order_relaxed);
+  uint64_t capacity = r->mask + 1;
+  uint64_t free_slots = capacity - (in - r->out_cache);
+
+  /* only look at the consumer's line if our cached copy of out does
+     not already show enough room */
+  if (free_slots < max) {
+    r->out_cache = atomic_load_explicit(&r->out, memory_order_acquire);
+    free_slots = capacity - (in - r->out_cache);
+  }
+  if (free_slots > max) free_slots = max;
+  return spsc_span_at(r, in, (unsigned)free_slots, span);
+}
+
+/* producer: make the first n reserved slots visible to the consumer */
+static inline void spsc_commit(struct spsc_ring *r, unsigned n) {
+  uint64_t in = atomic_load_explicit(&r->in, memory_order_relaxed);
+
+  atomic_store_explicit(&r->in, in + n, memory_order_release);
+}
+
+/* consumer: get every item in the ring, returns how many (0 if empty) */
+static inline unsigned spsc_peek(struct spsc_ring *r,
+				 struct spsc_span *span) {
+  uint64_t out = atomic_load_explicit(&r->out, memory_order_relaxed);
+  /* we want everything that has accumulated, so always look at in */
+  uint64_t in = atomic_load_explicit(&r->in, memory_order_acquire);
+
+  return spsc_span_at(r, out, (unsigned)(in - out), span);
+}
+
+/* consumer: give the first n peeked slots back to the producer */
+static inline void spsc_release(struct spsc_ring *r, unsigned n) {
+  uint64_t out = atomic_load_explicit(&r->out, memory_order_relaxed);
+
+  atomic_store_explicit(&r->out, out + n, memory_order_release);
+}
+
+#endif
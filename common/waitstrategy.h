@@ -0,0 +1,231 @@
+/*
+  How a producer or consumer waits for the buffer to change
+
+  The examples wait for an open slot or an item by checking a
+  condition over and over.  What to do between checks is a trade-off
+  between reacting quickly and not wasting the CPU, so instead of
+  wiring one answer into each loop, the loops call wait_pause and the
+  policy is picked when the program starts, from the WAIT_POLICY
+  environment variable:
+
+    spin      check again right away (lowest latency, burns a CPU)
+    backoff   execute the CPU's pause instruction between checks,
+              twice as many times after each failed check, up to
+              WAIT_BACKOFF_MAX, to take pressure off the shared cache
+              line (and off the other hyperthread)
+    yield     pause WAIT_SPIN_LIMIT times, then sched_yield between
+              checks so other runnable threads get the CPU
+    park      pause WAIT_SPIN_LIMIT times, then go to sleep in the
+              kernel (futex) until the other side says something
+              changed (lowest CPU use, costs a system call on each
+              side when it happens)
+
+  A wait loop looks like
+
+    spin = 0;
+    while (buffer is full) {
+      wait_pause(&w, spin++);
+    }
+    wait_done(&w);
+
+  where w is a struct waiter set up once with wait_init.  Parking needs
+  somewhere to sleep and someone to wake the sleeper: that is a struct
+  wait_queue, which must be visible to both sides (in shared memory for
+  processes), and the side that makes the condition true calls
+  wait_notify on it right after.  wait_notify only makes a system call
+  when someone is actually asleep, and with any policy other than park
+  it does nothing at all.
+
+  Each waiter counts what it did, and wait_report prints the counts
+  to stderr.
+*/
+
+#ifndef WAITSTRATEGY_H
+#define WAITSTRATEGY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* pauses before yield and park give up the CPU */
+#ifndef WAIT_SPIN_LIMIT
+#define WAIT_SPIN_LIMIT 1000
+#endif
+/* most pauses between two checks with backoff */
+#ifndef WAIT_BACKOFF_MAX
+#define WAIT_BACKOFF_MAX 1024
+#endif
+
+/* tell the processor we are in a spin loop */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+enum wait_policy { WAIT_SPIN, WAIT_BACKOFF, WAIT_YIELD, WAIT_PARK };
+
+static const char *const wait_policy_names[] = {
+  "spin", "backoff", "yield", "park"
+};
+
+struct wait_queue {
+  /* bumped by wait_notify when there are sleepers, and slept on */
+  _Atomic uint32_t seq;
+  /* how many are (about to be) asleep */
+  _Atomic uint32_t waiters;
+  /* whether anyone will ever park here */
+  int parking;
+};
+
+struct wait_stats {
+  long waits;			/* times the condition was not true at once */
+  long checks;			/* times it was found not true */
+  long pauses;			/* pause instructions executed */
+  long yields;
+  long parks;
+};
+
+struct waiter {
+  enum wait_policy policy;
+  struct wait_queue *queue;
+  struct wait_stats stats;
+  /* set up to park: counted in queue->waiters, and the seq we saw */
+  int registered;
+  uint32_t ticket;
+};
+
+/* the policy named by WAIT_POLICY, or dflt if it is not set */
+static inline enum wait_policy wait_policy_get(enum wait_policy dflt) {
+  char *name = getenv("WAIT_POLICY");
+  int p;
+
+  if (name == NULL || name[0] == '\0') return dflt;
+  for (p=WAIT_SPIN; p<=WAIT_PARK; p++) {
+    if (strcmp(name, wait_policy_names[p]) == 0) return (enum wait_policy)p;
+  }
+  fprintf(stderr, "unknown WAIT_POLICY %s, using %s\n", name,
+	  wait_policy_names[dflt]);
+  return dflt;
+}
+
+static inline void wait_queue_init(struct wait_queue *q,
+				   enum wait_policy policy) {
+
+  atomic_init(&q->seq, 0);
+  atomic_init(&q->waiters, 0);
+  q->parking = (policy == WAIT_PARK);
+}
+
+static inline void wait_init(struct waiter *w, enum wait_policy policy,
+			     struct wait_queue *q) {
+
+  w->policy = policy;
+  w->queue = q;
+  w->registered = 0;
+  memset(&w->stats, 0, sizeof(struct wait_stats));
+}
+
+/* we do not use the _PRIVATE futex operations since the queue may be
+   shared between processes */
+static inline void wait_futex(_Atomic uint32_t *word, uint32_t val) {
+
+  syscall(SYS_futex, word, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+/* call after making true a condition that someone may be parked on.
+   The fence keeps the load of waiters from being done before the store
+   that made the condition true, which pairs with the one in
+   wait_pause: either we see the waiter, or it sees the condition */
+static inline void wait_notify(struct wait_queue *q) {
+
+  if (!q->parking) return;
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&q->waiters, memory_order_relaxed) > 0) {
+    atomic_fetch_add(&q->seq, 1);
+    syscall(SYS_futex, &q->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+/* the condition was checked and found false for the n+1st time in
+   this wait (n counting from 0): wait a bit before the next check */
+static inline void wait_pause(struct waiter *w, long n) {
+  long k;
+
+  w->stats.checks++;
+  if (n == 0) w->stats.waits++;
+
+  switch (w->policy) {
+  case WAIT_SPIN:
+    break;
+
+  case WAIT_BACKOFF:
+    k = n < 10 ? 1L << n : WAIT_BACKOFF_MAX;
+    if (k > WAIT_BACKOFF_MAX) k = WAIT_BACKOFF_MAX;
+    w->stats.pauses += k;
+    while (k-- > 0) cpu_relax();
+    break;
+
+  case WAIT_YIELD:
+    if (n < WAIT_SPIN_LIMIT) {
+      cpu_relax();
+      w->stats.pauses++;
+    }
+    else {
+      sched_yield();
+      w->stats.yields++;
+    }
+    break;
+
+  case WAIT_PARK:
+    if (n < WAIT_SPIN_LIMIT) {
+      cpu_relax();
+      w->stats.pauses++;
+    }
+    else if (!w->registered) {
+      /* say we are going to sleep and note the seq, then let the
+	 caller check the condition once more before we actually do:
+	 any wait_notify after that check changes seq, and FUTEX_WAIT
+	 will not sleep if seq is no longer what we saw */
+      atomic_fetch_add(&w->queue->waiters, 1);
+      atomic_thread_fence(memory_order_seq_cst);
+      w->ticket = atomic_load(&w->queue->seq);
+      w->registered = 1;
+    }
+    else {
+      wait_futex(&w->queue->seq, w->ticket);
+      w->stats.parks++;
+      w->ticket = atomic_load(&w->queue->seq);
+    }
+    break;
+  }
+}
+
+/* the condition is true now */
+static inline void wait_done(struct waiter *w) {
+
+  if (w->registered) {
+    atomic_fetch_sub(&w->queue->waiters, 1);
+    w->registered = 0;
+  }
+}
+
+/* print what a waiter did */
+static inline void wait_report(const char *who, struct waiter *w) {
+  struct wait_stats *s = &w->stats;
+
+  fprintf(stderr, "%s: %s waits: %ld, checks: %ld, pauses: %ld, "
+	  "yields: %ld, parks: %ld\n", who, wait_policy_names[w->policy],
+	  s->waits, s->checks, s->pauses, s->yields, s->parks);
+}
+
+#endif
@@ -0,0 +1,453 @@
+/*
+  Bounded buffer with the synchronization picked at compile time
+
+  prodcons-pthreads-counter, -counter-cs, -counter-sem, -counter-mutex
+  and -counter-condvar are the same producer and consumer around the
+  same buffer, and differ only in how they keep track of how full it
+  is.  Here that difference is a policy, and
+
+    BOUNDED_BUFFER(name, type, capacity, policy)
+
+  defines a buffer of capacity items of type, kept full or empty by
+  policy, as struct name with
+
+    void name_init(struct name *b, enum wait_policy wait)
+    void name_put(struct name *b, type value, struct waiter *w)
+    type name_get(struct name *b, struct waiter *w)
+    void name_destroy(struct name *b)
+
+  for one producer thread (put) and one consumer thread (get).  put and
+  get copy the item in and out, which is fine for an int but not for
+  an item that owns memory or is too big to copy twice, so the slots
+  can also be used where they are:
+
+    type *name_emplace(struct name *b, struct waiter *w)
+    void name_commit(struct name *b)
+    type *name_consume(struct name *b, struct waiter *w)
+    void name_release(struct name *b)
+
+  name_emplace waits for room and returns the next slot, for the
+  producer to build the item in, and name_commit hands it over.
+  name_consume waits for an item and returns its slot, for the consumer
+  to use the item there or take what it owns out of it, and
+  name_release gives the slot back.  In between, the slot belongs to
+  the caller alone, and nothing is copied but what the caller copies.
+  With bb_condvar the mutex is held from one to the other, so whatever
+  is done in the slot should be quick.
+
+    BOUNDED_BUFFER_DTOR(name, type, capacity, policy, dtor)
+
+  is the same, but with void dtor(type *item) called by name_destroy
+  on each item still in the buffer, to free what it owns.  Nothing may
+  be using the buffer by then.
+
+  The waiter is what the producer or consumer waits with when the
+  policy makes it busy-wait, set up with wait_init on the buffer's
+  not_full or not_empty (see waitstrategy.h).
+
+  capacity must be a power of two, and is checked at compile time, so
+  the slot is always in or out masked with a constant, never a %.
+  Everything is static inline and the policy is a name pasted into
+  the calls, not a function pointer, so with optimization on a put or
+  get compiles down to the policy's own code with nothing in between.
+
+  The policies, each a struct and four functions named after it:
+
+    bb_spin      a plain counter, with nothing to stop the producer's
+                 counter++ and the consumer's counter-- from losing
+                 updates (like prodcons-pthreads-counter, so it may
+                 never finish)
+    bb_peterson  the counter guarded by Peterson's lock, with the
+                 fences it needs, for exactly these two threads
+    bb_sem       counting semaphores of empty and full slots, which
+                 the producer and consumer block on
+    bb_condvar   the counter under a mutex, with condition variables
+                 to block on (like prodcons-pthreads-counter-condvar)
+    bb_lockfree  an atomic counter: the release of each increment or
+                 decrement hands the slot over, and nothing locks
+
+  bb_P_wait_room returns once there is room for an item (bb_condvar
+  holding its mutex), bb_P_added counts the item in (and lets go), and
+  bb_P_wait_item and bb_P_removed do the same for the consumer.  A new
+  policy is a struct bb_P and those four, plus bb_P_init and
+  bb_P_destroy.
+*/
+
+#ifndef BOUNDEDBUF_H
+#define BOUNDEDBUF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "bench.h"
+#include "waitstrategy.h"
+
+/* nothing but a counter.  volatile, so that the wait loops read it
+   every time even with optimization on, but still not atomic */
+struct bb_spin {
+  volatile int counter;
+};
+
+static inline void bb_spin_init(struct bb_spin *s, unsigned capacity) {
+
+  s->counter = 0;
+}
+
+static inline void bb_spin_destroy(struct bb_spin *s) {
+}
+
+static inline void bb_spin_wait_room(struct bb_spin *s, unsigned capacity,
+				     struct waiter *w) {
+  long spin = 0;
+
+  while (s->counter == capacity) {
+    wait_pause(w, spin++);
+  }
+  wait_done(w);
+}
+
+static inline void bb_spin_added(struct bb_spin *s) {
+
+  s->counter++;
+}
+
+static inline void bb_spin_wait_item(struct bb_spin *s, struct waiter *w) {
+  long spin = 0;
+
+  while (s->counter == 0) {
+    wait_pause(w, spin++);
+  }
+  wait_done(w);
+}
+
+static inline void bb_spin_removed(struct bb_spin *s) {
+
+  s->counter--;
+}
+
+/* the counter, guarded by Peterson's lock: the producer is thread 0
+   and the consumer thread 1.  The seq_cst atomics keep each thread's
+   store of its flag from being ordered after its load of the other's,
+   which the lock does not work without */
+struct bb_peterson {
+  volatile int counter;
+  atomic_int flag[2];
+  atomic_int turn;
+};
+
+static inline void bb_peterson_init(struct bb_peterson *s,
+				    unsigned capacity) {
+
+  s->counter = 0;
+  atomic_init(&s->flag[0], 0);
+  atomic_init(&s->flag[1], 0);
+  atomic_init(&s->turn, 0);
+}
+
+static inline void bb_peterson_destroy(struct bb_peterson *s) {
+}
+
+static inline void bb_peterson_lock(struct bb_peterson *s, int me) {
+  long spin = 0;
+
+  atomic_store(&s->flag[me], 1);
+  atomic_store(&s->turn, 1 - me);
+  while (atomic_load(&s->flag[1 - me]) && atomic_load(&s->turn) == 1 - me) {
+    /* the other thread may be off the CPU holding the lock */
+    if (spin++ < WAIT_SPIN_LIMIT) cpu_relax();
+    else sched_yield();
+  }
+}
+
+static inline void bb_peterson_unlock(struct bb_peterson *s, int me) {
+
+  atomic_store(&s->flag[me], 0);
+}
+
+static inline void bb_peterson_wait_room(struct bb_peterson *s,
+					 unsigned capacity,
+					 struct waiter *w) {
+  long spin = 0;
+
+  while (s->counter == capacity) {
+    wait_pause(w, spin++);
+  }
+  wait_done(w);
+}
+
+static inline void bb_peterson_added(struct bb_peterson *s) {
+
+  bb_peterson_lock(s, 0);
+  s->counter++;
+  bb_peterson_unlock(s, 0);
+}
+
+static inline void bb_peterson_wait_item(struct bb_peterson *s,
+					 struct waiter *w) {
+  long spin = 0;
+
+  while (s->counter == 0) {
+    wait_pause(w, spin++);
+  }
+  wait_done(w);
+}
+
+static inline void bb_peterson_removed(struct bb_peterson *s) {
+
+  bb_peterson_lock(s, 1);
+  s->counter--;
+  bb_peterson_unlock(s, 1);
+}
+
+/* empty and full slots as counting semaphores: nobody busy-waits, so
+   the waiters go unused */
+struct bb_sem {
+  sem_t empty_slots;
+  sem_t full_slots;
+};
+
+static inline void bb_sem_init(struct bb_sem *s, unsigned capacity) {
+
+  if (sem_init(&s->empty_slots, 0, capacity) == -1 ||
+      sem_init(&s->full_slots, 0, 0) == -1) {
+    perror("sem_init");
+    exit(1);
+  }
+}
+
+static inline void bb_sem_destroy(struct bb_sem *s) {
+
+  sem_destroy(&s->empty_slots);
+  sem_destroy(&s->full_slots);
+}
+
+static inline void bb_sem_wait_room(struct bb_sem *s, unsigned capacity,
+				    struct waiter *w) {
+
+  while (sem_wait(&s->empty_slots) == -1) {
+    perror("sem_wait (empty_slots)");
+  }
+}
+
+static inline void bb_sem_added(struct bb_sem *s) {
+
+  sem_post(&s->full_slots);
+}
+
+static inline void bb_sem_wait_item(struct bb_sem *s, struct waiter *w) {
+
+  while (sem_wait(&s->full_slots) == -1) {
+    perror("sem_wait (full_slots)");
+  }
+}
+
+static inline void bb_sem_removed(struct bb_sem *s) {
+
+  sem_post(&s->empty_slots);
+}
+
+/* the counter under a mutex, and condition variables to sleep on until
+   it changes: the mutex is held from wait_room or wait_item to added
+   or removed, slot and all */
+struct bb_condvar {
+  int counter;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_full;
+  pthread_cond_t not_empty;
+};
+
+static inline void bb_condvar_init(struct bb_condvar *s, unsigned capacity) {
+
+  s->counter = 0;
+  if (pthread_mutex_init(&s->mutex, NULL) != 0 ||
+      pthread_cond_init(&s->not_full, NULL) != 0 ||
+      pthread_cond_init(&s->not_empty, NULL) != 0) {
+    fprintf(stderr, "bb_condvar: cannot initialize the mutex\n");
+    exit(1);
+  }
+}
+
+static inline void bb_condvar_destroy(struct bb_condvar *s) {
+
+  pthread_mutex_destroy(&s->mutex);
+  pthread_cond_destroy(&s->not_full);
+  pthread_cond_destroy(&s->not_empty);
+}
+
+static inline void bb_condvar_wait_room(struct bb_condvar *s,
+					unsigned capacity,
+					struct waiter *w) {
+
+  pthread_mutex_lock(&s->mutex);
+  /* a while, not an if: pthread_cond_wait may wake up spuriously */
+  while (s->counter == capacity) {
+    pthread_cond_wait(&s->not_full, &s->mutex);
+  }
+}
+
+static inline void bb_condvar_added(struct bb_condvar *s) {
+
+  s->counter++;
+  pthread_cond_signal(&s->not_empty);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static inline void bb_condvar_wait_item(struct bb_condvar *s,
+					struct waiter *w) {
+
+  pthread_mutex_lock(&s->mutex);
+  while (s->counter == 0) {
+    pthread_cond_wait(&s->not_empty, &s->mutex);
+  }
+}
+
+static inline void bb_condvar_removed(struct bb_condvar *s) {
+
+  s->counter--;
+  pthread_cond_signal(&s->not_full);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+/* an atomic counter: the producer's release increment publishes the
+   slot it wrote, and the consumer's release decrement gives the slot it
+   read back */
+struct bb_lockfree {
+  atomic_uint counter;
+};
+
+static inline void bb_lockfree_init(struct bb_lockfree *s,
+				    unsigned capacity) {
+
+  atomic_init(&s->counter, 0);
+}
+
+static inline void bb_lockfree_destroy(struct bb_lockfree *s) {
+}
+
+static inline void bb_lockfree_wait_room(struct bb_lockfree *s,
+					 unsigned capacity,
+					 struct waiter *w) {
+  long spin = 0;
+
+  while (atomic_load_explicit(&s->counter, memory_order_acquire) ==
+	 capacity) {
+    wait_pause(w, spin++);
+  }
+  wait_done(w);
+}
+
+static inline void bb_lockfree_added(struct bb_lockfree *s) {
+
+  atomic_fetch_add_explicit(&s->counter, 1, memory_order_release);
+}
+
+static inline void bb_lockfree_wait_item(struct bb_lockfree *s,
+					 struct waiter *w) {
+  long spin = 0;
+
+  while (atomic_load_explicit(&s->counter, memory_order_acquire) == 0) {
+    wait_pause(w, spin++);
+  }
+  wait_done(w);
+}
+
+static inline void bb_lockfree_removed(struct bb_lockfree *s) {
+
+  atomic_fetch_sub_explicit(&s->counter, 1, memory_order_release);
+}
+
+/* the buffer itself.  in is only touched by the producer and out only
+   by the consumer, so neither needs any synchronization of its own:
+   the policy's counter (or semaphores) is all they share.  The extra
+   level lets the arguments be macros themselves (-DBB_POLICY=...),
+   which ## would otherwise paste without expanding */
+#define BOUNDED_BUFFER(name, type, capacity, policy)			\
+  BOUNDED_BUFFER_DEFINE(name, type, capacity, policy, bb_no_dtor)
+
+#define BOUNDED_BUFFER_DTOR(name, type, capacity, policy, dtor)		\
+  BOUNDED_BUFFER_DEFINE(name, type, capacity, policy, dtor)
+
+/* for items that own nothing: only ever named, never called */
+#define bb_no_dtor(item) ((void)0)
+
+#define BOUNDED_BUFFER_DEFINE(name, type, capacity, policy, dtor)	\
+  _Static_assert((capacity) > 0 && ((capacity) & ((capacity) - 1)) == 0, \
+		 #name "'s capacity must be a power of two");		\
+									\
+  struct name {								\
+    type slots[capacity];						\
+    BENCH_STAMPS(stamp, capacity)					\
+    unsigned in;							\
+    unsigned out;							\
+    struct policy sync;							\
+    struct wait_queue not_full;						\
+    struct wait_queue not_empty;					\
+  };									\
+									\
+  static inline void name##_init(struct name *b, enum wait_policy wait) { \
+									\
+    b->in = 0;								\
+    b->out = 0;								\
+    policy##_init(&b->sync, (capacity));				\
+    wait_queue_init(&b->not_full, wait);				\
+    wait_queue_init(&b->not_empty, wait);				\
+  }									\
+									\
+  static inline type *name##_emplace(struct name *b, struct waiter *w) { \
+									\
+    policy##_wait_room(&b->sync, (capacity), w);			\
+    return &b->slots[b->in & ((capacity) - 1)];				\
+  }									\
+									\
+  static inline void name##_commit(struct name *b) {			\
+									\
+    BENCH_ENQUEUED(b->stamp[b->in & ((capacity) - 1)]);			\
+    b->in++;								\
+    policy##_added(&b->sync);						\
+    wait_notify(&b->not_empty);						\
+  }									\
+									\
+  static inline type *name##_consume(struct name *b, struct waiter *w) { \
+									\
+    policy##_wait_item(&b->sync, w);					\
+    return &b->slots[b->out & ((capacity) - 1)];			\
+  }									\
+									\
+  static inline void name##_release(struct name *b) {			\
+									\
+    BENCH_DEQUEUED(b->stamp[b->out & ((capacity) - 1)]);		\
+    b->out++;								\
+    policy##_removed(&b->sync);						\
+    wait_notify(&b->not_full);						\
+  }									\
+									\
+  static inline void name##_put(struct name *b, type value,		\
+				struct waiter *w) {			\
+									\
+    *name##_emplace(b, w) = value;					\
+    name##_commit(b);							\
+  }									\
+									\
+  static inline type name##_get(struct name *b, struct waiter *w) {	\
+    type value;								\
+									\
+    value = *name##_consume(b, w);					\
+    name##_release(b);							\
+    return value;							\
+  }									\
+									\
+  /* with the producer and consumer gone, so in and out are settled */	\
+  static inline void name##_destroy(struct name *b) {			\
+    unsigned pos;							\
+									\
+    for (pos = b->out; pos != b->in; pos++) {				\
+      dtor(&b->slots[pos & ((capacity) - 1)]);				\
+    }									\
+    policy##_destroy(&b->sync);						\
+  }
+
+#endif
@@ -0,0 +1,371 @@
+/*
+  Stackless coroutines on a pool of worker threads
+
+  A producer or consumer that is a thread of its own costs a stack and
+  a kernel thread, and a context switch every time it waits, which is
+  fine for two of them and not for ten thousand.  A coroutine here is
+  just a struct: a function that can return in the middle and later be
+  called again to carry on where it left off, so any number of them can
+  take turns on a few threads.  When a coroutine cannot push an item
+  because the queue is full, or pop one because it is empty, it does
+  not block its thread: it returns, the thread goes on to run another
+  coroutine, and the coroutine is only run again once there is room or
+  an item for it.
+
+  The coroutines are protothreads: CORO_BEGIN is a switch on where the
+  coroutine last stopped, and each place it can stop is a case label
+  (its line number), so
+
+    - a coroutine's local variables do not survive it stopping: keep
+      anything it needs across a CORO_PUSH, CORO_POP or CORO_YIELD in
+      a struct that starts with the struct coro, and cast
+    - the coroutine's function may not use a switch of its own around
+      those, nor put two of them on the same line
+
+  Use:
+
+    struct producer { struct coro co; int i; };
+
+    int producer(struct coro *c) {
+      struct producer *p = (struct producer *)c;
+
+      CORO_BEGIN(c);
+      for (p->i = 0; p->i < 100; p->i++) {
+        CORO_PUSH(c, &queue, p->i);
+      }
+      CORO_END(c);
+    }
+
+    coro_sched_init(&s, workers);
+    coro_queue_init(&queue, capacity);
+    coro_spawn(&s, &p.co, producer);   ... and any others
+    coro_sched_run(&s);                returns when all are done
+    coro_queue_destroy(&queue);
+    coro_sched_destroy(&s);
+
+  CORO_PUSH(c, q, value) waits until q has room and puts value in it,
+  evaluating value again each time it tries, and CORO_POP(c, q, item)
+  waits until q has an item and takes it into item, which must outlive
+  the coroutine stopping too.  CORO_YIELD lets other coroutines run.
+
+  The scheduler keeps a run queue of coroutines ready to run, which
+  its workers take them from.  A coroutine that has to wait returns
+  CORO_WAIT and says what for, and the worker that ran it puts it on
+  the queue's list of coroutines waiting for room or for an item,
+  after checking under the queue's lock that it still has to wait, so
+  that it cannot miss the push or pop that would wake it and cannot
+  be woken while it is still running.  Each push that finds a
+  coroutine waiting for an item moves one to the run queue, and each
+  pop does the same for one waiting for room.
+
+  A coroutine is only ever run by one worker at a time, but the
+  workers run different coroutines at once, so anything coroutines
+  share besides the queues needs its own synchronization.  If every
+  coroutine left is waiting, coro_sched_run never returns.  Workers
+  are pinned, if PLACE_CONSUMER_CPUS is set, in order (see
+  placement.h).
+*/
+
+#ifndef CORO_H
+#define CORO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "placement.h"
+
+/* what a coroutine's function returns */
+#define CORO_DONE 0
+#define CORO_YIELDED 1
+#define CORO_WAIT 2
+
+/* what a waiting coroutine is waiting for */
+#define CORO_ROOM 0
+#define CORO_ITEM 1
+
+struct coro;
+struct coro_queue;
+struct coro_sched;
+
+typedef int (*coro_func)(struct coro *c);
+
+struct coro {
+  /* where to carry on from, 0 to start, -1 once done */
+  int line;
+  coro_func func;
+  struct coro_sched *sched;
+  /* on the run queue or a waiting list */
+  struct coro *next;
+  /* when it returns CORO_WAIT, what for and on which queue */
+  struct coro_queue *wait_queue;
+  int wait_for;
+};
+
+#define CORO_BEGIN(c) switch ((c)->line) { case 0:
+
+#define CORO_END(c) } (c)->line = -1; return CORO_DONE
+
+#define CORO_YIELD(c)							\
+  do {									\
+    (c)->line = __LINE__;						\
+    return CORO_YIELDED;						\
+  case __LINE__:;							\
+  } while (0)
+
+#define CORO_PUSH(c, q, value)						\
+  do {									\
+    (c)->line = __LINE__;						\
+  case __LINE__:							\
+    if (!coro_queue_try_push((q), (value))) {				\
+      (c)->wait_queue = (q);						\
+      (c)->wait_for = CORO_ROOM;					\
+      return CORO_WAIT;							\
+    }									\
+  } while (0)
+
+#define CORO_POP(c, q, item)						\
+  do {									\
+    (c)->line = __LINE__;						\
+  case __LINE__:							\
+    if (!coro_queue_try_pop((q), &(item))) {				\
+      (c)->wait_queue = (q);						\
+      (c)->wait_for = CORO_ITEM;					\
+      return CORO_WAIT;							\
+    }									\
+  } while (0)
+
+/* a list of coroutines, in the order they were added */
+struct coro_list {
+  struct coro *head;
+  struct coro *tail;
+};
+
+static inline void coro_list_add(struct coro_list *l, struct coro *c) {
+
+  c->next = NULL;
+  if (l->tail == NULL) l->head = c;
+  else l->tail->next = c;
+  l->tail = c;
+}
+
+static inline struct coro *coro_list_take(struct coro_list *l) {
+  struct coro *c = l->head;
+
+  if (c != NULL) {
+    l->head = c->next;
+    if (l->head == NULL) l->tail = NULL;
+  }
+  return c;
+}
+
+struct coro_sched {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct coro_list run;
+  /* coroutines spawned and not done */
+  long live;
+  int nworkers;
+  pthread_t *workers;
+};
+
+/* a bounded queue of ints, capacity a power of two */
+struct coro_queue {
+  pthread_mutex_t lock;
+  unsigned capacity;
+  unsigned in;
+  unsigned out;
+  int *items;
+  struct coro_list room_waiters;
+  struct coro_list item_waiters;
+};
+
+static inline void coro_sched_init(struct coro_sched *s, int nworkers) {
+
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->ready, NULL);
+  s->run.head = s->run.tail = NULL;
+  s->live = 0;
+  s->nworkers = nworkers;
+  s->workers = NULL;
+}
+
+/* put c on its scheduler's run queue */
+static inline void coro_ready(struct coro *c) {
+  struct coro_sched *s = c->sched;
+
+  pthread_mutex_lock(&s->lock);
+  coro_list_add(&s->run, c);
+  pthread_cond_signal(&s->ready);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* start c running func, before or during coro_sched_run */
+static inline void coro_spawn(struct coro_sched *s, struct coro *c,
+			      coro_func func) {
+
+  c->line = 0;
+  c->func = func;
+  c->sched = s;
+  pthread_mutex_lock(&s->lock);
+  s->live++;
+  pthread_mutex_unlock(&s->lock);
+  coro_ready(c);
+}
+
+/* returns 0 on success, -1 if capacity is not a power of two or there
+   is no memory for it */
+static inline int coro_queue_init(struct coro_queue *q, unsigned capacity) {
+
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) return -1;
+  q->items = (int *)malloc(capacity * sizeof(int));
+  if (q->items == NULL) return -1;
+  pthread_mutex_init(&q->lock, NULL);
+  q->capacity = capacity;
+  q->in = q->out = 0;
+  q->room_waiters.head = q->room_waiters.tail = NULL;
+  q->item_waiters.head = q->item_waiters.tail = NULL;
+  return 0;
+}
+
+static inline void coro_queue_destroy(struct coro_queue *q) {
+
+  pthread_mutex_destroy(&q->lock);
+  free(q->items);
+}
+
+/* put item in q if there is room, waking a coroutine waiting for an
+   item.  Returns 1 if it did, 0 if q is full */
+static inline int coro_queue_try_push(struct coro_queue *q, int item) {
+  struct coro *w;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->in - q->out == q->capacity) {
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+  }
+  q->items[q->in++ & (q->capacity - 1)] = item;
+  w = coro_list_take(&q->item_waiters);
+  pthread_mutex_unlock(&q->lock);
+  if (w != NULL) coro_ready(w);
+  return 1;
+}
+
+/* take an item from q into *item if there is one, waking a coroutine
+   waiting for room.  Returns 1 if it did, 0 if q is empty */
+static inline int coro_queue_try_pop(struct coro_queue *q, int *item) {
+  struct coro *w;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->in == q->out) {
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+  }
+  *item = q->items[q->out++ & (q->capacity - 1)];
+  w = coro_list_take(&q->room_waiters);
+  pthread_mutex_unlock(&q->lock);
+  if (w != NULL) coro_ready(w);
+  return 1;
+}
+
+/* c returned CORO_WAIT: put it on its queue's waiting list, unless what
+   it is waiting for has turned up since, when it can run again now */
+static inline void coro_park(struct coro *c) {
+  struct coro_queue *q = c->wait_queue;
+  int wait;
+
+  pthread_mutex_lock(&q->lock);
+  if (c->wait_for == CORO_ROOM) {
+    wait = q->in - q->out == q->capacity;
+    if (wait) coro_list_add(&q->room_waiters, c);
+  }
+  else {
+    wait = q->in == q->out;
+    if (wait) coro_list_add(&q->item_waiters, c);
+  }
+  pthread_mutex_unlock(&q->lock);
+  if (!wait) coro_ready(c);
+}
+
+struct coro_worker_arg {
+  struct coro_sched *sched;
+  int number;
+};
+
+static inline void *coro_worker(void *arg) {
+  struct coro_worker_arg *a = (struct coro_worker_arg *)arg;
+  struct coro_sched *s = a->sched;
+  struct coro *c;
+
+  place_thread(PLACE_CONSUMER, a->number);
+
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    while (s->run.head == NULL && s->live > 0) {
+      pthread_cond_wait(&s->ready, &s->lock);
+    }
+    if (s->live == 0) {
+      pthread_mutex_unlock(&s->lock);
+      break;
+    }
+    c = coro_list_take(&s->run);
+    pthread_mutex_unlock(&s->lock);
+
+    switch (c->func(c)) {
+    case CORO_YIELDED:
+      coro_ready(c);
+      break;
+    case CORO_WAIT:
+      coro_park(c);
+      break;
+    default:
+      /* the last one done lets the workers go */
+      pthread_mutex_lock(&s->lock);
+      if (--s->live == 0) pthread_cond_broadcast(&s->ready);
+      pthread_mutex_unlock(&s->lock);
+    }
+  }
+  return NULL;
+}
+
+/* run the coroutines on the workers until they are all done.  Returns
+   0, or -1 (having said why) if the workers cannot be started */
+static inline int coro_sched_run(struct coro_sched *s) {
+  struct coro_worker_arg *args;
+  int k, started;
+
+  s->workers = (pthread_t *)calloc(s->nworkers, sizeof(pthread_t));
+  args = (struct coro_worker_arg *)
+    calloc(s->nworkers, sizeof(struct coro_worker_arg));
+  if (s->workers == NULL || args == NULL) {
+    perror("calloc");
+    free(s->workers);
+    free(args);
+    s->workers = NULL;
+    return -1;
+  }
+  for (started=0; started<s->nworkers; started++) {
+    args[started].sched = s;
+    args[started].number = started;
+    if (pthread_create(&s->workers[started], NULL, coro_worker,
+		       &args[started]) != 0) {
+      fprintf(stderr, "coro: cannot create worker %d\n", started);
+      break;
+    }
+  }
+  for (k=0; k<started; k++) {
+    pthread_join(s->workers[k], NULL);
+  }
+  free(args);
+  return started == s->nworkers ? 0 : -1;
+}
+
+static inline void coro_sched_destroy(struct coro_sched *s) {
+
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->ready);
+  free(s->workers);
+  s->workers = NULL;
+}
+
+#endif
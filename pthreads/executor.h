@@ -0,0 +1,356 @@
+/*
+  Fixed-size executor: a bounded buffer of tasks and a pool of workers
+
+  The consumer in every example is the same loop: take the next item
+  out of the buffer, then work on it.  Here the items are tasks, each
+  a function and the bytes of its argument (a closure), and the loop
+  runs on each of nworkers threads, so that anything can be handed to
+  the pool to run instead of starting a thread for it.
+
+  Use:
+
+    exec_init(&e, workers, capacity);   starts the workers
+    exec_submit(&e, func, &arg, sizeof(arg), &future);
+    exec_submit_then(&e, func, &arg, sizeof(arg), done, done_arg);
+    exec_submit_bulk(&e, func, args, sizeof(args[0]), n, futures);
+    exec_future_wait(&future);
+    exec_shutdown(&e);                  runs what is queued, then stops
+    exec_destroy(&e);
+
+  A task runs func(copy, worker), where copy is a copy of the size
+  bytes of the argument made when it was submitted (so the caller's
+  own can go away at once) and worker is the number of the worker
+  running it.  Up to EXEC_INLINE bytes of argument are copied straight
+  into the task's slot in the buffer, so submitting a small closure
+  allocates nothing; only a bigger one is copied to memory from malloc,
+  which is freed after the task runs.
+
+  The buffer is a ring of capacity slots (a power of two) under a
+  mutex, with condition variables for submitters waiting for a free
+  slot and workers waiting for a task, as in
+  prodcons-pthreads-counter-condvar.  exec_submit_bulk puts as many
+  tasks as there is room for in the ring each time it takes the
+  mutex, and wakes as many workers.  A worker copies the task out of
+  its slot before running it, so the slot is free while it runs.
+
+  When a task is done, its future (if it was given one, which need not
+  be set up first) is set, waking anyone in exec_future_wait, or its
+  done function is called with done_arg on the worker's thread.
+  exec_future_wait spins for a while and then sleeps on a futex on the
+  future's state, which the worker only wakes if someone is asleep.
+  Setting the future is the last thing the worker does with it, so the
+  future can go away as soon as exec_future_wait returns.
+
+  exec_shutdown stops new tasks being submitted (exec_submit then
+  returns -1, including in threads already waiting for room), lets the
+  workers run everything already in the buffer, and waits for them to
+  finish.  Workers are pinned, if PLACE_CONSUMER_CPUS is set, in order
+  (see placement.h).
+*/
+
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "placement.h"
+#include "waitstrategy.h"
+
+/* bytes of a task's argument kept right in its slot */
+#ifndef EXEC_INLINE
+#define EXEC_INLINE 48
+#endif
+
+typedef void (*exec_func)(void *arg, int worker);
+typedef void (*exec_done_func)(void *done_arg);
+
+/* a future's state */
+#define EXEC_PENDING 0
+#define EXEC_DONE 1
+/* still pending, and someone is asleep waiting for it */
+#define EXEC_SLEEPING 2
+
+struct exec_future {
+  _Atomic uint32_t state;
+};
+
+struct exec_task {
+  exec_func func;
+  exec_done_func done;
+  void *done_arg;
+  struct exec_future *future;
+  /* the argument, if it did not fit in arg */
+  void *heap;
+  _Alignas(max_align_t) unsigned char arg[EXEC_INLINE];
+};
+
+struct exec_worker {
+  pthread_t id;
+  struct executor *exec;
+  int number;
+};
+
+struct executor {
+  pthread_mutex_t lock;
+  pthread_cond_t not_full;
+  pthread_cond_t not_empty;
+  unsigned capacity;
+  unsigned in;
+  unsigned out;
+  struct exec_task *tasks;
+  int shutdown;
+  int nworkers;
+  struct exec_worker *workers;
+};
+
+static inline void *exec_worker(void *arg) {
+  struct exec_worker *me = (struct exec_worker *)arg;
+  struct executor *e = me->exec;
+  struct exec_task t;
+
+  place_thread(PLACE_CONSUMER, me->number);
+
+  for (;;) {
+
+    /* take the next task, or stop once there are none and no more
+       are coming */
+    pthread_mutex_lock(&e->lock);
+    while (e->in == e->out && !e->shutdown) {
+      pthread_cond_wait(&e->not_empty, &e->lock);
+    }
+    if (e->in == e->out) {
+      pthread_mutex_unlock(&e->lock);
+      break;
+    }
+    t = e->tasks[e->out++ & (e->capacity - 1)];
+    pthread_cond_signal(&e->not_full);
+    pthread_mutex_unlock(&e->lock);
+
+    /* run it, and say it is done */
+    t.func(t.heap != NULL ? t.heap : t.arg, me->number);
+    free(t.heap);
+    if (t.done != NULL) t.done(t.done_arg);
+    if (t.future != NULL &&
+	atomic_exchange_explicit(&t.future->state, EXEC_DONE,
+				 memory_order_release) == EXEC_SLEEPING) {
+      syscall(SYS_futex, &t.future->state, FUTEX_WAKE, INT_MAX, NULL, NULL,
+	      0);
+    }
+  }
+  return NULL;
+}
+
+/* start nworkers workers, taking tasks from a buffer of capacity slots
+   (a power of two).  Returns 0, or -1 (having said why) if it cannot */
+static inline int exec_init(struct executor *e, int nworkers,
+			    unsigned capacity) {
+  int k;
+
+  if (nworkers < 1 || capacity == 0 || (capacity & (capacity - 1)) != 0) {
+    fprintf(stderr, "executor: need a worker and a power of two "
+	    "capacity\n");
+    return -1;
+  }
+  e->tasks = (struct exec_task *)calloc(capacity, sizeof(struct exec_task));
+  e->workers = (struct exec_worker *)
+    calloc(nworkers, sizeof(struct exec_worker));
+  if (e->tasks == NULL || e->workers == NULL) {
+    perror("calloc");
+    free(e->tasks);
+    free(e->workers);
+    return -1;
+  }
+  pthread_mutex_init(&e->lock, NULL);
+  pthread_cond_init(&e->not_full, NULL);
+  pthread_cond_init(&e->not_empty, NULL);
+  e->capacity = capacity;
+  e->in = e->out = 0;
+  e->shutdown = 0;
+
+  for (k=0; k<nworkers; k++) {
+    e->workers[k].exec = e;
+    e->workers[k].number = k;
+    if (pthread_create(&e->workers[k].id, NULL, exec_worker,
+		       &e->workers[k]) != 0) {
+      fprintf(stderr, "executor: cannot create worker %d\n", k);
+      /* let the ones that did start go */
+      e->nworkers = k;
+      pthread_mutex_lock(&e->lock);
+      e->shutdown = 1;
+      pthread_cond_broadcast(&e->not_empty);
+      pthread_mutex_unlock(&e->lock);
+      while (k-- > 0) pthread_join(e->workers[k].id, NULL);
+      free(e->tasks);
+      free(e->workers);
+      return -1;
+    }
+  }
+  e->nworkers = nworkers;
+  return 0;
+}
+
+/* fill in slot t with a task, its argument already copied to heap if
+   it was too big to go in the slot */
+static inline void exec_fill(struct exec_task *t,
+			     exec_func func, const void *arg, size_t size,
+			     void *heap, struct exec_future *future,
+			     exec_done_func done, void *done_arg) {
+
+  t->func = func;
+  t->done = done;
+  t->done_arg = done_arg;
+  t->future = future;
+  t->heap = heap;
+  if (heap == NULL && size > 0) memcpy(t->arg, arg, size);
+  if (future != NULL) atomic_init(&future->state, EXEC_PENDING);
+}
+
+/* copy an argument too big for a slot to memory from malloc, in *heap
+   (NULL if it fits).  Returns 0, or -1 (having said why) */
+static inline int exec_copy(const void *arg, size_t size, void **heap) {
+
+  *heap = NULL;
+  if (size <= EXEC_INLINE) return 0;
+  *heap = malloc(size);
+  if (*heap == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  memcpy(*heap, arg, size);
+  return 0;
+}
+
+static inline int exec_post(struct executor *e, exec_func func,
+			    const void *arg, size_t size,
+			    struct exec_future *future,
+			    exec_done_func done, void *done_arg) {
+  void *heap;
+
+  if (exec_copy(arg, size, &heap) == -1) return -1;
+  pthread_mutex_lock(&e->lock);
+  while (e->in - e->out == e->capacity && !e->shutdown) {
+    pthread_cond_wait(&e->not_full, &e->lock);
+  }
+  if (e->shutdown) {
+    pthread_mutex_unlock(&e->lock);
+    free(heap);
+    return -1;
+  }
+  exec_fill(&e->tasks[e->in++ & (e->capacity - 1)], func, arg, size,
+	    heap, future, done, done_arg);
+  pthread_cond_signal(&e->not_empty);
+  pthread_mutex_unlock(&e->lock);
+  return 0;
+}
+
+/* run func on a copy of the size bytes at arg, setting future (if not
+   NULL) when it is done.  Waits while the buffer is full.  Returns 0,
+   or -1 if the executor is shutting down */
+static inline int exec_submit(struct executor *e, exec_func func,
+			      const void *arg, size_t size,
+			      struct exec_future *future) {
+
+  return exec_post(e, func, arg, size, future, NULL, NULL);
+}
+
+/* the same, but calling done(done_arg) when it is done */
+static inline int exec_submit_then(struct executor *e, exec_func func,
+				   const void *arg, size_t size,
+				   exec_done_func done, void *done_arg) {
+
+  return exec_post(e, func, arg, size, NULL, done, done_arg);
+}
+
+/* submit n tasks running func, task i on the size bytes at args +
+   i*size, with futures[i] (if futures is not NULL).  Returns how many
+   were submitted, n unless the executor is shutting down */
+static inline int exec_submit_bulk(struct executor *e, exec_func func,
+				   const void *args, size_t size, int n,
+				   struct exec_future *futures) {
+  const char *a = (const char *)args;
+  void *heap;
+  int i = 0, room;
+
+  while (i < n) {
+    pthread_mutex_lock(&e->lock);
+    while (e->in - e->out == e->capacity && !e->shutdown) {
+      pthread_cond_wait(&e->not_full, &e->lock);
+    }
+    if (e->shutdown) {
+      pthread_mutex_unlock(&e->lock);
+      break;
+    }
+    /* as many as there is room for, for as many workers */
+    room = e->capacity - (e->in - e->out);
+    if (room > n - i) room = n - i;
+    while (room-- > 0) {
+      if (exec_copy(a + i * size, size, &heap) == -1) {
+	room = 0;
+	n = i;
+	break;
+      }
+      exec_fill(&e->tasks[e->in++ & (e->capacity - 1)], func,
+		a + i * size, size, heap,
+		futures != NULL ? &futures[i] : NULL, NULL, NULL);
+      i++;
+    }
+    pthread_cond_broadcast(&e->not_empty);
+    pthread_mutex_unlock(&e->lock);
+  }
+  return i;
+}
+
+/* whether the task with future f is done yet */
+static inline int exec_future_ready(struct exec_future *f) {
+
+  return atomic_load_explicit(&f->state, memory_order_acquire) == EXEC_DONE;
+}
+
+/* wait until the task with future f is done */
+static inline void exec_future_wait(struct exec_future *f) {
+  uint32_t state;
+  long spin;
+
+  for (spin=0; spin<WAIT_SPIN_LIMIT; spin++) {
+    if (exec_future_ready(f)) return;
+    cpu_relax();
+  }
+  /* say we are asleep (unless it is done by now), and sleep until the
+     worker changes the state, checking again after every wakeup */
+  state = EXEC_PENDING;
+  atomic_compare_exchange_strong(&f->state, &state, EXEC_SLEEPING);
+  while (!exec_future_ready(f)) {
+    wait_futex(&f->state, EXEC_SLEEPING);
+  }
+}
+
+/* run everything submitted so far and stop the workers */
+static inline void exec_shutdown(struct executor *e) {
+  int k;
+
+  pthread_mutex_lock(&e->lock);
+  e->shutdown = 1;
+  pthread_cond_broadcast(&e->not_empty);
+  pthread_cond_broadcast(&e->not_full);
+  pthread_mutex_unlock(&e->lock);
+  for (k=0; k<e->nworkers; k++) {
+    pthread_join(e->workers[k].id, NULL);
+  }
+  e->nworkers = 0;
+}
+
+static inline void exec_destroy(struct executor *e) {
+
+  pthread_mutex_destroy(&e->lock);
+  pthread_cond_destroy(&e->not_full);
+  pthread_cond_destroy(&e->not_empty);
+  free(e->tasks);
+  free(e->workers);
+}
+
+#endif
@@ -0,0 +1,390 @@
+/*
+  Locks for short critical sections
+
+  One interface to several ways of getting mutual exclusion among N
+  threads, so they can be swapped around the same critical section and
+  compared:
+
+    peterson  Peterson's algorithm, generalized to N threads as the
+              filter lock: to get in, a thread goes through N-1 levels,
+              at each one waiting while it is the last to arrive and
+              anyone else is at that level or beyond.  With 2 threads
+              it is exactly Peterson.  It only needs loads and stores,
+              but they must not be reordered -- a store followed by a
+              load of another variable is exactly what x86 and ARM
+              reorder -- so all of them are seq_cst here
+    ticket    take a number (fetch-and-add) and wait for it to be
+              served: first come, first served, but everyone spins on
+              the same cache line
+    ttas      test-and-test-and-set: wait until the lock looks free,
+              then try to grab it with an exchange, and after losing
+              the race, back off for a random, growing time
+    mcs       Mellor-Crummey and Scott's queue lock: waiters form a
+              linked list and each spins on a flag in its own node,
+              which the thread ahead of it clears when it is done
+    clh       Craig, Landin and Hagersten's queue lock: each waiter
+              spins on the node of the thread ahead of it, and takes
+              that node over when it is done with its own
+    spin      pthread_spinlock_t
+    mutex     pthread_mutex_t
+    sem       sem_t starting at 1
+
+  Each thread that uses a lock needs a struct lock_thread of its own,
+  set up with lock_thread_init and a number from 0 to N-1.  The locks
+  that spin wait with wait_pause (see waitstrategy.h), so how they
+  wait is up to WAIT_POLICY like everywhere else, and wake any parked
+  waiters when they let go.
+
+  lock_kind_get picks the kind from the LOCK environment variable.
+*/
+
+#ifndef LOCKS_H
+#define LOCKS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "waitstrategy.h"
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+/* most pauses between two attempts with ttas */
+#ifndef LOCK_BACKOFF_MAX
+#define LOCK_BACKOFF_MAX 1024
+#endif
+
+enum lock_kind {
+  LOCK_PETERSON, LOCK_TICKET, LOCK_TTAS, LOCK_MCS, LOCK_CLH,
+  LOCK_SPIN, LOCK_MUTEX, LOCK_SEM
+};
+#define LOCK_KINDS (LOCK_SEM + 1)
+
+static const char *const lock_names[] = {
+  "peterson", "ticket", "ttas", "mcs", "clh", "spin", "mutex", "sem"
+};
+
+/* a waiter's place in line for mcs and clh */
+struct lock_node {
+  _Alignas(CACHE_LINE_SIZE) _Atomic(struct lock_node *) next;
+  atomic_int locked;
+};
+
+struct lock {
+  enum lock_kind kind;
+  int nthreads;
+  /* peterson: the level each thread is at, and who came to each
+     level last */
+  atomic_int *level;
+  atomic_int *victim;
+  /* ticket */
+  _Alignas(CACHE_LINE_SIZE) atomic_uint next_ticket;
+  _Alignas(CACHE_LINE_SIZE) atomic_uint now_serving;
+  /* ttas */
+  _Alignas(CACHE_LINE_SIZE) atomic_int held;
+  /* mcs and clh: the last thread in line */
+  _Alignas(CACHE_LINE_SIZE) _Atomic(struct lock_node *) tail;
+  pthread_spinlock_t spin;
+  pthread_mutex_t mutex;
+  sem_t sem;
+  /* how the threads wait, and where they park if that is how */
+  enum wait_policy policy;
+  _Alignas(CACHE_LINE_SIZE) struct wait_queue queue;
+};
+
+struct lock_thread {
+  int id;
+  struct waiter wait;
+  /* mcs: our node; clh: the node we will queue with next */
+  struct lock_node *node;
+  /* clh: the node we waited on */
+  struct lock_node *pred;
+  /* ttas: for random backoff */
+  uint32_t random;
+};
+
+/* the kind named by LOCK, or dflt if it is not set */
+static inline enum lock_kind lock_kind_get(enum lock_kind dflt) {
+  char *name = getenv("LOCK");
+  int k;
+
+  if (name == NULL || name[0] == '\0') return dflt;
+  for (k=0; k<LOCK_KINDS; k++) {
+    if (strcmp(name, lock_names[k]) == 0) return (enum lock_kind)k;
+  }
+  fprintf(stderr, "unknown LOCK %s, using %s\n", name, lock_names[dflt]);
+  return dflt;
+}
+
+static inline struct lock_node *lock_node_new(int locked) {
+  struct lock_node *node;
+
+  node = (struct lock_node *)aligned_alloc(CACHE_LINE_SIZE,
+					   sizeof(struct lock_node));
+  if (node == NULL) {
+    perror("lock node");
+    exit(1);
+  }
+  atomic_init(&node->next, NULL);
+  atomic_init(&node->locked, locked);
+  return node;
+}
+
+/* set up l for nthreads threads that wait with policy.  Returns 0 on
+   success, -1 if the lock could not be set up */
+static inline int lock_init(struct lock *l, enum lock_kind kind,
+			    int nthreads, enum wait_policy policy) {
+  int i;
+
+  memset(l, 0, sizeof(struct lock));
+  l->kind = kind;
+  l->nthreads = nthreads;
+  l->policy = policy;
+  wait_queue_init(&l->queue, policy);
+
+  switch (kind) {
+  case LOCK_PETERSON:
+    l->level = (atomic_int *)calloc(nthreads, sizeof(atomic_int));
+    l->victim = (atomic_int *)calloc(nthreads, sizeof(atomic_int));
+    if (l->level == NULL || l->victim == NULL) return -1;
+    for (i=0; i<nthreads; i++) {
+      atomic_init(&l->level[i], 0);
+      atomic_init(&l->victim[i], 0);
+    }
+    return 0;
+  case LOCK_TICKET:
+    atomic_init(&l->next_ticket, 0);
+    atomic_init(&l->now_serving, 0);
+    return 0;
+  case LOCK_TTAS:
+    atomic_init(&l->held, 0);
+    return 0;
+  case LOCK_MCS:
+    atomic_init(&l->tail, NULL);
+    return 0;
+  case LOCK_CLH:
+    /* the first thread in line waits on a node nobody holds */
+    atomic_init(&l->tail, lock_node_new(0));
+    return 0;
+  case LOCK_SPIN:
+    if (pthread_spin_init(&l->spin, PTHREAD_PROCESS_PRIVATE) != 0) return -1;
+    return 0;
+  case LOCK_MUTEX:
+    if (pthread_mutex_init(&l->mutex, NULL) != 0) return -1;
+    return 0;
+  case LOCK_SEM:
+    return sem_init(&l->sem, 0, 1);
+  }
+  return -1;
+}
+
+static inline void lock_thread_init(struct lock *l, struct lock_thread *t,
+				    int id) {
+
+  t->id = id;
+  wait_init(&t->wait, l->policy, &l->queue);
+  t->node = NULL;
+  t->pred = NULL;
+  t->random = 2654435761u * (id + 1);
+  if (l->kind == LOCK_MCS || l->kind == LOCK_CLH) t->node = lock_node_new(0);
+}
+
+/* peterson: someone other than me at level or above? */
+static inline int lock_filter_busy(struct lock *l, int me, int level) {
+  int k;
+
+  for (k=0; k<l->nthreads; k++) {
+    if (k != me && atomic_load(&l->level[k]) >= level) return 1;
+  }
+  return 0;
+}
+
+static inline void lock_acquire(struct lock *l, struct lock_thread *t) {
+  struct lock_node *pred;
+  unsigned ticket;
+  long spin, k, limit;
+  int level;
+
+  switch (l->kind) {
+  case LOCK_PETERSON:
+    for (level=1; level<l->nthreads; level++) {
+      atomic_store(&l->level[t->id], level);
+      atomic_store(&l->victim[level], t->id);
+      /* that may be what someone at this level was waiting for */
+      wait_notify(&l->queue);
+      spin = 0;
+      while (atomic_load(&l->victim[level]) == t->id &&
+	     lock_filter_busy(l, t->id, level)) {
+	wait_pause(&t->wait, spin++);
+      }
+      wait_done(&t->wait);
+    }
+    break;
+
+  case LOCK_TICKET:
+    ticket = atomic_fetch_add_explicit(&l->next_ticket, 1,
+				       memory_order_relaxed);
+    spin = 0;
+    while (atomic_load_explicit(&l->now_serving, memory_order_acquire) !=
+	   ticket) {
+      wait_pause(&t->wait, spin++);
+    }
+    wait_done(&t->wait);
+    break;
+
+  case LOCK_TTAS:
+    limit = 1;
+    for (;;) {
+      spin = 0;
+      while (atomic_load_explicit(&l->held, memory_order_relaxed)) {
+	wait_pause(&t->wait, spin++);
+      }
+      wait_done(&t->wait);
+      if (!atomic_exchange_explicit(&l->held, 1, memory_order_acquire)) break;
+      /* someone beat us to it: wait a while before trying again, so we
+	 are not all trying again at the same moment */
+      t->random ^= t->random << 13;
+      t->random ^= t->random >> 17;
+      t->random ^= t->random << 5;
+      for (k=t->random % limit; k>=0; k--) cpu_relax();
+      if (limit < LOCK_BACKOFF_MAX) limit *= 2;
+    }
+    break;
+
+  case LOCK_MCS:
+    atomic_store_explicit(&t->node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&t->node->locked, 1, memory_order_relaxed);
+    pred = atomic_exchange_explicit(&l->tail, t->node, memory_order_acq_rel);
+    if (pred != NULL) {
+      atomic_store_explicit(&pred->next, t->node, memory_order_release);
+      /* pred may be parked waiting for us to show up (see below) */
+      wait_notify(&l->queue);
+      spin = 0;
+      while (atomic_load_explicit(&t->node->locked, memory_order_acquire)) {
+	wait_pause(&t->wait, spin++);
+      }
+      wait_done(&t->wait);
+    }
+    break;
+
+  case LOCK_CLH:
+    atomic_store_explicit(&t->node->locked, 1, memory_order_relaxed);
+    pred = atomic_exchange_explicit(&l->tail, t->node, memory_order_acq_rel);
+    spin = 0;
+    while (atomic_load_explicit(&pred->locked, memory_order_acquire)) {
+      wait_pause(&t->wait, spin++);
+    }
+    wait_done(&t->wait);
+    t->pred = pred;
+    break;
+
+  case LOCK_SPIN:
+    pthread_spin_lock(&l->spin);
+    break;
+  case LOCK_MUTEX:
+    pthread_mutex_lock(&l->mutex);
+    break;
+  case LOCK_SEM:
+    while (sem_wait(&l->sem) != 0);
+    break;
+  }
+}
+
+static inline void lock_release(struct lock *l, struct lock_thread *t) {
+  struct lock_node *next, *expected;
+  unsigned ticket;
+  long spin;
+
+  switch (l->kind) {
+  case LOCK_PETERSON:
+    atomic_store(&l->level[t->id], 0);
+    break;
+
+  case LOCK_TICKET:
+    /* only the holder writes now_serving */
+    ticket = atomic_load_explicit(&l->now_serving, memory_order_relaxed);
+    atomic_store_explicit(&l->now_serving, ticket + 1, memory_order_release);
+    break;
+
+  case LOCK_TTAS:
+    atomic_store_explicit(&l->held, 0, memory_order_release);
+    break;
+
+  case LOCK_MCS:
+    next = atomic_load_explicit(&t->node->next, memory_order_acquire);
+    if (next == NULL) {
+      /* nobody in line behind us, unless someone has just swapped
+	 themselves into tail and not yet linked to us */
+      expected = t->node;
+      if (atomic_compare_exchange_strong_explicit(&l->tail, &expected, NULL,
+						  memory_order_acq_rel,
+						  memory_order_relaxed)) {
+	return;
+      }
+      spin = 0;
+      while ((next = atomic_load_explicit(&t->node->next,
+					  memory_order_acquire)) == NULL) {
+	wait_pause(&t->wait, spin++);
+      }
+      wait_done(&t->wait);
+    }
+    atomic_store_explicit(&next->locked, 0, memory_order_release);
+    break;
+
+  case LOCK_CLH:
+    atomic_store_explicit(&t->node->locked, 0, memory_order_release);
+    /* our node now belongs to whoever is waiting on it, and the one we
+       waited on is ours to use next time */
+    t->node = t->pred;
+    break;
+
+  case LOCK_SPIN:
+    pthread_spin_unlock(&l->spin);
+    return;
+  case LOCK_MUTEX:
+    pthread_mutex_unlock(&l->mutex);
+    return;
+  case LOCK_SEM:
+    sem_post(&l->sem);
+    return;
+  }
+  wait_notify(&l->queue);
+}
+
+static inline void lock_thread_destroy(struct lock *l, struct lock_thread *t) {
+
+  free(t->node);
+  t->node = NULL;
+}
+
+/* after every thread is done with it */
+static inline void lock_destroy(struct lock *l) {
+
+  switch (l->kind) {
+  case LOCK_PETERSON:
+    free(l->level);
+    free(l->victim);
+    break;
+  case LOCK_CLH:
+    free(atomic_load(&l->tail));
+    break;
+  case LOCK_SPIN:
+    pthread_spin_destroy(&l->spin);
+    break;
+  case LOCK_MUTEX:
+    pthread_mutex_destroy(&l->mutex);
+    break;
+  case LOCK_SEM:
+    sem_destroy(&l->sem);
+    break;
+  default:
+    break;
+  }
+}
+
+#endif
@@ -0,0 +1,213 @@
+/*
+  How fast and how fair the locks in locks.h are
+
+  Usage: lockzoo [-t threads] [-d milliseconds] [-c critical section ns]
+		 [-o ns outside] [lock ...]
+
+  For each lock named (all of them by default), starts the threads,
+  which for the given time keep taking the lock, adding one to a
+  shared counter and spinning for the critical section time while
+  they hold it, then letting go and spinning for the time outside.
+  The counter is a plain int, so if a lock ever lets two threads in at
+  once, updates get lost and the run says so.  Then it prints a line
+  of CSV per lock:
+
+    lock,threads,cs_ns,acquisitions,acquisitions_per_sec,fairness,min_share,max_share,lost_updates
+
+  where fairness is Jain's index of how many times each thread got the
+  lock (1 when they all got it equally often, down to 1/threads when
+  one of them got it every time), and min_share and max_share are the
+  fewest and most any thread got, as a fraction of the average.
+
+  Threads wait as WAIT_POLICY says (see waitstrategy.h), by default
+  spinning for a while and then calling sched_yield, and thread i runs
+  on the ith CPU of PLACE_PRODUCER_CPUS if that is set (see
+  placement.h).
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "locks.h"
+#include "placement.h"
+#include "waitstrategy.h"
+
+#define MAX_THREADS 256
+
+/* the lock under test and what it protects */
+struct lock lock;
+int counter;
+/* lined up at the start, told to stop at the end */
+pthread_barrier_t start_line;
+atomic_int stop;
+long cs_ns, outside_ns;
+
+/* per-thread arguments and results, one cache line each at least */
+struct thread_info {
+  _Alignas(CACHE_LINE_SIZE) pthread_t id;
+  int number;
+  struct lock_thread me;
+  long acquisitions;
+};
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* spin (rather than sleep) for ns nanoseconds */
+static void work(long ns) {
+  long long until;
+
+  if (ns <= 0) return;
+  until = now_ns() + ns;
+  while (now_ns() < until);
+}
+
+void *locker(void *args) {
+  struct thread_info *t = (struct thread_info *)args;
+
+  place_thread(PLACE_PRODUCER, t->number);
+  pthread_barrier_wait(&start_line);
+
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    lock_acquire(&lock, &t->me);
+    counter++;
+    work(cs_ns);
+    lock_release(&lock, &t->me);
+    t->acquisitions++;
+    work(outside_ns);
+  }
+  return NULL;
+}
+
+/* run nthreads threads on a lock of the given kind for ms milliseconds
+   and print how it went */
+static int run(enum lock_kind kind, struct thread_info *threads,
+	       int nthreads, long ms, enum wait_policy policy) {
+  long long start, elapsed;
+  long total, min, max;
+  double sum_squares, mean;
+  int i;
+
+  if (lock_init(&lock, kind, nthreads, policy) == -1) {
+    fprintf(stderr, "cannot set up a %s lock\n", lock_names[kind]);
+    return -1;
+  }
+  counter = 0;
+  atomic_store(&stop, 0);
+  pthread_barrier_init(&start_line, NULL, nthreads + 1);
+  for (i=0; i<nthreads; i++) {
+    threads[i].number = i;
+    threads[i].acquisitions = 0;
+    lock_thread_init(&lock, &threads[i].me, i);
+    if (pthread_create(&threads[i].id, NULL, locker, &threads[i]) != 0) {
+      fprintf(stderr, "Could not create thread %d\n", i);
+      exit(1);
+    }
+  }
+
+  pthread_barrier_wait(&start_line);
+  start = now_ns();
+  usleep(ms * 1000);
+  atomic_store(&stop, 1);
+  for (i=0; i<nthreads; i++) {
+    pthread_join(threads[i].id, NULL);
+  }
+  elapsed = now_ns() - start;
+
+  total = 0;
+  sum_squares = 0;
+  min = max = threads[0].acquisitions;
+  for (i=0; i<nthreads; i++) {
+    total += threads[i].acquisitions;
+    sum_squares += (double)threads[i].acquisitions * threads[i].acquisitions;
+    if (threads[i].acquisitions < min) min = threads[i].acquisitions;
+    if (threads[i].acquisitions > max) max = threads[i].acquisitions;
+    lock_thread_destroy(&lock, &threads[i].me);
+  }
+  mean = (double)total / nthreads;
+  printf("%s,%d,%ld,%ld,%.0f,%.3f,%.3f,%.3f,%ld\n", lock_names[kind],
+	 nthreads, cs_ns, total, total * 1e9 / elapsed,
+	 sum_squares > 0 ? (double)total * total / (nthreads * sum_squares) : 0,
+	 mean > 0 ? min / mean : 0, mean > 0 ? max / mean : 0,
+	 total - counter);
+  fflush(stdout);
+
+  pthread_barrier_destroy(&start_line);
+  lock_destroy(&lock);
+  return total == counter ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+  struct thread_info *threads;
+  int nthreads = 4, opt, i, k, failed = 0;
+  long ms = 1000;
+  enum wait_policy policy;
+
+  while ((opt = getopt(argc, argv, "t:d:c:o:")) != -1) {
+    switch (opt) {
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'd':
+      ms = atol(optarg);
+      break;
+    case 'c':
+      cs_ns = atol(optarg);
+      break;
+    case 'o':
+      outside_ns = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-t threads] [-d milliseconds] "
+	      "[-c critical section ns] [-o ns outside] [lock ...]\n",
+	      argv[0]);
+      exit(1);
+    }
+  }
+  if (nthreads < 1 || nthreads > MAX_THREADS || ms <= 0) {
+    fprintf(stderr, "%s: need 1 to %d threads and a positive time\n",
+	    argv[0], MAX_THREADS);
+    exit(1);
+  }
+
+  threads = (struct thread_info *)aligned_alloc(CACHE_LINE_SIZE,
+						nthreads * sizeof(struct thread_info));
+  if (threads == NULL) {
+    perror("aligned_alloc");
+    exit(1);
+  }
+  policy = wait_policy_get(WAIT_YIELD);
+  place_init();
+
+  printf("lock,threads,cs_ns,acquisitions,acquisitions_per_sec,fairness,"
+	 "min_share,max_share,lost_updates\n");
+  if (optind == argc) {
+    for (k=0; k<LOCK_KINDS; k++) {
+      if (run((enum lock_kind)k, threads, nthreads, ms, policy) != 0) failed++;
+    }
+  }
+  for (i=optind; i<argc; i++) {
+    for (k=0; k<LOCK_KINDS; k++) {
+      if (strcmp(argv[i], lock_names[k]) == 0) break;
+    }
+    if (k == LOCK_KINDS) {
+      fprintf(stderr, "%s: no lock called %s\n", argv[0], argv[i]);
+      failed++;
+    }
+    else if (run((enum lock_kind)k, threads, nthreads, ms, policy) != 0) {
+      failed++;
+    }
+  }
+
+  free(threads);
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+/*
+  Bounded multi-producer/multi-consumer queue
+
+  This is Dmitry Vyukov's bounded MPMC queue.  Each slot of the
+  buffer has a sequence number next to the item, and the sequence
+  number says whose turn it is to use the slot:
+
+    seq == pos      the slot is free for the producer that claims
+                    position pos
+    seq == pos+1    the slot holds the item enqueued at position pos,
+                    for the consumer that claims position pos
+
+  where positions are the ever-increasing 64-bit values of in and out
+  (the slot is the low bits, so the size must be a power of two).
+
+  A producer claims position in by advancing in with a single
+  compare-and-swap, writes the item, then publishes it by storing
+  pos+1 in the slot's sequence number.  A consumer claims position out
+  the same way, reads the item, then frees the slot for the producer
+  that will come around to it next time by storing pos+size.  There
+  is no lock anywhere: producers only contend with producers on in,
+  consumers only contend with consumers on out, and a producer and a
+  consumer only meet on the slot they are handing off.
+
+  mpmc_enqueue and mpmc_dequeue never block: they return 0 when the
+  queue is full or empty, and it is up to the caller to decide how to
+  wait.
+*/
+
+#ifndef MPMC_H
+#define MPMC_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+struct mpmc_slot {
+  _Atomic uint64_t seq;
+  int value;
+};
+
+struct mpmc_queue {
+  /* claimed by producers */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t in;
+  /* claimed by consumers */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t out;
+  /* read-only after mpmc_init */
+  _Alignas(CACHE_LINE_SIZE) uint64_t mask;
+  struct mpmc_slot *slots;
+};
+
+/* set up q with size slots, size a power of two.  Returns 0 on
+   success, -1 if size is bad or the slots cannot be allocated */
+static inline int mpmc_init(struct mpmc_queue *q, unsigned size) {
+  unsigned i;
+
+  if (size == 0 || (size & (size - 1)) != 0) return -1;
+  q->slots = (struct mpmc_slot *)
+    aligned_alloc(CACHE_LINE_SIZE,
+		  ((size * sizeof(struct mpmc_slot) + CACHE_LINE_SIZE - 1) /
+		   CACHE_LINE_SIZE) * CACHE_LINE_SIZE);
+  if (q->slots == NULL) return -1;
+  for (i=0; i<size; i++) {
+    atomic_init(&q->slots[i].seq, i);
+  }
+  q->mask = size - 1;
+  atomic_init(&q->in, 0);
+  atomic_init(&q->out, 0);
+  return 0;
+}
+
+static inline void mpmc_destroy(struct mpmc_queue *q) {
+
+  free(q->slots);
+  q->slots = NULL;
+}
+
+/* add value to the queue, returns 0 if it is full */
+static inline int mpmc_enqueue(struct mpmc_queue *q, int value) {
+  struct mpmc_slot *slot;
+  uint64_t pos, seq;
+  int64_t diff;
+
+  pos = atomic_load_explicit(&q->in, memory_order_relaxed);
+  for (;;) {
+    slot = &q->slots[pos & q->mask];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (int64_t)(seq - pos);
+    if (diff == 0) {
+      /* the slot is free: try to claim position pos.  On failure
+	 pos is reloaded with the current in and we try again */
+      if (atomic_compare_exchange_weak_explicit(&q->in, &pos, pos + 1,
+						memory_order_relaxed,
+						memory_order_relaxed)) {
+	break;
+      }
+    }
+    else if (diff < 0) {
+      /* the slot still holds the item from one lap ago: full */
+      return 0;
+    }
+    else {
+      /* another producer got here first, catch up */
+      pos = atomic_load_explicit(&q->in, memory_order_relaxed);
+    }
+  }
+
+  slot->value = value;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  return 1;
+}
+
+/* remove the oldest item into *value, returns 0 if the queue is empty */
+static inline int mpmc_dequeue(struct mpmc_queue *q, int *value) {
+  struct mpmc_slot *slot;
+  uint64_t pos, seq;
+  int64_t diff;
+
+  pos = atomic_load_explicit(&q->out, memory_order_relaxed);
+  for (;;) {
+    slot = &q->slots[pos & q->mask];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (int64_t)(seq - (pos + 1));
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->out, &pos, pos + 1,
+						memory_order_relaxed,
+						memory_order_relaxed)) {
+	break;
+      }
+    }
+    else if (diff < 0) {
+      /* nothing has been published at this position yet: empty */
+      return 0;
+    }
+    else {
+      pos = atomic_load_explicit(&q->out, memory_order_relaxed);
+    }
+  }
+
+  *value = slot->value;
+  atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+  return 1;
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*
+  Multi-stage pipeline of bounded buffers
+
+  A pipeline is a chain of stages, each with its own pool of worker
+  threads and its own bounded input queue (see mpmc.h).  A worker
+  takes an item from its stage's queue, calls the stage's function on
+  it, and puts whatever the function returns on the next stage's
+  queue, so a stage is a consumer of the stage before it and a
+  producer for the one after.  Nothing else connects them: when a
+  stage falls behind, its queue fills up, the workers of the stage
+  before it wait for room, their own queue fills up in turn, and so on
+  back to pipeline_put, so backpressure reaches the source without any
+  extra machinery, and no queue ever holds more than its capacity.
+
+  Items are non-negative ints (an index into the caller's own records,
+  say).  A stage function returns the item to pass on, which need not
+  be the one it was given, or PIPELINE_DROP to pass nothing on.  What
+  the last stage's function returns goes nowhere.
+
+  Use:
+
+    pipeline_init(&p);
+    pipeline_stage(&p, "parse", workers, capacity, parse, arg);
+    ... more stages, in order ...
+    pipeline_start(&p);
+    pipeline_put(&p, item);     as many times as there are items
+    pipeline_finish(&p);        waits for every item to get through
+    pipeline_report(&p, stdout);
+    pipeline_destroy(&p);
+
+  pipeline_finish puts one PIPELINE_END in the first queue for each of
+  its workers, and each worker stops when it takes one.  The last
+  worker of a stage to stop does the same for the next stage, after
+  everything it and the others passed on, so every item gets all the
+  way through before anything stops.
+
+  Every worker keeps its own counters: items taken, time spent in the
+  stage function (busy), waiting for an item (starved) and waiting for
+  room downstream (blocked), and the depth of its queue each time it
+  took an item.  pipeline_report adds them up by stage.  The stage
+  with the busiest workers is the bottleneck: the stages before it
+  show up as blocked with full queues, and the ones after it as
+  starved with empty ones.
+
+  Workers wait as WAIT_POLICY says (see waitstrategy.h), by default
+  spinning for a while and then calling sched_yield.  They are pinned,
+  if PLACE_CONSUMER_CPUS is set, in the order they are started (see
+  placement.h).
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mpmc.h"
+#include "placement.h"
+#include "waitstrategy.h"
+
+#define PIPELINE_MAX_STAGES 16
+/* items are >= 0, these are not */
+#define PIPELINE_END -1
+#define PIPELINE_DROP -2
+
+struct pipeline_stage;
+
+/* what a worker (number worker of its stage) does to an item */
+typedef int (*pipeline_func)(int item, void *arg, int worker);
+
+struct pipeline_worker {
+  pthread_t id;
+  struct pipeline_stage *stage;
+  int number;
+  /* for PLACE_CONSUMER_CPUS */
+  int place;
+  struct waiter in_wait;
+  struct waiter out_wait;
+  /* items taken, and passed on */
+  long items;
+  long passed;
+  long long busy_ns;
+  long long starved_ns;
+  long long blocked_ns;
+  /* depth of the input queue each time an item was taken, summed */
+  long long depth;
+};
+
+struct pipeline_stage {
+  const char *name;
+  int nworkers;
+  unsigned capacity;
+  pipeline_func func;
+  void *arg;
+  struct mpmc_queue in;
+  struct wait_queue not_full;
+  struct wait_queue not_empty;
+  /* NULL for the last stage */
+  struct pipeline_stage *next;
+  /* workers that have not taken their PIPELINE_END yet */
+  atomic_int running;
+  struct pipeline_worker *workers;
+};
+
+struct pipeline {
+  int nstages;
+  struct pipeline_stage stages[PIPELINE_MAX_STAGES];
+  enum wait_policy policy;
+  /* pipeline_put's waiting for room in the first queue */
+  struct waiter feed_wait;
+  long long feed_blocked_ns;
+  long long start_ns;
+  long long end_ns;
+};
+
+static inline long long pipeline_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void pipeline_init(struct pipeline *p) {
+
+  p->nstages = 0;
+  p->policy = wait_policy_get(WAIT_YIELD);
+  p->feed_blocked_ns = 0;
+}
+
+/* add a stage after the ones already added, with nworkers workers
+   calling func, and an input queue of capacity items (a power of two).
+   Returns 0, or -1 (having said why) if it cannot */
+static inline int pipeline_stage(struct pipeline *p, const char *name,
+				 int nworkers, unsigned capacity,
+				 pipeline_func func, void *arg) {
+  struct pipeline_stage *s;
+
+  if (p->nstages == PIPELINE_MAX_STAGES) {
+    fprintf(stderr, "pipeline: at most %d stages\n", PIPELINE_MAX_STAGES);
+    return -1;
+  }
+  if (nworkers < 1) {
+    fprintf(stderr, "pipeline: stage %s needs a worker\n", name);
+    return -1;
+  }
+  s = &p->stages[p->nstages];
+  if (mpmc_init(&s->in, capacity) == -1) {
+    fprintf(stderr, "pipeline: stage %s's capacity must be a power of "
+	    "two\n", name);
+    return -1;
+  }
+  s->workers = (struct pipeline_worker *)
+    calloc(nworkers, sizeof(struct pipeline_worker));
+  if (s->workers == NULL) {
+    perror("calloc");
+    mpmc_destroy(&s->in);
+    return -1;
+  }
+  s->name = name;
+  s->nworkers = nworkers;
+  s->capacity = capacity;
+  s->func = func;
+  s->arg = arg;
+  s->next = NULL;
+  wait_queue_init(&s->not_full, p->policy);
+  wait_queue_init(&s->not_empty, p->policy);
+  atomic_init(&s->running, nworkers);
+  if (p->nstages > 0) p->stages[p->nstages - 1].next = s;
+  p->nstages++;
+  return 0;
+}
+
+/* put item on stage s's queue, waiting for room with w, and adding
+   how long that took to *blocked_ns */
+static inline void pipeline_push(struct pipeline_stage *s, int item,
+				 struct waiter *w, long long *blocked_ns) {
+  long spin = 0;
+  long long start = 0;
+
+  while (!mpmc_enqueue(&s->in, item)) {
+    if (spin == 0) start = pipeline_now();
+    wait_pause(w, spin++);
+  }
+  wait_done(w);
+  if (spin > 0) *blocked_ns += pipeline_now() - start;
+  wait_notify(&s->not_empty);
+}
+
+static inline void *pipeline_worker(void *arg) {
+  struct pipeline_worker *me = (struct pipeline_worker *)arg;
+  struct pipeline_stage *s = me->stage;
+  int item, out, k;
+  uint64_t pos, depth;
+  long spin;
+  long long start, end;
+
+  place_thread(PLACE_CONSUMER, me->place);
+
+  for (;;) {
+
+    /* take an item */
+    spin = 0;
+    start = 0;
+    while (!mpmc_dequeue(&s->in, &item)) {
+      if (spin == 0) start = pipeline_now();
+      wait_pause(&me->in_wait, spin++);
+    }
+    wait_done(&me->in_wait);
+    if (spin > 0) me->starved_ns += pipeline_now() - start;
+    wait_notify(&s->not_full);
+    if (item == PIPELINE_END) break;
+
+    me->items++;
+    /* out first, then in.  The queue moves both with relaxed compare
+       and exchanges, so the two can still be out of step: count
+       anything outside 0 to capacity as the nearest end */
+    pos = atomic_load_explicit(&s->in.out, memory_order_acquire);
+    depth = atomic_load_explicit(&s->in.in, memory_order_acquire);
+    if ((int64_t)(depth - pos) < 0) depth = pos;
+    if (depth - pos > s->capacity) depth = pos + s->capacity;
+    me->depth += depth - pos;
+
+    /* do this stage's work on it */
+    start = pipeline_now();
+    out = s->func(item, s->arg, me->number);
+    end = pipeline_now();
+    me->busy_ns += end - start;
+
+    /* and pass the result on, waiting if the next stage is behind */
+    if (out == PIPELINE_DROP || s->next == NULL) continue;
+    me->passed++;
+    pipeline_push(s->next, out, &me->out_wait, &me->blocked_ns);
+  }
+
+  /* the last one out tells the next stage's workers to stop, after
+     everything this stage passed on */
+  if (atomic_fetch_sub(&s->running, 1) == 1 && s->next != NULL) {
+    for (k=0; k<s->next->nworkers; k++) {
+      pipeline_push(s->next, PIPELINE_END, &me->out_wait, &me->blocked_ns);
+    }
+  }
+  return NULL;
+}
+
+/* start every stage's workers.  Returns 0, or -1 if it cannot */
+static inline int pipeline_start(struct pipeline *p) {
+  struct pipeline_stage *s;
+  struct pipeline_worker *w;
+  int i, k, place = 0;
+
+  if (p->nstages == 0) {
+    fprintf(stderr, "pipeline: no stages\n");
+    return -1;
+  }
+  wait_init(&p->feed_wait, p->policy, &p->stages[0].not_full);
+  p->start_ns = pipeline_now();
+  for (i=0; i<p->nstages; i++) {
+    s = &p->stages[i];
+    for (k=0; k<s->nworkers; k++) {
+      w = &s->workers[k];
+      w->stage = s;
+      w->number = k;
+      w->place = place++;
+      wait_init(&w->in_wait, p->policy, &s->not_empty);
+      if (s->next != NULL) {
+	wait_init(&w->out_wait, p->policy, &s->next->not_full);
+      }
+      if (pthread_create(&w->id, NULL, pipeline_worker, w) != 0) {
+	fprintf(stderr, "pipeline: cannot create worker %d of %s\n", k,
+		s->name);
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* feed item (>= 0) to the first stage, waiting while it is full */
+static inline void pipeline_put(struct pipeline *p, int item) {
+
+  pipeline_push(&p->stages[0], item, &p->feed_wait, &p->feed_blocked_ns);
+}
+
+/* wait for every item put so far to get through, and stop */
+static inline void pipeline_finish(struct pipeline *p) {
+  int i, k;
+
+  for (k=0; k<p->stages[0].nworkers; k++) {
+    pipeline_put(p, PIPELINE_END);
+  }
+  for (i=0; i<p->nstages; i++) {
+    for (k=0; k<p->stages[i].nworkers; k++) {
+      pthread_join(p->stages[i].workers[k].id, NULL);
+    }
+  }
+  p->end_ns = pipeline_now();
+}
+
+/* print each stage's counters, as a share of the time the workers had,
+   and which stage is the bottleneck */
+static inline void pipeline_report(struct pipeline *p, FILE *f) {
+  struct pipeline_stage *s;
+  struct pipeline_worker *w;
+  long items, passed;
+  long long busy, starved, blocked, depth;
+  double elapsed = (double)(p->end_ns - p->start_ns);
+  double available, load, worst = -1.0;
+  int i, k, bottleneck = 0;
+
+  fprintf(f, "%-12s %7s %10s %10s %12s %6s %8s %8s %7s %6s\n", "stage",
+	  "workers", "items", "passed", "items/sec", "busy%", "starved%",
+	  "blocked%", "depth", "full%");
+  for (i=0; i<p->nstages; i++) {
+    s = &p->stages[i];
+    items = passed = 0;
+    busy = starved = blocked = depth = 0;
+    for (k=0; k<s->nworkers; k++) {
+      w = &s->workers[k];
+      items += w->items;
+      passed += w->passed;
+      busy += w->busy_ns;
+      starved += w->starved_ns;
+      blocked += w->blocked_ns;
+      depth += w->depth;
+    }
+    available = elapsed * s->nworkers;
+    load = busy / available;
+    if (load > worst) {
+      worst = load;
+      bottleneck = i;
+    }
+    fprintf(f, "%-12s %7d %10ld %10ld %12.0f %6.1f %8.1f %8.1f %7.1f "
+	    "%6.1f\n", s->name, s->nworkers, items, passed,
+	    items * 1e9 / elapsed, 100.0 * load,
+	    100.0 * starved / available, 100.0 * blocked / available,
+	    items > 0 ? (double)depth / items : 0.0,
+	    items > 0 ? 100.0 * depth / items / s->capacity : 0.0);
+  }
+  fprintf(f, "feeding blocked %.1f%% of %.3f seconds, bottleneck: %s\n",
+	  100.0 * p->feed_blocked_ns / elapsed, elapsed / 1e9,
+	  p->stages[bottleneck].name);
+}
+
+static inline void pipeline_destroy(struct pipeline *p) {
+  int i;
+
+  for (i=0; i<p->nstages; i++) {
+    mpmc_destroy(&p->stages[i].in);
+    free(p->stages[i].workers);
+  }
+  p->nstages = 0;
+}
+
+#endif
@@ -0,0 +1,218 @@
+/*
+  Producer-consumer example with pthreads
+
+  The lock-free single-producer/single-consumer buffer again, but
+  moving items in batches using the span interface in spscring.h:
+
+  - the producer reserves up to BATCH_SIZE free slots at once, fills
+    them in place as it produces the items, and publishes the whole
+    batch with one commit
+
+  - the consumer takes everything that has accumulated in the buffer
+    at once, consumes the items in place, and frees all of their slots
+    with one release
+
+  so the cost of synchronizing is paid once per batch instead of once
+  per item.  The free or full slots can wrap around the end of the
+  buffer, so each batch comes as up to two pieces.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "placement.h"
+#include "spscring.h"
+#include "waitstrategy.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+#ifndef NUMBER_OF_ITEMS
+#define NUMBER_OF_ITEMS 30
+#endif
+/* most slots the producer will reserve at once */
+#ifndef BATCH_SIZE
+#define BATCH_SIZE 4
+#endif
+
+/* the shared buffer */
+struct spsc_ring *ring;
+BENCH_STAMPS(stamp, BUFFER_SIZE)
+BENCH_SHARED(bench)
+
+/* how to wait for the other side (see waitstrategy.h) */
+enum wait_policy policy;
+struct wait_queue not_full;
+struct wait_queue not_empty;
+
+/* producer thread */
+void producer(void *args) {
+  int i;
+  long spin;
+  unsigned k, n;
+  struct spsc_span span;
+  int *slot;
+  struct waiter w;
+
+  place_thread(PLACE_PRODUCER, 0);
+  BENCH_PRODUCER_BEGIN(&bench);
+  wait_init(&w, policy, &not_full);
+
+  i = 0;
+  while (i < NUMBER_OF_ITEMS) {
+
+    /* get as many slots as we can (up to the number of items left) */
+    spin = 0;
+    n = NUMBER_OF_ITEMS - i < BATCH_SIZE ? NUMBER_OF_ITEMS - i : BATCH_SIZE;
+    while ((n = spsc_reserve(ring, n, &span)) == 0) {
+      if (spin == 0) {
+	LOG("P: waiting for open slots\n");
+	BENCH_WAITING();
+      }
+      wait_pause(&w, spin++);
+      n = NUMBER_OF_ITEMS - i < BATCH_SIZE ? NUMBER_OF_ITEMS - i : BATCH_SIZE;
+    }
+    wait_done(&w);
+    if (spin > 0) {
+      LOG("P: done waiting (cycled %ld times)\n", spin);
+      BENCH_PRODUCER_WAITED();
+    }
+    LOG("P: reserved %u slots starting at slot %u\n", n,
+	spsc_slot(ring, span.first));
+
+    /* produce items directly into the reserved slots */
+    for (k=0; k<n; k++) {
+      slot = k < span.first_len ? &span.first[k]
+				: &span.second[k - span.first_len];
+
+      /* simulate the cost of producing the item */
+      PRODUCER_WORK();
+
+      LOG("P: produced %d into slot %u\n", i, spsc_slot(ring, slot));
+      *slot = i;
+      BENCH_ENQUEUED(stamp[spsc_slot(ring, slot)]);
+      i++;
+    }
+
+    /* and hand them all to the consumer at once */
+    spsc_commit(ring, n);
+    wait_notify(&not_empty);
+    LOG("P: committed %u items\n", n);
+  }
+
+  BENCH_PRODUCER_END(&bench);
+  wait_report("P", &w);
+}
+
+/* consumer thread */
+void consumer(void *args) {
+  int i;
+  long spin;
+  unsigned k, n;
+  struct spsc_span span;
+  int *slot;
+  struct waiter w;
+
+  place_thread(PLACE_CONSUMER, 0);
+  BENCH_CONSUMER_BEGIN(NUMBER_OF_ITEMS);
+  wait_init(&w, policy, &not_empty);
+
+  i = 0;
+  while (i < NUMBER_OF_ITEMS) {
+
+    /* take everything that is there */
+    spin = 0;
+    while ((n = spsc_peek(ring, &span)) == 0) {
+      if (spin == 0) {
+	LOG("C: waiting for items\n");
+	BENCH_WAITING();
+      }
+      wait_pause(&w, spin++);
+    }
+    wait_done(&w);
+    if (spin > 0) {
+      LOG("C: done waiting (cycled %ld times)\n", spin);
+      BENCH_CONSUMER_WAITED();
+    }
+    LOG("C: found %u items starting at slot %u\n", n,
+	spsc_slot(ring, span.first));
+
+    /* consume them where they sit */
+    for (k=0; k<n; k++) {
+      slot = k < span.first_len ? &span.first[k]
+				: &span.second[k - span.first_len];
+      LOG("C: consuming value %d from slot %u\n", *slot,
+	  spsc_slot(ring, slot));
+      BENCH_DEQUEUED(stamp[spsc_slot(ring, slot)]);
+
+      /* simulate the cost of consuming the item */
+      CONSUMER_WORK();
+    }
+
+    /* and give all of the slots back at once */
+    spsc_release(ring, n);
+    wait_notify(&not_full);
+    LOG("C: released %u slots\n", n);
+    i += n;
+  }
+
+  BENCH_CONSUMER_END(&bench, NUMBER_OF_ITEMS, BUFFER_SIZE);
+  wait_report("C", &w);
+}
+
+/* main program - just starts up threads */
+int main(int argc, char *argv[]) {
+  pthread_t producer_id, consumer_id;
+  int rc;
+
+  /* allocate and initialize the shared buffer */
+  ring = (struct spsc_ring *)aligned_alloc(CACHE_LINE_SIZE,
+					   spsc_ring_size(BUFFER_SIZE));
+  if (ring == NULL) {
+    perror("aligned_alloc");
+    exit(1);
+  }
+  if (spsc_ring_init(ring, BUFFER_SIZE) == -1) {
+    fprintf(stderr, "BUFFER_SIZE must be a power of two\n");
+    exit(1);
+  }
+
+  policy = wait_policy_get(WAIT_SPIN);
+  wait_queue_init(&not_full, policy);
+  wait_queue_init(&not_empty, policy);
+
+  /* pin, bind and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_memory(ring, spsc_ring_size(BUFFER_SIZE));
+
+  /* seed the random number generator on pid */
+  srand(getpid());
+
+  /* create the consumer */
+  rc = pthread_create(&consumer_id, NULL, (void *)&consumer, NULL);
+
+  if (rc != 0) {
+    fprintf(stderr, "Could not create consumer child thread\n");
+    exit(1);
+  }
+
+  /* create the producer */
+  rc = pthread_create(&producer_id, NULL, (void *)&producer, NULL);
+
+  if (rc != 0) {
+    fprintf(stderr, "Could not create producer child thread\n");
+    exit(1);
+  }
+
+  /* wait for the child threads to exit */
+  pthread_join(producer_id,NULL);
+  pthread_join(consumer_id,NULL);
+
+  free(ring);
+
+  return 0;
+}
@@ -0,0 +1,137 @@
+/*
+  Producer-consumer example with pthreads
+
+  The counter programs again, as one program around a bounded buffer
+  from boundedbuf.h: which policy keeps the buffer full or empty is
+  picked when it is compiled, with -DBB_POLICY=bb_spin, bb_peterson,
+  bb_sem, bb_condvar or bb_lockfree (bb_condvar if not given), and the
+  Makefile builds one prodcons-pthreads-bb-<policy> for each.
+
+  The consumer checks that it gets the items in the order they were
+  produced, which bb_spin does not promise.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "boundedbuf.h"
+#include "placement.h"
+#include "waitstrategy.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+#ifndef NUMBER_OF_ITEMS
+#define NUMBER_OF_ITEMS 30
+#endif
+#ifndef BB_POLICY
+#define BB_POLICY bb_condvar
+#endif
+
+BOUNDED_BUFFER(int_buffer, int, BUFFER_SIZE, BB_POLICY)
+
+/* the shared data structures -- just global variables in this case */
+struct int_buffer buffer;
+BENCH_SHARED(bench)
+int out_of_order;
+
+/* how to wait for the buffer to change (see waitstrategy.h) */
+enum wait_policy policy;
+
+/* producer thread */
+void producer(void *args) {
+  int i;
+  struct waiter w;
+
+  place_thread(PLACE_PRODUCER, 0);
+  BENCH_PRODUCER_BEGIN(&bench);
+  wait_init(&w, policy, &buffer.not_full);
+
+  for (i=0; i<NUMBER_OF_ITEMS; i++) {
+
+    /* simulate the cost of producing the item by
+       sleeping for a small random number of seconds */
+    PRODUCER_WORK();
+
+    /* put the produced value in the buffer when there's space */
+    LOG("P: produced %d\n", i);
+    int_buffer_put(&buffer, i, &w);
+  }
+
+  BENCH_PRODUCER_END(&bench);
+  wait_report("P", &w);
+}
+
+/* consumer thread */
+void consumer(void *args) {
+  struct waiter w;
+  int i, value;
+
+  place_thread(PLACE_CONSUMER, 0);
+  BENCH_CONSUMER_BEGIN(NUMBER_OF_ITEMS);
+  wait_init(&w, policy, &buffer.not_empty);
+
+  for (i=0; i<NUMBER_OF_ITEMS; i++) {
+
+    /* consume the next available item */
+    value = int_buffer_get(&buffer, &w);
+    LOG("C: consumed value %d\n", value);
+    if (value != i) out_of_order++;
+
+    /* simulate the cost of consuming the item */
+    /* this is slightly longer than the producer to increase the
+       chances of filling up the buffer */
+    CONSUMER_WORK();
+  }
+
+  BENCH_CONSUMER_END(&bench, NUMBER_OF_ITEMS, BUFFER_SIZE);
+  wait_report("C", &w);
+}
+
+/* main program, just starts up the threads */
+int main(int argc, char *argv[]) {
+  pthread_t producer_id, consumer_id;
+  int rc;
+
+  policy = wait_policy_get(WAIT_SPIN);
+  int_buffer_init(&buffer, policy);
+
+  /* pin, bind and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_memory(&buffer, sizeof(buffer));
+
+  /* seed the random number generator on pid */
+  srand(getpid());
+
+  /* create the consumer */
+  rc = pthread_create(&consumer_id, NULL, (void *)&consumer, NULL);
+
+  if (rc != 0) {
+    fprintf(stderr, "Could not create consumer child thread\n");
+    exit(1);
+  }
+
+  /* create the producer */
+  rc = pthread_create(&producer_id, NULL, (void *)&producer, NULL);
+
+  if (rc != 0) {
+    fprintf(stderr, "Could not create producer child thread\n");
+    exit(1);
+  }
+
+  /* wait for the child threads to exit */
+  pthread_join(producer_id,NULL);
+  pthread_join(consumer_id,NULL);
+
+  int_buffer_destroy(&buffer);
+
+  if (out_of_order > 0) {
+    fprintf(stderr, "%d items out of order\n", out_of_order);
+    return 1;
+  }
+  return 0;
+}
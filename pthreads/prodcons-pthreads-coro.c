@@ -0,0 +1,279 @@
+/*
+  Producer-consumer example with pthreads
+
+  Many producers and consumers sharing one bounded queue, either as
+  coroutines taking turns on a few worker threads (see coro.h), or,
+  with -t, each as a thread of its own blocking on a mutex and
+  condition variables, to compare the two.
+
+  Usage: prodcons-pthreads-coro [-t] [-p producers] [-c consumers]
+				[-n items] [-w workers] [-b capacity]
+
+  Each producer puts -n items in the queue, and the producers' items
+  are shared out evenly among the consumers, so consumers must divide
+  producers * items.  -w is the number of worker threads for the
+  coroutines, and -b the capacity of the queue, a power of two.
+
+  At the end the program checks that every item was consumed exactly
+  once (by adding them up) and prints a line of CSV, under a header:
+  the mode, the producer and consumer counts, the number of threads,
+  items, items per second, and the most memory the process had
+  resident at once (its maximum resident set size).
+*/
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "coro.h"
+#include "placement.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+
+struct producer {
+  struct coro co;
+  int id;
+  long i;
+};
+
+struct consumer {
+  struct coro co;
+  int id;
+  long i;
+  int item;
+  long long sum;
+};
+
+/* the shared data structures */
+long items = 5;
+long per_consumer;
+struct coro_queue queue;
+
+/* the thread-per-party version of the queue, which uses its ring but
+   blocks threads on condition variables instead of parking coroutines */
+pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* what producer id's item i is, all different */
+static int item_value(int id, long i) {
+
+  return (int)(id * items + i);
+}
+
+/* producer coroutine */
+static int producer_coro(struct coro *c) {
+  struct producer *p = (struct producer *)c;
+
+  CORO_BEGIN(c);
+  for (p->i=0; p->i<items; p->i++) {
+    LOG("P%d: producing %d\n", p->id, item_value(p->id, p->i));
+    CORO_PUSH(c, &queue, item_value(p->id, p->i));
+  }
+  CORO_END(c);
+}
+
+/* consumer coroutine */
+static int consumer_coro(struct coro *c) {
+  struct consumer *k = (struct consumer *)c;
+
+  CORO_BEGIN(c);
+  for (k->i=0; k->i<per_consumer; k->i++) {
+    CORO_POP(c, &queue, k->item);
+    LOG("C%d: consumed %d\n", k->id, k->item);
+    k->sum += k->item;
+  }
+  CORO_END(c);
+}
+
+/* producer thread */
+static void *producer_thread(void *arg) {
+  struct producer *p = (struct producer *)arg;
+  int value;
+
+  for (p->i=0; p->i<items; p->i++) {
+    value = item_value(p->id, p->i);
+    LOG("P%d: producing %d\n", p->id, value);
+    pthread_mutex_lock(&queue.lock);
+    while (queue.in - queue.out == queue.capacity) {
+      pthread_cond_wait(&not_full, &queue.lock);
+    }
+    queue.items[queue.in++ & (queue.capacity - 1)] = value;
+    pthread_cond_signal(&not_empty);
+    pthread_mutex_unlock(&queue.lock);
+  }
+  return NULL;
+}
+
+/* consumer thread */
+static void *consumer_thread(void *arg) {
+  struct consumer *k = (struct consumer *)arg;
+
+  for (k->i=0; k->i<per_consumer; k->i++) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.in == queue.out) {
+      pthread_cond_wait(&not_empty, &queue.lock);
+    }
+    k->item = queue.items[queue.out++ & (queue.capacity - 1)];
+    pthread_cond_signal(&not_full);
+    pthread_mutex_unlock(&queue.lock);
+    LOG("C%d: consumed %d\n", k->id, k->item);
+    k->sum += k->item;
+  }
+  return NULL;
+}
+
+/* start a thread with a 64K stack rather than the default (8M of
+   address space), as anyone running thousands of them would */
+static int start_thread(pthread_t *id, void *(*func)(void *), void *arg) {
+  pthread_attr_t attr;
+  int rc;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+  rc = pthread_create(id, &attr, func, arg);
+  pthread_attr_destroy(&attr);
+  return rc;
+}
+
+int main(int argc, char *argv[]) {
+  struct coro_sched s;
+  struct producer *producers;
+  struct consumer *consumers;
+  pthread_t *threads;
+  struct rusage usage;
+  int nproducers = 4, nconsumers = 2, workers = 2, threaded = 0;
+  int capacity = BUFFER_SIZE;
+  int opt, i, nthreads;
+  long long start, elapsed, sum, expected;
+  long total;
+
+  while ((opt = getopt(argc, argv, "tp:c:n:w:b:")) != -1) {
+    switch (opt) {
+    case 't':
+      threaded = 1;
+      break;
+    case 'p':
+      nproducers = atoi(optarg);
+      break;
+    case 'c':
+      nconsumers = atoi(optarg);
+      break;
+    case 'n':
+      items = atol(optarg);
+      break;
+    case 'w':
+      workers = atoi(optarg);
+      break;
+    case 'b':
+      capacity = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-t] [-p producers] [-c consumers] "
+	      "[-n items] [-w workers] [-b capacity]\n", argv[0]);
+      exit(1);
+    }
+  }
+  total = nproducers * items;
+  if (nproducers < 1 || nconsumers < 1 || workers < 1 || items < 0 ||
+      total % nconsumers != 0) {
+    fprintf(stderr, "%s: need at least one producer, consumer and worker, "
+	    "and consumers dividing producers * items\n", argv[0]);
+    exit(1);
+  }
+  per_consumer = total / nconsumers;
+
+  if (coro_queue_init(&queue, capacity) == -1) {
+    fprintf(stderr, "%s: capacity must be a power of two\n", argv[0]);
+    exit(1);
+  }
+  producers = (struct producer *)calloc(nproducers, sizeof(struct producer));
+  consumers = (struct consumer *)calloc(nconsumers, sizeof(struct consumer));
+  if (producers == NULL || consumers == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+
+  /* pin and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+
+  start = now_ns();
+  if (threaded) {
+    nthreads = nproducers + nconsumers;
+    threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    if (threads == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+    for (i=0; i<nconsumers; i++) {
+      consumers[i].id = i;
+      if (start_thread(&threads[i], consumer_thread, &consumers[i]) != 0) {
+	fprintf(stderr, "Could not create consumer thread %d\n", i);
+	exit(1);
+      }
+    }
+    for (i=0; i<nproducers; i++) {
+      producers[i].id = i;
+      if (start_thread(&threads[nconsumers + i], producer_thread,
+		       &producers[i]) != 0) {
+	fprintf(stderr, "Could not create producer thread %d\n", i);
+	exit(1);
+      }
+    }
+    for (i=0; i<nthreads; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    free(threads);
+  }
+  else {
+    nthreads = workers;
+    coro_sched_init(&s, workers);
+    for (i=0; i<nconsumers; i++) {
+      consumers[i].id = i;
+      coro_spawn(&s, &consumers[i].co, consumer_coro);
+    }
+    for (i=0; i<nproducers; i++) {
+      producers[i].id = i;
+      coro_spawn(&s, &producers[i].co, producer_coro);
+    }
+    if (coro_sched_run(&s) == -1) exit(1);
+    coro_sched_destroy(&s);
+  }
+  elapsed = now_ns() - start;
+
+  /* every item once: 0 + 1 + ... + total-1 */
+  for (i=0, sum=0; i<nconsumers; i++) {
+    sum += consumers[i].sum;
+  }
+  expected = (long long)total * (total - 1) / 2;
+  if (sum != expected) {
+    fprintf(stderr, "%s: items add up to %lld, should be %lld\n", argv[0],
+	    sum, expected);
+  }
+
+  getrusage(RUSAGE_SELF, &usage);
+  printf("mode,producers,consumers,threads,items,items_per_sec,maxrss_kb\n");
+  printf("%s,%d,%d,%d,%ld,%.0f,%ld\n", threaded ? "threads" : "coroutines",
+	 nproducers, nconsumers, nthreads, total,
+	 elapsed > 0 ? total * 1e9 / elapsed : 0.0, usage.ru_maxrss);
+
+  coro_queue_destroy(&queue);
+  free(producers);
+  free(consumers);
+
+  return sum != expected;
+}
@@ -0,0 +1,282 @@
+/*
+  Producer-consumer example with pthreads
+
+  The blocking version of prodcons-pthreads-counter-mutex.c.  There
+  the mutex only protects the updates of counter, and a thread that
+  finds the buffer full or empty spins on counter until the other
+  thread changes it, burning a whole CPU while it waits.
+
+  Here the entire operation on the buffer (the full/empty test, the
+  update of buffer and in or out, and the update of counter) is done
+  while holding the mutex, and a thread that cannot proceed sleeps on
+  a condition variable, which atomically releases the mutex while it
+  waits:
+
+    not_full  - the producer waits here when counter == BUFFER_SIZE
+    not_empty - the consumer waits here when counter == 0
+
+  A signal is only sent when it could wake someone up: the producer
+  signals not_empty only when it takes the buffer from empty to
+  non-empty, and the consumer signals not_full only when it takes the
+  buffer from full to non-full.
+
+  Instead of counting spins, each thread counts how many times it had
+  to block and how long it spent blocked in total.
+
+  Based on prodcons-pthreads-counter-mutex.c by Jim Teresco
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "placement.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 5
+#endif
+#ifndef NUMBER_OF_ITEMS
+#define NUMBER_OF_ITEMS 30
+#endif
+
+/* the shared data structures -- just global variables in this case */
+int buffer[BUFFER_SIZE];
+BENCH_STAMPS(stamp, BUFFER_SIZE)
+BENCH_SHARED(bench)
+int in;
+int out;
+int counter;
+/* mutex to protect access to all of the above */
+pthread_mutex_t mutex;
+/* conditions to wait on when the buffer is full or empty */
+pthread_cond_t not_full;
+pthread_cond_t not_empty;
+
+/* current time in nanoseconds, for measuring time spent blocked */
+static long long now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* producer thread */
+void producer(void *args) {
+  int i;
+  int waits;
+  long blocked_waits = 0;
+  long long start, blocked_ns = 0;
+
+  place_thread(PLACE_PRODUCER, 0);
+  BENCH_PRODUCER_BEGIN(&bench);
+
+  for (i=0; i<NUMBER_OF_ITEMS; i++) {
+
+    /* simulate the cost of producing the item by
+       sleeping for a small random number of seconds */
+    PRODUCER_WORK();
+
+    /* put the produced value in the buffer when there's space */
+    LOG("P: produced %d\n", i);
+
+    if (pthread_mutex_lock(&mutex) != 0) {
+      perror("pthread_mutex_lock");
+      exit(1);
+    }
+
+    /* a while, not an if: we must recheck the condition after being
+       woken, since pthread_cond_wait is allowed to wake up spuriously */
+    waits = 0;
+    start = 0;
+    while (counter == BUFFER_SIZE) {
+      if (waits == 0) {
+	LOG("P: waiting for open slot\n");
+	BENCH_WAITING();
+	start = now_ns();
+      }
+      waits++;
+      if (pthread_cond_wait(&not_full, &mutex) != 0) {
+	perror("pthread_cond_wait");
+	exit(1);
+      }
+    }
+    if (waits > 0) {
+      blocked_waits++;
+      blocked_ns += now_ns() - start;
+      LOG("P: done waiting (woken %d times)\n", waits);
+      BENCH_PRODUCER_WAITED();
+    }
+
+    LOG("P: adding item %d at slot %d (counter=%d->%d)\n", i, in,
+	   counter, counter+1);
+
+    buffer[in] = i;
+    BENCH_ENQUEUED(stamp[in]);
+
+    in = (in + 1)%BUFFER_SIZE;
+    counter++;
+
+    /* wake the consumer only if it could be waiting */
+    if (counter == 1) {
+      if (pthread_cond_signal(&not_empty) != 0) {
+	perror("pthread_cond_signal");
+	exit(1);
+      }
+    }
+
+    if (pthread_mutex_unlock(&mutex) != 0) {
+      perror("pthread_mutex_unlock");
+      exit(1);
+    }
+  }
+
+  LOG("P: blocked %ld times, %.3f seconds total\n", blocked_waits,
+	 blocked_ns/1e9);
+
+  BENCH_PRODUCER_END(&bench);
+}
+
+/* consumer thread */
+void consumer(void *args) {
+  int i;
+  int waits;
+  long blocked_waits = 0;
+  long long start, blocked_ns = 0;
+
+  place_thread(PLACE_CONSUMER, 0);
+  BENCH_CONSUMER_BEGIN(NUMBER_OF_ITEMS);
+
+  for (i=0; i<NUMBER_OF_ITEMS; i++) {
+
+    if (pthread_mutex_lock(&mutex) != 0) {
+      perror("pthread_mutex_lock");
+      exit(1);
+    }
+
+    /* look for a value, sleeping until the producer adds one */
+    waits = 0;
+    start = 0;
+    while (counter == 0) {
+      if (waits == 0) {
+	LOG("C: waiting for item\n");
+	BENCH_WAITING();
+	start = now_ns();
+      }
+      waits++;
+      if (pthread_cond_wait(&not_empty, &mutex) != 0) {
+	perror("pthread_cond_wait");
+	exit(1);
+      }
+    }
+    if (waits > 0) {
+      blocked_waits++;
+      blocked_ns += now_ns() - start;
+      LOG("C: done waiting (woken %d times)\n", waits);
+      BENCH_CONSUMER_WAITED();
+    }
+
+    /* consume the next available item */
+    LOG("C: consuming value %d from slot %d (counter=%d->%d)\n",
+	   buffer[out], out, counter, counter-1);
+    BENCH_DEQUEUED(stamp[out]);
+    out = (out + 1)%BUFFER_SIZE;
+    counter--;
+
+    /* wake the producer only if it could be waiting */
+    if (counter == BUFFER_SIZE-1) {
+      if (pthread_cond_signal(&not_full) != 0) {
+	perror("pthread_cond_signal");
+	exit(1);
+      }
+    }
+
+    if (pthread_mutex_unlock(&mutex) != 0) {
+      perror("pthread_mutex_unlock");
+      exit(1);
+    }
+
+    /* simulate the cost of consuming the item */
+    /* this is slightly longer than the producer to increase the
+       chances of filling up the buffer */
+    CONSUMER_WORK();
+  }
+
+  LOG("C: blocked %ld times, %.3f seconds total\n", blocked_waits,
+	 blocked_ns/1e9);
+
+  BENCH_CONSUMER_END(&bench, NUMBER_OF_ITEMS, BUFFER_SIZE);
+}
+
+/* main program, just starts up the threads */
+int main(int argc, char *argv[]) {
+  pthread_t producer_id, consumer_id;
+  int rc;
+
+  /* initialize shared data */
+  in = 0;
+  out = 0;
+  counter = 0;
+
+  /* pin, bind and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_memory(buffer, sizeof(buffer));
+
+  /* seed the random number generator on pid */
+  srand(getpid());
+
+  /* initialize our mutex and condition variables */
+  if (pthread_mutex_init(&mutex, NULL) != 0) {
+    perror("pthread_mutex_init");
+    exit(1);
+  }
+  if (pthread_cond_init(&not_full, NULL) != 0) {
+    perror("pthread_cond_init");
+    exit(1);
+  }
+  if (pthread_cond_init(&not_empty, NULL) != 0) {
+    perror("pthread_cond_init");
+    exit(1);
+  }
+
+  /* create the consumer */
+  rc = pthread_create(&consumer_id, NULL, (void *)&consumer, NULL);
+
+  if (rc != 0) {
+    fprintf(stderr, "Could not create consumer child thread\n");
+    exit(1);
+  }
+
+  /* create the producer */
+  rc = pthread_create(&producer_id, NULL, (void *)&producer, NULL);
+
+  if (rc != 0) {
+    fprintf(stderr, "Could not create producer child thread\n");
+    exit(1);
+  }
+
+  /* wait for the child threads to exit */
+  pthread_join(producer_id,NULL);
+  pthread_join(consumer_id,NULL);
+
+  /* destroy our mutex and condition variables */
+  if (pthread_cond_destroy(&not_empty) != 0) {
+    perror("pthread_cond_destroy");
+    exit(1);
+  }
+  if (pthread_cond_destroy(&not_full) != 0) {
+    perror("pthread_cond_destroy");
+    exit(1);
+  }
+  if (pthread_mutex_destroy(&mutex) != 0) {
+    perror("pthread_mutex_destroy");
+    exit(1);
+  }
+
+  LOG("Final counter is %d\n", counter);
+
+  return 0;
+}
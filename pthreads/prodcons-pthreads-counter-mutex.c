@@ -17,46 +17,70 @@
 #include <stdlib.h>
 #include <pthread.h>
 
+#include "bench.h"
+#include "placement.h"
+#include "waitstrategy.h"
+
+#ifndef BUFFER_SIZE
 #define BUFFER_SIZE 5
+#endif
+#ifndef NUMBER_OF_ITEMS
 #define NUMBER_OF_ITEMS 30
+#endif
 
 /* the shared data structures -- just global variables in this case */
 int buffer[BUFFER_SIZE];
+BENCH_STAMPS(stamp, BUFFER_SIZE)
+BENCH_SHARED(bench)
 int in;
 int out;
 int counter;
 /* mutex to protect access to the counter variable */
 pthread_mutex_t mutex;
 
+/* how to wait for the buffer to change (see waitstrategy.h) */
+enum wait_policy policy;
+struct wait_queue not_full;
+struct wait_queue not_empty;
+
 /* producer thread */
 void producer(void *args) {
   int i;
   long spin;
+  struct waiter w;
+
+  place_thread(PLACE_PRODUCER, 0);
+  BENCH_PRODUCER_BEGIN(&bench);
+  wait_init(&w, policy, &not_full);
 
   for (i=0; i<NUMBER_OF_ITEMS; i++) {
     
     /* simulate the cost of producing the item by 
        sleeping for a small random number of seconds */
-    sleep(rand()%4+1);
+    PRODUCER_WORK();
     
     /* put the produced value in the buffer when there's space */
-    printf("P: produced %d\n", i);
+    LOG("P: produced %d\n", i);
     
     spin = 0;
     while (counter == BUFFER_SIZE) {
       if (spin == 0) {
-	printf("P: waiting for open slot\n");
+	LOG("P: waiting for open slot\n");
+	BENCH_WAITING();
       }
-      spin++;
+      wait_pause(&w, spin++);
     }
+    wait_done(&w);
     if (spin > 0) {
-      printf("P: done waiting (cycled %ld times)\n", spin);
+      LOG("P: done waiting (cycled %ld times)\n", spin);
+      BENCH_PRODUCER_WAITED();
     }
     
-    printf("P: adding item %d at slot %d (counter=%d->%d)\n", i, in,
+    LOG("P: adding item %d at slot %d (counter=%d->%d)\n", i, in,
 	   counter, counter+1);
     
     buffer[in] = i;
+    BENCH_ENQUEUED(stamp[in]);
     
     in = (in + 1)%BUFFER_SIZE;
     /* Need to protect this modification of counter with mutual exclusion */
@@ -72,31 +96,46 @@ void producer(void *args) {
       perror("pthread_mutex_unlock");
       exit(1);
     }
+
+    /* wake the consumer if it is parked waiting for an item */
+    wait_notify(&not_empty);
   }
+
+  BENCH_PRODUCER_END(&bench);
+  wait_report("P", &w);
 }
 
 /* consumer thread */
 void consumer(void *args) {
   long spin;
+  struct waiter w;
   int i;
   
+  place_thread(PLACE_CONSUMER, 0);
+  BENCH_CONSUMER_BEGIN(NUMBER_OF_ITEMS);
+  wait_init(&w, policy, &not_empty);
+
   for (i=0; i<NUMBER_OF_ITEMS; i++) {
     
     /* look for a value */
     spin = 0;
     while (counter == 0) {
       if (spin == 0) {
-	printf("C: waiting for item\n");
+	LOG("C: waiting for item\n");
+	BENCH_WAITING();
       }
-      spin++;
+      wait_pause(&w, spin++);
     }
+    wait_done(&w);
     if (spin > 0) {
-      printf("C: done waiting (cycled %ld times)\n", spin);
+      LOG("C: done waiting (cycled %ld times)\n", spin);
+      BENCH_CONSUMER_WAITED();
     }
     
     /* consume the next available item */
-    printf("C: consuming value %d from slot %d (counter=%d->%d)\n", 
+    LOG("C: consuming value %d from slot %d (counter=%d->%d)\n", 
 	   buffer[out], out, counter, counter-1);
+    BENCH_DEQUEUED(stamp[out]);
     out = (out + 1)%BUFFER_SIZE;
     /* Need to protect this modification of counter with mutual exclusion */
     if (pthread_mutex_lock(&mutex) != 0) {
@@ -112,11 +151,17 @@ void consumer(void *args) {
       exit(1);
     }
     
+    /* wake the producer if it is parked waiting for a slot */
+    wait_notify(&not_full);
+
     /* simulate the cost of consuming the item */
     /* this is slightly longer than the producer to increase the
        chances of filling up the buffer */
-    sleep(rand()%5+1);
+    CONSUMER_WORK();
   }
+
+  BENCH_CONSUMER_END(&bench, NUMBER_OF_ITEMS, BUFFER_SIZE);
+  wait_report("C", &w);
 }
 
 /* main program, just starts up the threads */
@@ -129,6 +174,14 @@ int main(int argc, char *argv[]) {
   out = 0;
   counter = 0;
 
+  policy = wait_policy_get(WAIT_SPIN);
+  wait_queue_init(&not_full, policy);
+  wait_queue_init(&not_empty, policy);
+
+  /* pin, bind and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_memory(buffer, sizeof(buffer));
+
   /* seed the random number generator on pid */
   srand(getpid());
 
@@ -164,7 +217,7 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
  
-  printf("Final counter is %d\n", counter);
+  LOG("Final counter is %d\n", counter);
 
   return 0;
 }
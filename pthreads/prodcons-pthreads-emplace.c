@@ -0,0 +1,201 @@
+/*
+  Producer-consumer example with pthreads
+
+  Items that own memory, in a bounded buffer from boundedbuf.h.  Each
+  message has some text in a buffer of its own on the heap.  The
+  producer builds the message right in its slot (name_emplace) and the
+  consumer reads it right there (name_consume) and frees the text, so
+  the text is allocated once and never copied, and only its pointer
+  passes through the buffer.  Copying the message in and out with put
+  and get would do no harm here, but a message that kept its text in
+  the struct would be copied twice.
+
+  The consumer stops LEFTOVER items short, leaving them in the buffer,
+  and msg_buffer_destroy frees their text with the destructor given to
+  BOUNDED_BUFFER_DTOR.  At the end every text allocated must have been
+  freed exactly once.
+
+  The policy is -DBB_POLICY, as for prodcons-pthreads-bb.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "boundedbuf.h"
+#include "placement.h"
+#include "waitstrategy.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+#ifndef NUMBER_OF_ITEMS
+#define NUMBER_OF_ITEMS 30
+#endif
+#ifndef BB_POLICY
+#define BB_POLICY bb_condvar
+#endif
+/* items the consumer leaves behind, at most BUFFER_SIZE */
+#ifndef LEFTOVER
+#define LEFTOVER 3
+#endif
+
+#define CONSUMED (NUMBER_OF_ITEMS - LEFTOVER)
+
+struct message {
+  int seq;
+  size_t len;
+  /* owned by the message: whoever has the message frees it */
+  char *text;
+};
+
+/* texts allocated and freed, which should come out the same */
+atomic_long allocated;
+atomic_long freed;
+
+static void message_free(struct message *m) {
+
+  free(m->text);
+  m->text = NULL;
+  atomic_fetch_add(&freed, 1);
+}
+
+BOUNDED_BUFFER_DTOR(msg_buffer, struct message, BUFFER_SIZE, BB_POLICY,
+		    message_free)
+
+/* the shared data structures -- just global variables in this case */
+struct msg_buffer buffer;
+BENCH_SHARED(bench)
+int bad;
+
+/* how to wait for the buffer to change (see waitstrategy.h) */
+enum wait_policy policy;
+
+/* producer thread */
+void producer(void *args) {
+  int i;
+  struct waiter w;
+  struct message *m;
+
+  place_thread(PLACE_PRODUCER, 0);
+  BENCH_PRODUCER_BEGIN(&bench);
+  wait_init(&w, policy, &buffer.not_full);
+
+  for (i=0; i<NUMBER_OF_ITEMS; i++) {
+
+    /* simulate the cost of producing the item by
+       sleeping for a small random number of seconds */
+    PRODUCER_WORK();
+
+    /* build the message in the next free slot */
+    m = msg_buffer_emplace(&buffer, &w);
+    m->seq = i;
+    m->len = 16 + i % 48;
+    m->text = (char *)malloc(m->len + 1);
+    if (m->text == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    memset(m->text, 'a' + i % 26, m->len);
+    m->text[m->len] = '\0';
+    atomic_fetch_add(&allocated, 1);
+    LOG("P: produced message %d (%zu bytes)\n", i, m->len);
+    /* and hand it over: m is the consumer's now */
+    msg_buffer_commit(&buffer);
+  }
+
+  BENCH_PRODUCER_END(&bench);
+  wait_report("P", &w);
+}
+
+/* consumer thread */
+void consumer(void *args) {
+  struct waiter w;
+  struct message *m;
+  int i;
+
+  place_thread(PLACE_CONSUMER, 0);
+  BENCH_CONSUMER_BEGIN(CONSUMED);
+  wait_init(&w, policy, &buffer.not_empty);
+
+  for (i=0; i<CONSUMED; i++) {
+
+    /* use the message where it is, then free what it owns */
+    m = msg_buffer_consume(&buffer, &w);
+    LOG("C: consuming message %d: %c... (%zu bytes)\n", m->seq, m->text[0],
+	m->len);
+    if (m->seq != i || strlen(m->text) != m->len ||
+	m->text[0] != 'a' + i % 26) {
+      bad++;
+    }
+    message_free(m);
+    msg_buffer_release(&buffer);
+
+    /* simulate the cost of consuming the item */
+    /* this is slightly longer than the producer to increase the
+       chances of filling up the buffer */
+    CONSUMER_WORK();
+  }
+
+  BENCH_CONSUMER_END(&bench, CONSUMED, BUFFER_SIZE);
+  wait_report("C", &w);
+}
+
+/* main program, just starts up the threads */
+int main(int argc, char *argv[]) {
+  pthread_t producer_id, consumer_id;
+  int rc;
+
+  _Static_assert(LEFTOVER >= 0 && LEFTOVER <= BUFFER_SIZE &&
+		 LEFTOVER <= NUMBER_OF_ITEMS,
+		 "LEFTOVER must fit in the buffer");
+
+  atomic_init(&allocated, 0);
+  atomic_init(&freed, 0);
+  policy = wait_policy_get(WAIT_SPIN);
+  msg_buffer_init(&buffer, policy);
+
+  /* pin, bind and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_memory(&buffer, sizeof(buffer));
+
+  /* seed the random number generator on pid */
+  srand(getpid());
+
+  /* create the consumer */
+  rc = pthread_create(&consumer_id, NULL, (void *)&consumer, NULL);
+
+  if (rc != 0) {
+    fprintf(stderr, "Could not create consumer child thread\n");
+    exit(1);
+  }
+
+  /* create the producer */
+  rc = pthread_create(&producer_id, NULL, (void *)&producer, NULL);
+
+  if (rc != 0) {
+    fprintf(stderr, "Could not create producer child thread\n");
+    exit(1);
+  }
+
+  /* wait for the child threads to exit */
+  pthread_join(producer_id,NULL);
+  pthread_join(consumer_id,NULL);
+
+  /* this frees the messages the consumer left */
+  msg_buffer_destroy(&buffer);
+
+  LOG("%ld texts allocated, %ld freed\n", atomic_load(&allocated),
+      atomic_load(&freed));
+  if (bad > 0 || atomic_load(&allocated) != atomic_load(&freed)) {
+    fprintf(stderr, "%d messages wrong, %ld texts allocated, %ld freed\n",
+	    bad, atomic_load(&allocated), atomic_load(&freed));
+    return 1;
+  }
+  return 0;
+}
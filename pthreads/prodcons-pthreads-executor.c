@@ -0,0 +1,266 @@
+/*
+  Producer-consumer example with pthreads
+
+  The consumer loop as a reusable pool (see executor.h): main is the
+  producer, submitting tasks to a fixed set of worker threads, or, with
+  -t, starting a thread for each task instead, to compare the two.
+
+  Usage: prodcons-pthreads-executor [-t] [-n tasks] [-w workers]
+				    [-b capacity] [-s bytes] [-k bulk]
+				    [-u work ns]
+
+  Each task's closure is -s bytes (at least the few it needs, and
+  copied into the buffer's slot if it is at most EXEC_INLINE), and the
+  task spins for -u nanoseconds.  With -k, tasks are submitted that
+  many at a time with exec_submit_bulk and futures; otherwise one at a
+  time with exec_submit_then and a done function.
+
+  Every task notes how long it was from being submitted to starting.
+  At the end the program checks that every task ran exactly once, and
+  prints a line of CSV, under a header: the mode, tasks, workers,
+  closure bytes, tasks per second from the first submit to the last
+  task done, and percentiles of that submit-to-start latency in ns.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "executor.h"
+#include "histogram.h"
+#include "placement.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 64
+#endif
+
+/* what every closure starts with; the rest of its bytes are padding */
+struct job {
+  long long submitted;
+  long id;
+};
+
+/* the shared data structures */
+long long *latency;
+/* how many times each task has run */
+atomic_int *ran;
+/* tasks done, counted by the done function or the task's thread */
+atomic_long runs;
+long tasks = 20;
+long work_ns;
+/* for -t, so that main can wait for the last thread */
+pthread_mutex_t all_done_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t all_done = PTHREAD_COND_INITIALIZER;
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* the task itself */
+static void run_job(void *arg, int worker) {
+  struct job *j = (struct job *)arg;
+  long long start = now_ns(), until;
+
+  atomic_fetch_add(&ran[j->id], 1);
+  latency[j->id] = start - j->submitted;
+  LOG("W%d: task %ld started after %lld ns\n", worker, j->id,
+      latency[j->id]);
+  until = start + work_ns;
+  while (now_ns() < until);
+}
+
+/* the done function for exec_submit_then */
+static void job_done(void *done_arg) {
+
+  atomic_fetch_add((atomic_long *)done_arg, 1);
+}
+
+/* a thread for one task, for -t */
+static void *job_thread(void *arg) {
+
+  run_job(arg, 0);
+  free(arg);
+  if (atomic_fetch_add(&runs, 1) + 1 == tasks) {
+    pthread_mutex_lock(&all_done_lock);
+    pthread_cond_signal(&all_done);
+    pthread_mutex_unlock(&all_done_lock);
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  struct executor e;
+  struct exec_future *futures = NULL;
+  struct histogram h;
+  pthread_attr_t attr;
+  pthread_t id;
+  char *closures;
+  struct job *j;
+  int threaded = 0, workers = 2, capacity = BUFFER_SIZE, bulk = 0;
+  size_t size = sizeof(struct job);
+  int opt, n;
+  long i, k, bad;
+  long long start, elapsed;
+
+  while ((opt = getopt(argc, argv, "tn:w:b:s:k:u:")) != -1) {
+    switch (opt) {
+    case 't':
+      threaded = 1;
+      break;
+    case 'n':
+      tasks = atol(optarg);
+      break;
+    case 'w':
+      workers = atoi(optarg);
+      break;
+    case 'b':
+      capacity = atoi(optarg);
+      break;
+    case 's':
+      size = atol(optarg);
+      break;
+    case 'k':
+      bulk = atoi(optarg);
+      break;
+    case 'u':
+      work_ns = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-t] [-n tasks] [-w workers] "
+	      "[-b capacity] [-s bytes] [-k bulk] [-u work ns]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (tasks < 1 || size < sizeof(struct job) || bulk < 0 || work_ns < 0) {
+    fprintf(stderr, "%s: need a task, closures of at least %zu bytes, "
+	    "and bulk and work ns >= 0\n", argv[0], sizeof(struct job));
+    exit(1);
+  }
+
+  /* the closures, built up front so that building them is not timed */
+  latency = (long long *)calloc(tasks, sizeof(long long));
+  closures = (char *)calloc(tasks, size);
+  ran = (atomic_int *)calloc(tasks, sizeof(atomic_int));
+  if (bulk > 0) {
+    futures = (struct exec_future *)calloc(bulk, sizeof(struct exec_future));
+  }
+  if (latency == NULL || closures == NULL || ran == NULL ||
+      (bulk > 0 && futures == NULL)) {
+    perror("calloc");
+    exit(1);
+  }
+  for (i=0; i<tasks; i++) {
+    ((struct job *)(closures + i * size))->id = i;
+    atomic_init(&ran[i], 0);
+  }
+  atomic_init(&runs, 0);
+
+  /* pin and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_thread(PLACE_PRODUCER, 0);
+
+  start = now_ns();
+  if (threaded) {
+    /* a thread per task, each with its own copy of its closure, as
+       anyone starting threads for tasks has to */
+    workers = 0;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    for (i=0; i<tasks; i++) {
+      j = (struct job *)malloc(size);
+      if (j == NULL) {
+	perror("malloc");
+	exit(1);
+      }
+      memcpy(j, closures + i * size, size);
+      j->submitted = now_ns();
+      if (pthread_create(&id, &attr, job_thread, j) != 0) {
+	fprintf(stderr, "Could not create thread for task %ld\n", i);
+	exit(1);
+      }
+    }
+    pthread_attr_destroy(&attr);
+    pthread_mutex_lock(&all_done_lock);
+    while (atomic_load(&runs) < tasks) {
+      pthread_cond_wait(&all_done, &all_done_lock);
+    }
+    pthread_mutex_unlock(&all_done_lock);
+  }
+  else {
+    if (exec_init(&e, workers, capacity) == -1) exit(1);
+    if (bulk > 0) {
+      /* bulk at a time, waiting for each lot to finish before reusing
+	 its futures */
+      for (i=0; i<tasks; i+=n) {
+	n = tasks - i < bulk ? tasks - i : bulk;
+	for (k=0; k<n; k++) {
+	  ((struct job *)(closures + (i + k) * size))->submitted = now_ns();
+	}
+	if (exec_submit_bulk(&e, run_job, closures + i * size, size, n,
+			     futures) != n) {
+	  fprintf(stderr, "%s: executor shut down\n", argv[0]);
+	  exit(1);
+	}
+	for (k=0; k<n; k++) {
+	  exec_future_wait(&futures[k]);
+	}
+      }
+    }
+    else {
+      for (i=0; i<tasks; i++) {
+	j = (struct job *)(closures + i * size);
+	j->submitted = now_ns();
+	if (exec_submit_then(&e, run_job, j, size, job_done, &runs) == -1) {
+	  fprintf(stderr, "%s: executor shut down\n", argv[0]);
+	  exit(1);
+	}
+      }
+    }
+    /* runs everything still queued before it returns */
+    exec_shutdown(&e);
+    exec_destroy(&e);
+  }
+  elapsed = now_ns() - start;
+
+  /* every task once, and (but for -k, which has futures instead) a
+     done function or thread finishing for each */
+  hist_init(&h);
+  for (i=0, bad=0; i<tasks; i++) {
+    if (atomic_load(&ran[i]) != 1) bad++;
+    else hist_record(&h, latency[i]);
+  }
+  if (bad > 0) {
+    fprintf(stderr, "%s: %ld tasks did not run exactly once\n", argv[0],
+	    bad);
+  }
+  if (bulk == 0 && atomic_load(&runs) != tasks) {
+    fprintf(stderr, "%s: %ld finished for %ld tasks\n", argv[0],
+	    atomic_load(&runs), tasks);
+    bad++;
+  }
+
+  printf("mode,tasks,workers,closure_bytes,tasks_per_sec,p50_ns,p99_ns,"
+	 "p999_ns\n");
+  printf("%s,%ld,%d,%zu,%.0f,%lld,%lld,%lld\n",
+	 threaded ? "thread-per-task" : bulk > 0 ? "executor-bulk" :
+	 "executor", tasks, workers, size, tasks * 1e9 / elapsed,
+	 hist_percentile(&h, 0.5), hist_percentile(&h, 0.99),
+	 hist_percentile(&h, 0.999));
+
+  free(latency);
+  free(closures);
+  free(futures);
+  free(ran);
+
+  return bad > 0;
+}
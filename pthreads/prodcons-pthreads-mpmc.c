@@ -0,0 +1,270 @@
+/*
+  Producer-consumer example with pthreads
+
+  Any number of producer and consumer threads sharing one bounded
+  buffer, using the lock-free queue in mpmc.h: each producer and
+  consumer claims its slot with a single compare-and-swap, and no
+  thread ever holds a lock.
+
+  Usage: prodcons-pthreads-mpmc [-p producers] [-c consumers]
+			       [-n items per producer] [-b buffer size]
+
+  Producer k produces the items k*n .. k*n+n-1, so every item has a
+  distinct value.  Each consumer marks every value it removes in a
+  shared table and complains immediately if some other consumer
+  already saw it, and at the end main checks that every value was
+  seen exactly once.
+
+  When a producer finds the buffer full or a consumer finds it empty
+  it waits as WAIT_POLICY says (see waitstrategy.h), by default
+  spinning for a while and then calling sched_yield between attempts.
+  Once all producers are done, main puts one end marker per consumer
+  into the buffer to tell them to stop.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "mpmc.h"
+#include "placement.h"
+#include "waitstrategy.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+#ifndef NUMBER_OF_ITEMS
+#define NUMBER_OF_ITEMS 30
+#endif
+#define MAX_THREADS 256
+
+/* the value put in the buffer to tell a consumer to stop */
+#define END_MARKER -1
+
+/* the shared data structures */
+struct mpmc_queue queue;
+int items_per_producer;
+/* seen[v] counts how many times value v has been consumed */
+atomic_uchar *seen;
+/* how to wait when the queue is full or empty */
+enum wait_policy policy;
+struct wait_queue not_full;
+struct wait_queue not_empty;
+
+/* per-thread arguments and results */
+struct thread_info {
+  pthread_t id;
+  int number;
+  long items;
+  long duplicates;
+  struct waiter wait;
+};
+
+/* keep trying to enqueue value, returns number of failed attempts */
+static long enqueue_wait(struct waiter *w, int value) {
+  long spin = 0;
+
+  while (!mpmc_enqueue(&queue, value)) {
+    wait_pause(w, spin++);
+  }
+  wait_done(w);
+  wait_notify(&not_empty);
+  return spin;
+}
+
+/* producer thread */
+void *producer(void *args) {
+  struct thread_info *me = (struct thread_info *)args;
+  int i, value;
+  long spin;
+
+  place_thread(PLACE_PRODUCER, me->number);
+
+  for (i=0; i<items_per_producer; i++) {
+
+    /* simulate the cost of producing the item */
+    PRODUCER_WORK();
+
+    value = me->number * items_per_producer + i;
+    LOG("P%d: produced %d\n", me->number, value);
+
+    spin = enqueue_wait(&me->wait, value);
+    if (spin > 0) {
+      LOG("P%d: waited for open slot (cycled %ld times)\n", me->number,
+	  spin);
+    }
+    me->items++;
+  }
+  return NULL;
+}
+
+/* consumer thread */
+void *consumer(void *args) {
+  struct thread_info *me = (struct thread_info *)args;
+  int value;
+  long spin;
+
+  place_thread(PLACE_CONSUMER, me->number);
+
+  for (;;) {
+
+    /* look for a value */
+    spin = 0;
+    while (!mpmc_dequeue(&queue, &value)) {
+      wait_pause(&me->wait, spin++);
+    }
+    wait_done(&me->wait);
+    wait_notify(&not_full);
+    if (spin > 0) {
+      LOG("C%d: waited for item (cycled %ld times)\n", me->number, spin);
+    }
+
+    if (value == END_MARKER) break;
+
+    /* make sure nobody else has consumed this one */
+    if (atomic_fetch_add(&seen[value], 1) != 0) {
+      fprintf(stderr, "C%d: value %d consumed more than once!\n",
+	      me->number, value);
+      me->duplicates++;
+    }
+    LOG("C%d: consumed value %d\n", me->number, value);
+    me->items++;
+
+    /* simulate the cost of consuming the item */
+    CONSUMER_WORK();
+  }
+  return NULL;
+}
+
+/* create nthreads threads running func, numbering them from 0 */
+static void start_threads(struct thread_info *threads, int nthreads,
+			  void *(*func)(void *), struct wait_queue *q,
+			  char *what) {
+  int i;
+
+  for (i=0; i<nthreads; i++) {
+    threads[i].number = i;
+    wait_init(&threads[i].wait, policy, q);
+    if (pthread_create(&threads[i].id, NULL, func, &threads[i]) != 0) {
+      fprintf(stderr, "Could not create %s thread %d\n", what, i);
+      exit(1);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct thread_info *producers, *consumers;
+  int nproducers = 2, nconsumers = 2, buffer_size = BUFFER_SIZE;
+  int opt, i;
+  long v, total, missing, duplicates;
+  struct waiter main_wait;
+  char who[32];
+  struct timespec start, end;
+  double elapsed;
+
+  items_per_producer = NUMBER_OF_ITEMS;
+  while ((opt = getopt(argc, argv, "p:c:n:b:")) != -1) {
+    switch (opt) {
+    case 'p':
+      nproducers = atoi(optarg);
+      break;
+    case 'c':
+      nconsumers = atoi(optarg);
+      break;
+    case 'n':
+      items_per_producer = atoi(optarg);
+      break;
+    case 'b':
+      buffer_size = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-p producers] [-c consumers] "
+	      "[-n items per producer] [-b buffer size]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (nproducers < 1 || nproducers > MAX_THREADS ||
+      nconsumers < 1 || nconsumers > MAX_THREADS ||
+      items_per_producer < 0) {
+    fprintf(stderr, "%s: need 1 to %d producers and consumers\n", argv[0],
+	    MAX_THREADS);
+    exit(1);
+  }
+  if (mpmc_init(&queue, buffer_size) == -1) {
+    fprintf(stderr, "%s: buffer size must be a power of two\n", argv[0]);
+    exit(1);
+  }
+
+  total = (long)nproducers * items_per_producer;
+  seen = (atomic_uchar *)calloc(total, sizeof(atomic_uchar));
+  producers = (struct thread_info *)calloc(nproducers,
+					   sizeof(struct thread_info));
+  consumers = (struct thread_info *)calloc(nconsumers,
+					   sizeof(struct thread_info));
+  if (seen == NULL || producers == NULL || consumers == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+
+  policy = wait_policy_get(WAIT_YIELD);
+  wait_queue_init(&not_full, policy);
+  wait_queue_init(&not_empty, policy);
+  wait_init(&main_wait, policy, &not_full);
+
+  /* pin, bind and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_memory(queue.slots, (queue.mask + 1) * sizeof(struct mpmc_slot));
+
+  /* seed the random number generator on pid */
+  srand(getpid());
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  start_threads(consumers, nconsumers, consumer, &not_empty, "consumer");
+  start_threads(producers, nproducers, producer, &not_full, "producer");
+
+  /* when the producers are all done, tell each consumer to stop */
+  for (i=0; i<nproducers; i++) {
+    pthread_join(producers[i].id, NULL);
+  }
+  for (i=0; i<nconsumers; i++) {
+    enqueue_wait(&main_wait, END_MARKER);
+  }
+  for (i=0; i<nconsumers; i++) {
+    pthread_join(consumers[i].id, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+
+  for (i=0; i<nproducers; i++) {
+    printf("Producer %d: %ld items\n", i, producers[i].items);
+    sprintf(who, "P%d", i);
+    wait_report(who, &producers[i].wait);
+  }
+  duplicates = 0;
+  for (i=0; i<nconsumers; i++) {
+    printf("Consumer %d: %ld items\n", i, consumers[i].items);
+    sprintf(who, "C%d", i);
+    wait_report(who, &consumers[i].wait);
+    duplicates += consumers[i].duplicates;
+  }
+
+  /* every value should have been seen exactly once */
+  missing = 0;
+  for (v=0; v<total; v++) {
+    if (atomic_load(&seen[v]) == 0) missing++;
+  }
+  printf("%ld items in %.3f seconds (%.0f items/sec), "
+	 "%ld missing, %ld duplicated\n", total, elapsed, total / elapsed,
+	 missing, duplicates);
+
+  mpmc_destroy(&queue);
+  free(seen);
+  free(producers);
+  free(consumers);
+
+  return (missing == 0 && duplicates == 0) ? 0 : 1;
+}
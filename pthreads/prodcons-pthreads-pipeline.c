@@ -0,0 +1,250 @@
+/*
+  Producer-consumer example with pthreads
+
+  A four-stage pipeline, parse -> enrich -> aggregate -> sink, built
+  with pipeline.h: each stage has its own workers and its own bounded
+  queue, and main feeds the items into the first one.
+
+  Usage: prodcons-pthreads-pipeline [-n items] [-w workers] [-c costs]
+				    [-b capacity] [-u unit ns]
+
+  -w and -c take one number per stage, separated by commas: how many
+  workers the stage has (default 1,2,1,1) and how many units of work
+  it does on each item (default 1,3,1,1).  -b is the capacity of every
+  stage's queue, a power of two.  A unit is a second of sleeping by
+  default, or -u nanoseconds of spinning.
+
+  Item i is record i.  parse fills in its key and value from i and
+  drops every tenth record as malformed, enrich scales the value by a
+  rate looked up by key, aggregate adds it to its key's total, and
+  sink counts it.  At the end main works the totals out again on its
+  own and checks that the pipeline got the same ones, then prints each
+  stage's counters (see pipeline.h), which show which stage held the
+  others up.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "pipeline.h"
+#include "placement.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+#ifndef NUMBER_OF_ITEMS
+#define NUMBER_OF_ITEMS 30
+#endif
+#define STAGES 4
+#define KEYS 16
+
+struct record {
+  int key;
+  long value;
+};
+
+/* the shared data structures */
+struct record *records;
+long rate[KEYS];
+atomic_long totals[KEYS];
+atomic_long sunk;
+long unit_ns;
+int costs[STAGES] = { 1, 3, 1, 1 };
+
+static const char *stage_names[STAGES] = {
+  "parse", "enrich", "aggregate", "sink"
+};
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* simulate the cost of a stage's work on an item */
+static void work(int units) {
+  long long until;
+
+  if (unit_ns == 0) {
+    sleep(units);
+  }
+  else {
+    until = now_ns() + units * unit_ns;
+    while (now_ns() < until);
+  }
+}
+
+static uint32_t hash(int i) {
+
+  return (uint32_t)i * 2654435761u;
+}
+
+/* what parse makes of record i, 0 if it is malformed */
+static int parse_record(int i, struct record *r) {
+
+  if (i % 10 == 9) return 0;
+  r->key = (hash(i) >> 16) % KEYS;
+  r->value = i % 100;
+  return 1;
+}
+
+static int parse(int i, void *arg, int worker) {
+
+  work(costs[0]);
+  if (!parse_record(i, &records[i])) {
+    LOG("parse W%d: dropping malformed record %d\n", worker, i);
+    return PIPELINE_DROP;
+  }
+  LOG("parse W%d: record %d has key %d\n", worker, i, records[i].key);
+  return i;
+}
+
+static int enrich(int i, void *arg, int worker) {
+
+  work(costs[1]);
+  records[i].value *= rate[records[i].key];
+  LOG("enrich W%d: record %d is worth %ld\n", worker, i, records[i].value);
+  return i;
+}
+
+static int aggregate(int i, void *arg, int worker) {
+
+  work(costs[2]);
+  atomic_fetch_add(&totals[records[i].key], records[i].value);
+  LOG("aggregate W%d: added record %d to key %d\n", worker, i,
+      records[i].key);
+  return i;
+}
+
+static int sink(int i, void *arg, int worker) {
+
+  work(costs[3]);
+  atomic_fetch_add(&sunk, 1);
+  LOG("sink W%d: record %d done\n", worker, i);
+  return i;
+}
+
+static pipeline_func stage_funcs[STAGES] = {
+  parse, enrich, aggregate, sink
+};
+
+/* parse a comma-separated list of STAGES numbers, each at least min */
+static int parse_list(char *list, int *values, int min) {
+  char *s;
+  int i;
+
+  for (i=0, s=strtok(list, ","); s != NULL; i++, s=strtok(NULL, ",")) {
+    if (i == STAGES || (values[i] = atoi(s)) < min) return -1;
+  }
+  return i == STAGES ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+  struct pipeline p;
+  struct record r;
+  int workers[STAGES] = { 1, 2, 1, 1 };
+  int capacity = BUFFER_SIZE, items = NUMBER_OF_ITEMS;
+  int opt, i, k, bad;
+  long expected[KEYS], valid;
+
+  while ((opt = getopt(argc, argv, "n:w:c:b:u:")) != -1) {
+    switch (opt) {
+    case 'n':
+      items = atoi(optarg);
+      break;
+    case 'w':
+      if (parse_list(optarg, workers, 1) == -1) {
+	fprintf(stderr, "%s: -w needs %d worker counts of at least 1\n",
+		argv[0], STAGES);
+	exit(1);
+      }
+      break;
+    case 'c':
+      if (parse_list(optarg, costs, 0) == -1) {
+	fprintf(stderr, "%s: -c needs %d costs of at least 0\n", argv[0],
+		STAGES);
+	exit(1);
+      }
+      break;
+    case 'b':
+      capacity = atoi(optarg);
+      break;
+    case 'u':
+      unit_ns = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n items] [-w workers] [-c costs] "
+	      "[-b capacity] [-u unit ns]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (items < 0 || unit_ns < 0) {
+    fprintf(stderr, "%s: need items >= 0 and unit ns >= 0\n", argv[0]);
+    exit(1);
+  }
+
+  records = (struct record *)calloc(items > 0 ? items : 1,
+				    sizeof(struct record));
+  if (records == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for (k=0; k<KEYS; k++) {
+    rate[k] = k + 1;
+    atomic_init(&totals[k], 0);
+  }
+  atomic_init(&sunk, 0);
+
+  /* pin and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_thread(PLACE_PRODUCER, 0);
+
+  pipeline_init(&p);
+  for (i=0; i<STAGES; i++) {
+    if (pipeline_stage(&p, stage_names[i], workers[i], capacity,
+		       stage_funcs[i], NULL) == -1) {
+      exit(1);
+    }
+  }
+  if (pipeline_start(&p) == -1) exit(1);
+
+  for (i=0; i<items; i++) {
+    LOG("main: feeding record %d\n", i);
+    pipeline_put(&p, i);
+  }
+  pipeline_finish(&p);
+
+  pipeline_report(&p, stdout);
+
+  /* the totals should be what we get doing it all ourselves */
+  memset(expected, 0, sizeof(expected));
+  for (i=0, valid=0; i<items; i++) {
+    if (parse_record(i, &r)) {
+      expected[r.key] += r.value * rate[r.key];
+      valid++;
+    }
+  }
+  bad = atomic_load(&sunk) != valid;
+  for (k=0; k<KEYS; k++) {
+    if (atomic_load(&totals[k]) != expected[k]) {
+      fprintf(stderr, "key %d: total %ld, should be %ld\n", k,
+	      atomic_load(&totals[k]), expected[k]);
+      bad = 1;
+    }
+  }
+  printf("%d records, %ld valid, %ld reached the sink, totals %s\n", items,
+	 valid, atomic_load(&sunk), bad ? "WRONG" : "right");
+
+  pipeline_destroy(&p);
+  free(records);
+
+  return bad;
+}
@@ -0,0 +1,234 @@
+/*
+  Producer-consumer example with pthreads
+
+  A lock-free single-producer/single-consumer version of the
+  "one empty slot" program.  As there, no variable is written by both
+  threads: the producer is the only writer of in and the consumer is
+  the only writer of out.  The differences are
+
+  - in and out are C11 atomics, and each side publishes its index with
+    a release store and reads the other's with an acquire load, so the
+    item stored in the buffer is guaranteed to be visible before the
+    index that announces it
+
+  - in and out are 64-bit sequence numbers that only ever increase
+    (they will not wrap in the lifetime of the program), so the slot
+    is just the low bits of the sequence number (BUFFER_SIZE must be a
+    power of two) and no % is needed.  Since in-out is always the
+    exact number of items in the buffer, we no longer need to sacrifice
+    a slot to tell a full buffer from an empty one.
+
+  - in and out live on separate cache lines, and each side keeps a
+    private cached copy of the other side's index.  The shared line is
+    only read when the cached copy says the buffer is full (producer)
+    or empty (consumer), so in steady state each line stays in the
+    cache of the core that writes it.
+
+  Based on prodcons-pthreads-oneempty.c by Jim Teresco
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "placement.h"
+#include "waitstrategy.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+#define BUFFER_MASK (BUFFER_SIZE - 1)
+#ifndef NUMBER_OF_ITEMS
+#define NUMBER_OF_ITEMS 30
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+_Static_assert((BUFFER_SIZE & BUFFER_MASK) == 0,
+	       "BUFFER_SIZE must be a power of two");
+
+/* shared variables -- each group on its own cache line(s) */
+_Alignas(CACHE_LINE_SIZE) int buffer[BUFFER_SIZE];
+BENCH_STAMPS(stamp, BUFFER_SIZE)
+BENCH_SHARED(bench)
+
+/* written only by the producer (except when the consumer parks on
+   not_empty, see waitstrategy.h) */
+struct {
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t in;
+  struct wait_queue not_empty;
+} producer_line;
+
+/* written only by the consumer (except when the producer parks) */
+struct {
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t out;
+  struct wait_queue not_full;
+} consumer_line;
+
+/* how to wait for the other side */
+enum wait_policy policy;
+
+/* producer thread */
+void producer(void *args) {
+  int i;
+  long spin;
+  struct waiter w;
+  uint64_t in, out_cache;
+
+  /* only the producer writes in, so a relaxed load is enough here */
+  in = atomic_load_explicit(&producer_line.in, memory_order_relaxed);
+  out_cache = atomic_load_explicit(&consumer_line.out, memory_order_acquire);
+
+  place_thread(PLACE_PRODUCER, 0);
+  BENCH_PRODUCER_BEGIN(&bench);
+  wait_init(&w, policy, &consumer_line.not_full);
+
+  for (i=0; i<NUMBER_OF_ITEMS; i++) {
+
+    /* simulate the cost of producing the item by
+       sleeping for a small random number of seconds */
+    PRODUCER_WORK();
+
+    /* put the produced value in the buffer when there's space */
+    LOG("P: produced %d\n", i);
+
+    /* only go look at the consumer's cache line when our cached
+       copy of out says the buffer is full */
+    spin = 0;
+    while (in - out_cache == BUFFER_SIZE) {
+      out_cache = atomic_load_explicit(&consumer_line.out,
+				       memory_order_acquire);
+      if (in - out_cache < BUFFER_SIZE) break;
+      if (spin == 0) {
+	LOG("P: waiting for open slot\n");
+	BENCH_WAITING();
+      }
+      wait_pause(&w, spin++);
+    }
+    wait_done(&w);
+    if (spin > 0) {
+      LOG("P: done waiting (cycled %ld times)\n", spin);
+      BENCH_PRODUCER_WAITED();
+    }
+
+    LOG("P: adding item %d at slot %d (in=%lu,out=%lu)\n", i,
+	   (int)(in & BUFFER_MASK), (unsigned long)in,
+	   (unsigned long)out_cache);
+
+    buffer[in & BUFFER_MASK] = i;
+    BENCH_ENQUEUED(stamp[in & BUFFER_MASK]);
+
+    /* release: the store to buffer above happens-before any
+       consumer that sees the new value of in */
+    in++;
+    atomic_store_explicit(&producer_line.in, in, memory_order_release);
+    wait_notify(&producer_line.not_empty);
+  }
+
+  BENCH_PRODUCER_END(&bench);
+  wait_report("P", &w);
+}
+
+/* consumer thread */
+void consumer(void *args) {
+  long spin;
+  struct waiter w;
+  int i;
+  uint64_t out, in_cache;
+
+  out = atomic_load_explicit(&consumer_line.out, memory_order_relaxed);
+  in_cache = atomic_load_explicit(&producer_line.in, memory_order_acquire);
+
+  place_thread(PLACE_CONSUMER, 0);
+  BENCH_CONSUMER_BEGIN(NUMBER_OF_ITEMS);
+  wait_init(&w, policy, &producer_line.not_empty);
+
+  for (i=0; i<NUMBER_OF_ITEMS; i++) {
+
+    /* look for a value, only going to the producer's cache line
+       when our cached copy of in says the buffer is empty */
+    spin = 0;
+    while (in_cache == out) {
+      in_cache = atomic_load_explicit(&producer_line.in,
+				      memory_order_acquire);
+      if (in_cache != out) break;
+      if (spin == 0) {
+	LOG("C: waiting for item\n");
+	BENCH_WAITING();
+      }
+      wait_pause(&w, spin++);
+    }
+    wait_done(&w);
+    if (spin > 0) {
+      LOG("C: done waiting (cycled %ld times)\n", spin);
+      BENCH_CONSUMER_WAITED();
+    }
+
+    /* consume the next available item */
+    LOG("C: consuming value %d from slot %d (in=%lu,out=%lu)\n",
+	   buffer[out & BUFFER_MASK], (int)(out & BUFFER_MASK),
+	   (unsigned long)in_cache, (unsigned long)out);
+    BENCH_DEQUEUED(stamp[out & BUFFER_MASK]);
+
+    /* release: our read of the slot is done before the producer
+       can see it as free and overwrite it */
+    out++;
+    atomic_store_explicit(&consumer_line.out, out, memory_order_release);
+    wait_notify(&consumer_line.not_full);
+
+    /* simulate the cost of consuming the item */
+    /* this is slightly longer than the producer to increase the
+       chances of filling up the buffer */
+    CONSUMER_WORK();
+  }
+
+  BENCH_CONSUMER_END(&bench, NUMBER_OF_ITEMS, BUFFER_SIZE);
+  wait_report("C", &w);
+}
+
+/* main program - just starts up threads */
+int main(int argc, char *argv[]) {
+  pthread_t producer_id, consumer_id;
+  int rc;
+
+  /* initialize the shared data */
+  atomic_init(&producer_line.in, 0);
+  atomic_init(&consumer_line.out, 0);
+  policy = wait_policy_get(WAIT_SPIN);
+  wait_queue_init(&producer_line.not_empty, policy);
+  wait_queue_init(&consumer_line.not_full, policy);
+
+  /* pin, bind and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_memory(buffer, sizeof(buffer));
+
+  /* seed the random number generator on pid */
+  srand(getpid());
+
+  /* create the consumer */
+  rc = pthread_create(&consumer_id, NULL, (void *)&consumer, NULL);
+
+  if (rc != 0) {
+    fprintf(stderr, "Could not create consumer child thread\n");
+    exit(1);
+  }
+
+  /* create the producer */
+  rc = pthread_create(&producer_id, NULL, (void *)&producer, NULL);
+
+  if (rc != 0) {
+    fprintf(stderr, "Could not create producer child thread\n");
+    exit(1);
+  }
+
+  /* wait for the child threads to exit */
+  pthread_join(producer_id,NULL);
+  pthread_join(consumer_id,NULL);
+
+  return 0;
+}
@@ -0,0 +1,396 @@
+/*
+  Producer-consumer example with pthreads
+
+  One dispatcher handing items to a pool of consumer threads (workers)
+  that steal work from each other, so that one slow item does not hold
+  up everything behind it.
+
+  Usage: prodcons-pthreads-steal [-w workers] [-n items] [-d deque size]
+				 [-u unit ns] [-f]
+
+  Each worker has a bounded work-stealing deque of its own (see
+  wsdeque.h).  The dispatcher owns all of them, in wsdeque.h's sense:
+  it is the only thread that adds to them, going round the workers and
+  putting each item at the bottom of the next deque with room.  A
+  worker takes its items from the top of its own deque, oldest first,
+  and when that is empty steals the oldest item from the top of some
+  other worker's deque instead.  So items that land behind a slow one
+  are picked up by whichever worker is free first, rather than waiting
+  their turn.  Taking from the top is a compare-and-swap either way,
+  so a worker only ever contends with thieves, and only over the one
+  item at the top.
+
+  With -f the workers share one FIFO queue instead (see mpmc.h), with
+  the same total room as all of the deques together, for comparison.
+
+  Item v takes between 1 and 5 units of work, the same amount whichever
+  worker gets it, like the sleep(rand()%5+1) of the other consumers.
+  A unit is a second of sleeping by default, or -u nanoseconds of
+  spinning.  At the end each worker reports how many items it took
+  from its own deque, how many it stole and how many times it lost the
+  race for an item to another worker, and main prints the totals and
+  percentiles of the queueing delay, from when the dispatcher handed
+  an item over to when some worker started on it.
+
+  Like prodcons-pthreads-mpmc, every value is checked off as it is
+  consumed, and main checks that every value was seen exactly once.
+  Idle workers and the dispatcher wait as WAIT_POLICY says (see
+  waitstrategy.h), by default spinning for a while and then calling
+  sched_yield.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "histogram.h"
+#include "mpmc.h"
+#include "placement.h"
+#include "waitstrategy.h"
+#include "wsdeque.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+#ifndef NUMBER_OF_ITEMS
+#define NUMBER_OF_ITEMS 30
+#endif
+#define MAX_THREADS 256
+
+/* per-worker deque and results */
+struct worker {
+  pthread_t id;
+  int number;
+  struct ws_deque deque;
+  struct waiter wait;
+  uint32_t random;
+  long items;
+  long local;
+  long stolen;
+  long lost;
+  long duplicates;
+  /* from handing over to starting on, of the items this worker did */
+  struct histogram delay;
+};
+
+/* the shared data structures */
+struct worker *workers;
+int nworkers;
+int fifo;
+struct mpmc_queue queue;
+long unit_ns;
+/* when each value was handed over, and how many times it was consumed */
+long long *dispatched;
+atomic_uchar *seen;
+/* items not yet consumed, so the workers know when to stop */
+atomic_long remaining;
+/* how to wait: the workers for something to do, the dispatcher for room */
+enum wait_policy policy;
+struct wait_queue work;
+struct wait_queue room;
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* units of work item v takes, 1 to 5 */
+static int cost(int v) {
+
+  return (int)(((uint32_t)v * 2654435761u) >> 16) % 5 + 1;
+}
+
+/* consume value, which worker me got from worker victim's deque, or
+   from the shared queue if victim is -1 */
+static void consume(struct worker *me, int value, int victim) {
+  long long until;
+
+  hist_record(&me->delay, now_ns() - dispatched[value]);
+  if (atomic_fetch_add(&seen[value], 1) != 0) {
+    fprintf(stderr, "W%d: value %d consumed more than once!\n",
+	    me->number, value);
+    me->duplicates++;
+  }
+  if (victim == -1) {
+    LOG("W%d: consuming value %d (%d units) from the shared queue\n",
+	me->number, value, cost(value));
+  }
+  else if (victim == me->number) {
+    LOG("W%d: consuming value %d (%d units) from own deque\n",
+	me->number, value, cost(value));
+  }
+  else {
+    LOG("W%d: consuming value %d (%d units) stolen from W%d\n",
+	me->number, value, cost(value), victim);
+  }
+  me->items++;
+
+  /* simulate the cost of consuming the item */
+  if (unit_ns == 0) {
+    sleep(cost(value));
+  }
+  else {
+    until = now_ns() + cost(value) * unit_ns;
+    while (now_ns() < until);
+  }
+
+  /* wake everyone to stop after the last one */
+  if (atomic_fetch_sub(&remaining, 1) == 1) wait_notify(&work);
+}
+
+/* take the oldest item from our own deque or, failing that, steal
+   one from the other workers, starting from a random one.  Returns 1
+   if we got one, with who from in victim */
+static int take(struct worker *me, int *value, int *victim) {
+  int k, got;
+
+  me->random ^= me->random << 13;
+  me->random ^= me->random >> 17;
+  me->random ^= me->random << 5;
+  for (k=0; k<nworkers; k++) {
+    *victim = k == 0 ? me->number : (me->random + k) % nworkers;
+    if (k > 0 && *victim == me->number) continue;
+    while ((got = ws_steal(&workers[*victim].deque, value)) == -1) {
+      me->lost++;
+    }
+    if (got == 1) {
+      if (k == 0) me->local++;
+      else me->stolen++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* worker thread, stealing from the others when out of work */
+void *stealing_worker(void *args) {
+  struct worker *me = (struct worker *)args;
+  int value, victim, got;
+  long spin;
+
+  place_thread(PLACE_CONSUMER, me->number);
+
+  for (;;) {
+    got = 0;
+    spin = 0;
+    while (atomic_load(&remaining) > 0) {
+      if (take(me, &value, &victim)) {
+	got = 1;
+	break;
+      }
+      if (spin == 0) LOG("W%d: waiting for work\n", me->number);
+      wait_pause(&me->wait, spin++);
+    }
+    wait_done(&me->wait);
+    if (!got) break;
+    /* the dispatcher may be waiting for room */
+    wait_notify(&room);
+    consume(me, value, victim);
+  }
+  return NULL;
+}
+
+/* worker thread, all of them sharing one queue */
+void *fifo_worker(void *args) {
+  struct worker *me = (struct worker *)args;
+  int value, got;
+  long spin;
+
+  place_thread(PLACE_CONSUMER, me->number);
+
+  for (;;) {
+    got = 0;
+    spin = 0;
+    while (atomic_load(&remaining) > 0) {
+      if (mpmc_dequeue(&queue, &value)) {
+	got = 1;
+	break;
+      }
+      if (spin == 0) LOG("W%d: waiting for work\n", me->number);
+      wait_pause(&me->wait, spin++);
+    }
+    wait_done(&me->wait);
+    if (!got) break;
+    wait_notify(&room);
+    me->local++;
+    consume(me, value, -1);
+  }
+  return NULL;
+}
+
+/* hand the items out, going round the deques (or into the shared
+   queue) */
+static void dispatch(int nitems, struct waiter *w) {
+  int v, next = 0, k = 0;
+  long spin;
+
+  place_thread(PLACE_PRODUCER, 0);
+
+  for (v=0; v<nitems; v++) {
+    spin = 0;
+    /* stamped before each attempt, since a worker may see it as soon
+       as one succeeds */
+    if (fifo) {
+      while (dispatched[v] = now_ns(), !mpmc_enqueue(&queue, v)) {
+	if (spin == 0) LOG("D: waiting for room\n");
+	wait_pause(w, spin++);
+      }
+      LOG("D: handed %d to the shared queue\n", v);
+    }
+    else {
+      /* the next deque with room, waiting if none has any */
+      for (;;) {
+	for (k=0; k<nworkers; k++) {
+	  dispatched[v] = now_ns();
+	  if (ws_push(&workers[(next + k) % nworkers].deque, v)) break;
+	}
+	if (k < nworkers) break;
+	if (spin == 0) LOG("D: waiting for room\n");
+	wait_pause(w, spin++);
+      }
+      next = (next + k) % nworkers;
+      LOG("D: handed %d to W%d\n", v, next);
+      next = (next + 1) % nworkers;
+    }
+    wait_done(w);
+    wait_notify(&work);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int nitems = NUMBER_OF_ITEMS, deque_size = BUFFER_SIZE;
+  int opt, i;
+  unsigned size;
+  long v, missing, duplicates, local, stolen, lost;
+  struct waiter dispatcher;
+  struct histogram delay;
+  char who[32];
+  long long start, elapsed;
+
+  nworkers = 4;
+  while ((opt = getopt(argc, argv, "w:n:d:u:f")) != -1) {
+    switch (opt) {
+    case 'w':
+      nworkers = atoi(optarg);
+      break;
+    case 'n':
+      nitems = atoi(optarg);
+      break;
+    case 'd':
+      deque_size = atoi(optarg);
+      break;
+    case 'u':
+      unit_ns = atol(optarg);
+      break;
+    case 'f':
+      fifo = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-w workers] [-n items] [-d deque size] "
+	      "[-u unit ns] [-f]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (nworkers < 1 || nworkers > MAX_THREADS || nitems < 0 ||
+      unit_ns < 0) {
+    fprintf(stderr, "%s: need 1 to %d workers\n", argv[0], MAX_THREADS);
+    exit(1);
+  }
+
+  workers = (struct worker *)calloc(nworkers, sizeof(struct worker));
+  dispatched = (long long *)calloc(nitems + 1, sizeof(long long));
+  seen = (atomic_uchar *)calloc(nitems + 1, sizeof(atomic_uchar));
+  if (workers == NULL || dispatched == NULL || seen == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for (i=0; i<nworkers; i++) {
+    if (ws_init(&workers[i].deque, deque_size) == -1) {
+      fprintf(stderr, "%s: deque size must be a power of two\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (fifo) {
+    /* as much room as the deques have between them */
+    for (size=1; size<(unsigned)(nworkers * deque_size); size*=2);
+    if (mpmc_init(&queue, size) == -1) {
+      perror("mpmc_init");
+      exit(1);
+    }
+  }
+  atomic_init(&remaining, nitems);
+
+  policy = wait_policy_get(WAIT_YIELD);
+  wait_queue_init(&work, policy);
+  wait_queue_init(&room, policy);
+  wait_init(&dispatcher, policy, &room);
+
+  /* pin and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+
+  start = now_ns();
+  for (i=0; i<nworkers; i++) {
+    workers[i].number = i;
+    workers[i].random = 2654435761u * (i + 1);
+    hist_init(&workers[i].delay);
+    wait_init(&workers[i].wait, policy, &work);
+    if (pthread_create(&workers[i].id, NULL,
+		       fifo ? fifo_worker : stealing_worker,
+		       &workers[i]) != 0) {
+      fprintf(stderr, "Could not create worker thread %d\n", i);
+      exit(1);
+    }
+  }
+
+  /* main is the dispatcher */
+  dispatch(nitems, &dispatcher);
+
+  for (i=0; i<nworkers; i++) {
+    pthread_join(workers[i].id, NULL);
+  }
+  elapsed = now_ns() - start;
+
+  wait_report("D", &dispatcher);
+  hist_init(&delay);
+  duplicates = local = stolen = lost = 0;
+  for (i=0; i<nworkers; i++) {
+    printf("Worker %d: %ld items, %ld from its own %s, %ld stolen, "
+	   "%ld steals lost\n", i, workers[i].items, workers[i].local,
+	   fifo ? "queue" : "deque", workers[i].stolen, workers[i].lost);
+    sprintf(who, "W%d", i);
+    wait_report(who, &workers[i].wait);
+    duplicates += workers[i].duplicates;
+    local += workers[i].local;
+    stolen += workers[i].stolen;
+    lost += workers[i].lost;
+    hist_merge(&delay, &workers[i].delay);
+  }
+
+  /* every value should have been seen exactly once */
+  missing = 0;
+  for (v=0; v<nitems; v++) {
+    if (atomic_load(&seen[v]) == 0) missing++;
+  }
+  printf("%d items in %.3f seconds (%.0f items/sec), %ld local, "
+	 "%ld stolen, %ld steals lost, %ld missing, %ld duplicated\n",
+	 nitems, elapsed / 1e9, nitems * 1e9 / elapsed, local, stolen, lost,
+	 missing, duplicates);
+  hist_print(stdout, "queueing delay (ns)", &delay);
+
+  for (i=0; i<nworkers; i++) {
+    ws_destroy(&workers[i].deque);
+  }
+  if (fifo) mpmc_destroy(&queue);
+  free(workers);
+  free(dispatched);
+  free(seen);
+
+  return (missing == 0 && duplicates == 0) ? 0 : 1;
+}
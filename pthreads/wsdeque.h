@@ -0,0 +1,146 @@
+/*
+  Bounded work-stealing deque
+
+  This is the Chase-Lev deque, in the C11 form given by Le, Pop,
+  Cohen and Zappa Nardelli, with a fixed-size buffer instead of one
+  that grows.  One thread owns the deque and works at its bottom end
+  like a stack: ws_push adds an item and ws_pop takes the newest one
+  back, with no atomic read-modify-write at all unless the deque is
+  down to its last item.  Any other thread can ws_steal the oldest
+  item from the top end with a compare-and-swap on top, so thieves
+  only contend with each other (and with the owner over the last
+  item), and take the items the owner would have got to last.  The
+  owner does not have to take items at all: a thread that only hands
+  out work can own a deque that its consumers all steal from, in which
+  case they get the items oldest first.
+
+  top and bottom are ever-increasing 64-bit positions (the slot is the
+  low bits, so the size must be a power of two), and the deque holds
+  the items at positions top .. bottom-1.
+
+  None of the three calls blocks: ws_push returns 0 when the deque is
+  full, ws_pop and ws_steal return 0 when it is empty, and ws_steal
+  returns -1 when it lost a race for the item it saw, in which case
+  there may well be more to steal.
+*/
+
+#ifndef WSDEQUE_H
+#define WSDEQUE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+struct ws_deque {
+  /* advanced by thieves (and the owner, for the last item) */
+  _Alignas(CACHE_LINE_SIZE) _Atomic int64_t top;
+  /* written only by the owner */
+  _Alignas(CACHE_LINE_SIZE) _Atomic int64_t bottom;
+  /* read-only after ws_init */
+  _Alignas(CACHE_LINE_SIZE) int64_t mask;
+  atomic_int *slots;
+};
+
+/* set up d with size slots, size a power of two.  Returns 0 on
+   success, -1 if size is bad or the slots cannot be allocated */
+static inline int ws_init(struct ws_deque *d, unsigned size) {
+  unsigned i;
+
+  if (size == 0 || (size & (size - 1)) != 0) return -1;
+  d->slots = (atomic_int *)aligned_alloc(CACHE_LINE_SIZE,
+					 (size * sizeof(atomic_int) +
+					  CACHE_LINE_SIZE - 1) /
+					 CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+  if (d->slots == NULL) return -1;
+  for (i=0; i<size; i++) {
+    atomic_init(&d->slots[i], 0);
+  }
+  atomic_init(&d->top, 0);
+  atomic_init(&d->bottom, 0);
+  d->mask = size - 1;
+  return 0;
+}
+
+static inline void ws_destroy(struct ws_deque *d) {
+
+  free(d->slots);
+  d->slots = NULL;
+}
+
+/* owner: add value at the bottom.  Returns 1, or 0 if the deque is full */
+static inline int ws_push(struct ws_deque *d, int value) {
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+
+  if (b - t > d->mask) return 0;
+  atomic_store_explicit(&d->slots[b & d->mask], value, memory_order_relaxed);
+  /* the item before the new bottom, for thieves */
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  return 1;
+}
+
+/* owner: take the newest item.  Returns 1, or 0 if the deque is empty */
+static inline int ws_pop(struct ws_deque *d, int *value) {
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  int64_t t;
+  int got = 1;
+
+  /* claim the bottom item first, then see whether a thief might be
+     after it too: the fence keeps the load of top from being done
+     before the store of bottom, which pairs with the one in ws_steal */
+  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+  if (t > b) {
+    /* it was empty */
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 0;
+  }
+  *value = atomic_load_explicit(&d->slots[b & d->mask], memory_order_relaxed);
+  if (t == b) {
+    /* the last item: race any thieves for it by advancing top */
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+						 memory_order_seq_cst,
+						 memory_order_relaxed)) {
+      got = 0;
+    }
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  }
+  return got;
+}
+
+/* anyone but the owner: take the oldest item.  Returns 1, 0 if the
+   deque is empty, or -1 if another thread got the item first */
+static inline int ws_steal(struct ws_deque *d, int *value) {
+  int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+  int64_t b;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+  if (t >= b) return 0;
+
+  *value = atomic_load_explicit(&d->slots[t & d->mask], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+					       memory_order_seq_cst,
+					       memory_order_relaxed)) {
+    return -1;
+  }
+  return 1;
+}
+
+/* how many items there are, which may be out of date by the time the
+   caller looks at it */
+static inline long ws_size(struct ws_deque *d) {
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+  return b > t ? (long)(b - t) : 0;
+}
+
+#endif
@@ -18,14 +18,28 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 
+#include "bench.h"
+#include "placement.h"
+#include "shmseg.h"
+#include "waitstrategy.h"
+
+#ifndef BUFFER_SIZE
 #define BUFFER_SIZE 5
+#endif
+#ifndef NUMBER_OF_ITEMS
 #define NUMBER_OF_ITEMS 30
+#endif
 
 typedef struct {
   int buffer[BUFFER_SIZE];
+  BENCH_STAMPS(stamp, BUFFER_SIZE)
+  BENCH_SHARED(bench)
   int in;
   int out;
   int counter;
+  /* where to park, if WAIT_POLICY says to (see waitstrategy.h) */
+  struct wait_queue not_full;
+  struct wait_queue not_empty;
 } shared_data;
 
 int main(int argc, char *argv[]) {
@@ -33,89 +47,135 @@ int main(int argc, char *argv[]) {
   int segment_id;
   shared_data *data;
   long spin;
+  enum wait_policy policy;
+  struct waiter w;
 
   /* allocate a chunk of shared memory */
-  segment_id = shmget(IPC_PRIVATE, sizeof(shared_data), SHM_R|SHM_W);
+  segment_id = shmseg_get(IPC_PRIVATE, sizeof(shared_data), SHM_R|SHM_W);
 
   /* attach a pointer to the shared memory */
   data = (shared_data *)shmat(segment_id, NULL, 0);
 
+  /* bind the segment to the PLACE_NODE node, if set (see placement.h),
+     before anything touches it */
+  place_memory(data, sizeof(shared_data));
+
   data->in = 0;
   data->out = 0;
   data->counter = 0;
+  policy = wait_policy_get(WAIT_SPIN);
+  wait_queue_init(&data->not_full, policy);
+  wait_queue_init(&data->not_empty, policy);
 
   if (fork() == 0) {
     /* child process -- the consumer */
 
+    /* the mapping we inherited still has to be faulted in (if asked
+       to, see shmseg.h) */
+    shmseg_prefault(data, sizeof(shared_data));
+
+    /* pin and lock as the PLACE_ settings say (see placement.h): memory
+       locks are not inherited across fork, so each process asks */
+    place_init();
+    place_thread(PLACE_CONSUMER, 0);
+
     /* seed the random number generator on pid */
     srand(getpid());
 
+    BENCH_CONSUMER_BEGIN(NUMBER_OF_ITEMS);
+    wait_init(&w, policy, &data->not_empty);
+
     for (i=0; i<NUMBER_OF_ITEMS; i++) {
 
       /* look for a value */
       spin = 0;
       while (data->counter == 0) {
 	if (spin == 0) {
-	  printf("C: waiting for item\n");
+	  LOG("C: waiting for item\n");
+	  BENCH_WAITING();
 	}
-	spin++;
+	wait_pause(&w, spin++);
       }
+      wait_done(&w);
       if (spin > 0) {
-	printf("C: done waiting (cycled %ld times)\n", spin);
+	LOG("C: done waiting (cycled %ld times)\n", spin);
+	BENCH_CONSUMER_WAITED();
       }
 
       /* consume the next available item */
-      printf("C: consuming value %d from slot %d (counter=%d->%d)\n", 
+      LOG("C: consuming value %d from slot %d (counter=%d->%d)\n", 
 	     data->buffer[data->out], data->out, data->counter, 
 	     data->counter-1);
+      BENCH_DEQUEUED(data->stamp[data->out]);
       data->out = (data->out + 1)%BUFFER_SIZE;
       /* here's our problem: */
       data->counter--;
+      wait_notify(&data->not_full);
 
       /* simulate the cost of consuming the item */
       /* this is slightly longer than the producer to increase the
 	 chances of filling up the buffer */
-      sleep(rand()%5+1);
+      CONSUMER_WORK();
     }
 
+    BENCH_CONSUMER_END(&data->bench, NUMBER_OF_ITEMS, BUFFER_SIZE);
+    wait_report("C", &w);
+
     exit(0);
   }
   else {
     /* parent process -- the producer */
 
+    shmseg_prefault(data, sizeof(shared_data));
+
+    /* and this one has to pin and lock itself too */
+    place_init();
+    place_thread(PLACE_PRODUCER, 0);
+
     /* seed the random number generator on pid */
     srand(getpid());
 
+    BENCH_PRODUCER_BEGIN(&data->bench);
+    wait_init(&w, policy, &data->not_full);
+
     for (i=0; i<NUMBER_OF_ITEMS; i++) {
 
       /* simulate the cost of producing the item by 
 	 sleeping for a small random number of seconds */
-      sleep(rand()%4+1);
+      PRODUCER_WORK();
 
       /* put the produced value in the buffer when there's space */
-      printf("P: produced %d\n", i);
+      LOG("P: produced %d\n", i);
 
       spin = 0;
       while (data->counter == BUFFER_SIZE) {
 	if (spin == 0) {
-	  printf("P: waiting for open slot\n");
+	  LOG("P: waiting for open slot\n");
+	  BENCH_WAITING();
 	}
-	spin++;
+	wait_pause(&w, spin++);
       }
+      wait_done(&w);
       if (spin > 0) {
-	printf("P: done waiting (cycled %ld times)\n", spin);
+	LOG("P: done waiting (cycled %ld times)\n", spin);
+	BENCH_PRODUCER_WAITED();
       }
 
-      printf("P: adding item %d at slot %d (counter=%d->%d)\n", i, data->in,
+      LOG("P: adding item %d at slot %d (counter=%d->%d)\n", i, data->in,
 	     data->counter, data->counter+1);
 
       data->buffer[data->in] = i;
+      BENCH_ENQUEUED(data->stamp[data->in]);
 
       data->in = (data->in + 1)%BUFFER_SIZE;
       /* here's our problem: */
       data->counter++;
+      wait_notify(&data->not_empty);
     }
 
+    BENCH_PRODUCER_END(&data->bench);
+    wait_report("P", &w);
+
     /* all done producing, now wait for the child to exit */
     wait(NULL);
 
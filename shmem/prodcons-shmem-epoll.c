@@ -0,0 +1,402 @@
+/*
+  Producer-consumer example with many queues and one consumer
+
+  Usage: prodcons-shmem-epoll [-x] [-q queues] [-p producers] [-b batch]
+
+  There are queues queues (see evqueue.h), each with an eventfd
+  doorbell that its producer rings when the queue goes from empty to
+  not empty.  Producer k owns queues k, k+producers, k+2*producers, ...
+  and puts each of its items on one of them at random.  A single
+  consumer sleeps in epoll_wait on all of the doorbells at once, and
+  when any ring drains the ready queues in turn, up to batch items
+  from each, so a quiet queue costs it nothing but a slot in the epoll
+  set, and a busy one no system calls at all.
+
+  By default the producers are threads in the consumer's process and
+  the queues are shared with them directly.  With -x they are separate
+  processes instead: each makes its own queues, in memfds, and hands
+  them and their doorbells to the consumer over a UNIX socket, the way
+  unrelated processes would.
+
+  Each queue gets its items from one producer, in increasing order,
+  and the consumer complains about any that it gets out of order.
+*/
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "bench.h"
+#include "placement.h"
+#include "shmseg.h"
+#include "evqueue.h"
+#include "waitstrategy.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+#ifndef NUMBER_OF_ITEMS
+#define NUMBER_OF_ITEMS 30
+#endif
+/* most queues */
+#define MAX_QUEUES 64
+
+/* the shared segment: just what the processes have to share besides
+   the queues */
+typedef struct {
+  /* how many times the producers rang a doorbell */
+  atomic_long rung;
+  BENCH_SHARED(bench)
+  /* when each item in each queue was committed, by queue and slot */
+  BENCH_STAMPS(stamp, MAX_QUEUES * BUFFER_SIZE)
+} shared_data;
+
+struct queue {
+  struct evq *q;
+  int doorbell;
+};
+
+static shared_data *data;
+static struct queue queues[MAX_QUEUES];
+static int number_of_queues = 8;
+static int number_of_producers = 2;
+static int batch = 4;
+static enum wait_policy policy;
+
+/* producer k's share of the items, and the number of its first one */
+static void producer_share(int k, int *items, int *first) {
+  int per = NUMBER_OF_ITEMS / number_of_producers;
+  int extra = NUMBER_OF_ITEMS % number_of_producers;
+
+  *items = per + (k < extra);
+  *first = k * per + (k < extra ? k : extra) + 1;
+}
+
+/* producer k: put its items on its queues */
+static void produce(int k) {
+  int i, r, items, first, owned;
+  unsigned seed;
+  long spin;
+  struct spsc_ring *ring;
+  struct spsc_span span;
+  struct waiter w[MAX_QUEUES];
+
+  place_thread(PLACE_PRODUCER, k);
+  producer_share(k, &items, &first);
+  owned = (number_of_queues - k + number_of_producers - 1) /
+    number_of_producers;
+  for (r=k; r<number_of_queues; r+=number_of_producers) {
+    wait_init(&w[r], policy, &queues[r].q->not_full);
+  }
+
+  /* rand() is shared by the threads, so pick queues with our own seed */
+  seed = getpid() + k;
+
+  BENCH_PRODUCER_BEGIN(&data->bench);
+
+  for (i=0; i<items; i++) {
+
+    /* simulate the cost of producing the item */
+    PRODUCER_WORK();
+
+    r = k + number_of_producers * (rand_r(&seed) % owned);
+    ring = evq_ring(queues[r].q);
+
+    /* wait for room on the queue */
+    spin = 0;
+    while (spsc_reserve(ring, 1, &span) == 0) {
+      if (spin == 0) {
+	LOG("P%d: queue %d is full\n", k, r);
+	BENCH_WAITING();
+      }
+      wait_pause(&w[r], spin++);
+    }
+    wait_done(&w[r]);
+    if (spin > 0) BENCH_PRODUCER_WAITED();
+
+    *span.first = first + i;
+    LOG("P%d: adding item %d to queue %d\n", k, first + i, r);
+    BENCH_ENQUEUED(data->stamp[r * BUFFER_SIZE +
+			       spsc_slot(ring, span.first)]);
+    spsc_commit(ring, 1);
+    /* ring the doorbell if the queue was empty */
+    if (evq_committed(queues[r].q, queues[r].doorbell, 1)) {
+      atomic_fetch_add(&data->rung, 1);
+    }
+  }
+
+  BENCH_PRODUCER_END(&data->bench);
+}
+
+static void *producer_thread(void *arg) {
+
+  produce((int)(long)arg);
+  return NULL;
+}
+
+/* the consumer: drain every queue, sleeping only when none has items.
+   Returns how many items came out of order */
+static int consume(void) {
+  int epfd, i, e, j, k, r, n, kept;
+  int nready = 0, bad = 0;
+  int ready[MAX_QUEUES], is_ready[MAX_QUEUES], last[MAX_QUEUES];
+  int items[BUFFER_SIZE];
+  int *slot;
+  long left, sleeps = 0, doorbells = 0;
+  struct epoll_event ev, events[MAX_QUEUES];
+  struct spsc_ring *ring;
+  struct spsc_span span;
+
+  place_thread(PLACE_CONSUMER, 0);
+
+  /* watch every doorbell, and remember which queue each one is for */
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    perror("epoll_create1");
+    return -1;
+  }
+  for (r=0; r<number_of_queues; r++) {
+    ev.events = EPOLLIN;
+    ev.data.u32 = r;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, queues[r].doorbell, &ev) == -1) {
+      perror("epoll_ctl");
+      close(epfd);
+      return -1;
+    }
+    is_ready[r] = 0;
+    last[r] = 0;
+  }
+
+  BENCH_CONSUMER_BEGIN(NUMBER_OF_ITEMS);
+
+  for (i=0; i<NUMBER_OF_ITEMS; ) {
+
+    /* see which quiet queues have had items since we last looked,
+       sleeping until one does if no queue is known to have any */
+    if (nready == 0) {
+      LOG("C: waiting for items\n");
+      BENCH_WAITING();
+    }
+    n = epoll_wait(epfd, events, MAX_QUEUES, nready == 0 ? -1 : 0);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
+    }
+    if (nready == 0) {
+      sleeps++;
+      BENCH_CONSUMER_WAITED();
+    }
+    for (e=0; e<n; e++) {
+      r = events[e].data.u32;
+      evq_ack(queues[r].doorbell);
+      doorbells++;
+      if (!is_ready[r]) {
+	is_ready[r] = 1;
+	ready[nready++] = r;
+      }
+    }
+
+    /* take up to a batch from each ready queue in turn, keeping the
+       ones that still have items: their doorbells will not ring */
+    for (j=0, kept=0; j<nready; j++) {
+      r = ready[j];
+      ring = evq_ring(queues[r].q);
+      n = spsc_peek(ring, &span);
+      if (n > batch) n = batch;
+      if (n > NUMBER_OF_ITEMS - i) n = NUMBER_OF_ITEMS - i;
+      for (k=0; k<n; k++) {
+	slot = k < span.first_len ? &span.first[k] :
+	  &span.second[k - span.first_len];
+	items[k] = *slot;
+	BENCH_DEQUEUED(data->stamp[r * BUFFER_SIZE +
+				   spsc_slot(ring, slot)]);
+	if (items[k] <= last[r]) {
+	  fprintf(stderr, "C: item %d came after item %d on queue %d\n",
+		  items[k], last[r], r);
+	  bad++;
+	}
+	last[r] = items[k];
+      }
+      spsc_release(ring, n);
+      left = evq_consumed(queues[r].q, n);
+      i += n;
+
+      for (k=0; k<n; k++) {
+	LOG("C: consuming item %d from queue %d\n", items[k], r);
+	/* simulate the cost of consuming the item */
+	CONSUMER_WORK();
+      }
+
+      if (left > 0) ready[kept++] = r;
+      else is_ready[r] = 0;
+    }
+    nready = kept;
+  }
+
+  BENCH_CONSUMER_END(&data->bench, NUMBER_OF_ITEMS, BUFFER_SIZE);
+  fprintf(stderr, "C: %d queues, %ld sleeps in epoll_wait, %ld doorbells "
+	  "rung and %ld heard, %.1f items per doorbell\n", number_of_queues,
+	  sleeps, atomic_load(&data->rung), doorbells,
+	  doorbells > 0 ? (double)i / doorbells : 0.0);
+
+  close(epfd);
+  return bad;
+}
+
+/* -x: make producer k's queues in its own process and send them to
+   the consumer over sock */
+static void producer_process(int k, int sock) {
+  int r, memfd;
+
+  /* memory locks are not inherited across fork, so each process asks
+     (see placement.h) */
+  place_init();
+
+  for (r=k; r<number_of_queues; r+=number_of_producers) {
+    queues[r].q = evq_create(BUFFER_SIZE, policy, &memfd);
+    if (queues[r].q == NULL) exit(1);
+    queues[r].doorbell = evq_doorbell();
+    if (queues[r].doorbell == -1 ||
+	evq_send(sock, r, memfd, queues[r].doorbell) == -1) {
+      exit(1);
+    }
+    /* the mapping and the consumer's copy keep the memory */
+    close(memfd);
+  }
+  close(sock);
+
+  /* rand() is ours alone here, and paces the demo's producing */
+  srand(getpid());
+  produce(k);
+  exit(0);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, k, r, memfd, doorbell, got, bad;
+  int cross = 0;
+  int segment_id;
+  int sv[2];
+  size_t size;
+  pthread_t producers[MAX_QUEUES];
+
+  while ((opt = getopt(argc, argv, "xq:p:b:")) != -1) {
+    switch (opt) {
+    case 'x': cross = 1; break;
+    case 'q': number_of_queues = atoi(optarg); break;
+    case 'p': number_of_producers = atoi(optarg); break;
+    case 'b': batch = atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-x] [-q queues] [-p producers] "
+	      "[-b batch]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (number_of_queues < 1 || number_of_queues > MAX_QUEUES ||
+      number_of_producers < 1 || number_of_producers > number_of_queues) {
+    fprintf(stderr, "%s: need 1 <= producers <= queues <= %d\n", argv[0],
+	    MAX_QUEUES);
+    exit(1);
+  }
+  if (batch < 1 || batch > BUFFER_SIZE) {
+    fprintf(stderr, "%s: batch size must be between 1 and %d\n", argv[0],
+	    BUFFER_SIZE);
+    exit(1);
+  }
+
+  /* allocate a chunk of shared memory for the timing data */
+  segment_id = shmseg_get(IPC_PRIVATE, sizeof(shared_data), SHM_R|SHM_W);
+  if (segment_id == -1) {
+    perror("shmget");
+    exit(1);
+  }
+  data = (shared_data *)shmat(segment_id, NULL, 0);
+  if (data == (shared_data *)-1) {
+    perror("shmat");
+    exit(1);
+  }
+  shmseg_prefault(data, sizeof(shared_data));
+  atomic_init(&data->rung, 0);
+
+  place_init();
+  policy = wait_policy_get(WAIT_YIELD);
+
+  if (!cross) {
+    /* the queues are ours, and the producer threads use them as is */
+    for (r=0; r<number_of_queues; r++) {
+      queues[r].q = evq_create(BUFFER_SIZE, policy, &memfd);
+      if (queues[r].q == NULL) exit(1);
+      close(memfd);
+      queues[r].doorbell = evq_doorbell();
+      if (queues[r].doorbell == -1) exit(1);
+    }
+    for (k=0; k<number_of_producers; k++) {
+      pthread_create(&producers[k], NULL, producer_thread, (void *)(long)k);
+    }
+  }
+  else {
+    /* each producer process sends us its queues, and we map them */
+    for (k=0, got=0; k<number_of_producers; k++) {
+      if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+	perror("socketpair");
+	exit(1);
+      }
+      if (fork() == 0) {
+	close(sv[0]);
+	producer_process(k, sv[1]);
+      }
+      close(sv[1]);
+      while (evq_recv(sv[0], &r, &memfd, &doorbell) == 1) {
+	if (r < 0 || r >= number_of_queues || r % number_of_producers != k ||
+	    doorbell == -1) {
+	  fprintf(stderr, "%s: producer %d sent a bad queue %d\n", argv[0],
+		  k, r);
+	  exit(1);
+	}
+	queues[r].q = evq_attach(memfd, &size);
+	if (queues[r].q == NULL) exit(1);
+	close(memfd);
+	queues[r].doorbell = doorbell;
+	LOG("C: got queue %d from producer %d\n", r, k);
+	got++;
+      }
+      close(sv[0]);
+    }
+    if (got != number_of_queues) {
+      fprintf(stderr, "%s: got %d of the %d queues\n", argv[0], got,
+	      number_of_queues);
+      exit(1);
+    }
+  }
+
+  bad = consume();
+
+  if (!cross) {
+    for (k=0; k<number_of_producers; k++) {
+      pthread_join(producers[k], NULL);
+    }
+  }
+  else {
+    while (wait(NULL) > 0);
+  }
+
+  if (bad > 0) {
+    fprintf(stderr, "%d items out of order\n", bad);
+  }
+
+  /* detach from shared memory segment */
+  shmdt(data);
+
+  /* free shared memory segment */
+  shmctl(segment_id, IPC_RMID, NULL);
+
+  return bad != 0;
+}
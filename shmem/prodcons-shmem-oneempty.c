@@ -1,7 +1,29 @@
 /*
   Producer-consumer example with POSIX shared memory.
 
-  This one avoids trouble by always leaving one slot empty in the buffer
+  This one avoids trouble by never having a variable written by both
+  processes: the producer is the only writer of in and the consumer
+  is the only writer of out.
+
+  To make that actually safe between two processes on real hardware,
+  in and out are C11 atomics: each side publishes its index with a
+  release store and reads the other side's with an acquire load, so
+  the item written to the buffer is visible before the index that
+  announces it.  in and out are 32-bit sequence numbers that only
+  increase (wrapping around harmlessly, since BUFFER_SIZE is a power
+  of two and divides 2^32), and in-out is the number of items in the
+  buffer, so the "one empty slot" is no longer needed to tell full
+  from empty.  in and out are on separate cache lines, and each side
+  only rereads the other side's index when its cached copy says the
+  buffer is full or empty.
+
+  A process that finds the buffer empty (or full) waits as WAIT_POLICY
+  says (see waitstrategy.h).  By default it spins for a short while,
+  then parks in the kernel on a futex that lives next to the index it
+  is waiting for the other side to change; the other side only makes
+  the FUTEX_WAKE system call when someone is parked, so when both
+  sides are busy no system calls are made at all, and when the buffer
+  sits idle no CPU is burned.
 
   Jim Teresco, Williams College
   February, 2005
@@ -14,16 +36,39 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 
-#define BUFFER_SIZE 5
+#include "bench.h"
+#include "placement.h"
+#include "shmseg.h"
+#include "waitstrategy.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+#define BUFFER_MASK (BUFFER_SIZE - 1)
+#ifndef NUMBER_OF_ITEMS
 #define NUMBER_OF_ITEMS 30
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+_Static_assert((BUFFER_SIZE & BUFFER_MASK) == 0,
+	       "BUFFER_SIZE must be a power of two");
 
 typedef struct {
   int buffer[BUFFER_SIZE];
-  int in;
-  int out;
+  BENCH_STAMPS(stamp, BUFFER_SIZE)
+  BENCH_SHARED(bench)
+  /* written by the producer (not_empty also by a parked consumer) */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t in;
+  struct wait_queue not_empty;
+  /* written by the consumer (not_full also by a parked producer) */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t out;
+  struct wait_queue not_full;
 } shared_data;
 
 int main(int argc, char *argv[]) {
@@ -31,90 +76,159 @@ int main(int argc, char *argv[]) {
   int segment_id;
   shared_data *data;
   long spin;
+  enum wait_policy policy;
+  struct waiter w;
+  uint32_t in, out, in_cache, out_cache;
 
   /* allocate a chunk of shared memory */
-  segment_id = shmget(IPC_PRIVATE, sizeof(shared_data), SHM_R|SHM_W);
+  segment_id = shmseg_get(IPC_PRIVATE, sizeof(shared_data), SHM_R|SHM_W);
+  if (segment_id == -1) {
+    perror("shmget");
+    exit(1);
+  }
 
   /* attach a pointer to the shared memory */
   data = (shared_data *)shmat(segment_id, NULL, 0);
+  if (data == (shared_data *)-1) {
+    perror("shmat");
+    exit(1);
+  }
 
-  data->in = 0;
-  data->out = 0;
+  /* bind the segment to the PLACE_NODE node, if set (see placement.h),
+     before anything touches it */
+  place_memory(data, sizeof(shared_data));
+
+  atomic_init(&data->in, 0);
+  atomic_init(&data->out, 0);
+  policy = wait_policy_get(WAIT_PARK);
+  wait_queue_init(&data->not_empty, policy);
+  wait_queue_init(&data->not_full, policy);
 
   if (fork() == 0) {
     /* child process -- the consumer */
 
+    /* the mapping we inherited still has to be faulted in (if asked
+       to, see shmseg.h) */
+    shmseg_prefault(data, sizeof(shared_data));
+
+    /* pin and lock as the PLACE_ settings say (see placement.h): memory
+       locks are not inherited across fork, so each process asks */
+    place_init();
+    place_thread(PLACE_CONSUMER, 0);
+
     /* seed the random number generator on pid */
     srand(getpid());
 
+    out = 0;
+    in_cache = 0;
+    wait_init(&w, policy, &data->not_empty);
+
+    BENCH_CONSUMER_BEGIN(NUMBER_OF_ITEMS);
+
     for (i=0; i<NUMBER_OF_ITEMS; i++) {
 
-      /* look for a value */
+      /* look for a value, only rereading in when our cached copy
+	 says the buffer is empty */
       spin = 0;
-      while (data->in == data->out) {
+      while (in_cache == out) {
+	in_cache = atomic_load_explicit(&data->in, memory_order_acquire);
+	if (in_cache != out) break;
 	if (spin == 0) {
-	  printf("C: waiting for item\n");
+	  LOG("C: waiting for item\n");
+	  BENCH_WAITING();
 	}
-	spin++;
+	wait_pause(&w, spin++);
       }
+      wait_done(&w);
       if (spin > 0) {
-	printf("C: done waiting (cycled %ld times)\n", spin);
+	LOG("C: done waiting (cycled %ld times)\n", spin);
+	BENCH_CONSUMER_WAITED();
       }
 
       /* consume the next available item */
-      printf("C: consuming value %d from slot %d (in=%d,out=%d)\n", 
-	     data->buffer[data->out], data->out, data->in, data->out);
-      data->out = (data->out + 1)%BUFFER_SIZE;
+      LOG("C: consuming value %d from slot %d (in=%u,out=%u)\n",
+	     data->buffer[out & BUFFER_MASK], (int)(out & BUFFER_MASK),
+	     in_cache, out);
+      BENCH_DEQUEUED(data->stamp[out & BUFFER_MASK]);
+      out++;
+      atomic_store_explicit(&data->out, out, memory_order_release);
+      wait_notify(&data->not_full);
 
       /* simulate the cost of consuming the item */
       /* this is slightly longer than the producer to increase the
 	 chances of filling up the buffer */
-      sleep(rand()%5+1);
+      CONSUMER_WORK();
     }
 
+    BENCH_CONSUMER_END(&data->bench, NUMBER_OF_ITEMS, BUFFER_SIZE);
+    wait_report("C", &w);
+
     exit(0);
   }
   else {
     /* parent process -- the producer */
 
+    shmseg_prefault(data, sizeof(shared_data));
+
+    /* and this one has to pin and lock itself too */
+    place_init();
+    place_thread(PLACE_PRODUCER, 0);
+
     /* seed the random number generator on pid */
     srand(getpid());
 
+    in = 0;
+    out_cache = 0;
+    wait_init(&w, policy, &data->not_full);
+
+    BENCH_PRODUCER_BEGIN(&data->bench);
+
     for (i=0; i<NUMBER_OF_ITEMS; i++) {
 
-      /* simulate the cost of producing the item by 
+      /* simulate the cost of producing the item by
 	 sleeping for a small random number of seconds */
-      sleep(rand()%4+1);
+      PRODUCER_WORK();
 
       /* put the produced value in the buffer when there's space */
-      printf("P: produced %d\n", i);
+      LOG("P: produced %d\n", i);
 
       spin = 0;
-      while (((data->in+1)%BUFFER_SIZE) == data->out) {
+      while (in - out_cache == BUFFER_SIZE) {
+	out_cache = atomic_load_explicit(&data->out, memory_order_acquire);
+	if (in - out_cache != BUFFER_SIZE) break;
 	if (spin == 0) {
-	  printf("P: waiting for open slot\n");
+	  LOG("P: waiting for open slot\n");
+	  BENCH_WAITING();
 	}
-	spin++;
+	wait_pause(&w, spin++);
       }
+      wait_done(&w);
       if (spin > 0) {
-	printf("P: done waiting (cycled %ld times)\n", spin);
+	LOG("P: done waiting (cycled %ld times)\n", spin);
+	BENCH_PRODUCER_WAITED();
       }
 
-      printf("P: adding item %d at slot %d (in=%d,out=%d)\n", i, data->in,
-	     data->in, data->out);
+      LOG("P: adding item %d at slot %d (in=%u,out=%u)\n", i,
+	     (int)(in & BUFFER_MASK), in, out_cache);
 
-      data->buffer[data->in] = i;
+      data->buffer[in & BUFFER_MASK] = i;
+      BENCH_ENQUEUED(data->stamp[in & BUFFER_MASK]);
 
-      data->in = (data->in + 1)%BUFFER_SIZE;
+      in++;
+      atomic_store_explicit(&data->in, in, memory_order_release);
+      wait_notify(&data->not_empty);
     }
 
+    BENCH_PRODUCER_END(&data->bench);
+    wait_report("P", &w);
+
     /* all done producing, now wait for the child to exit */
     wait(NULL);
 
   }
   /* detach from shared memory segment */
   shmdt(data);
-  
+
   /* free shared memory segment */
   shmctl(segment_id, IPC_RMID, NULL);
 
@@ -0,0 +1,273 @@
+/*
+  Producer-consumer example with POSIX shared memory.
+
+  Instead of a buffer of BUFFER_SIZE ints, the processes share a ring
+  of bytes (see recring.h) and pass messages of different sizes
+  through it, each taking only as much of the ring as it needs.
+
+  Usage: prodcons-shmem-records [ring bytes] [min length] [max length]
+
+  The ring size is chosen at run time and must be a power of two.  The
+  producer picks a random length between min and max for each message
+  and builds the message right in the ring: a small header with its
+  number and length, then a body filled with a pattern that depends on
+  both.  The consumer checks each message where it sits in the ring
+  and complains about any that are not what the producer wrote.
+
+  As in prodcons-shmem-oneempty, the producer only writes in and the
+  consumer only writes out.  A process that finds the ring full (or
+  empty) waits as WAIT_POLICY says (see waitstrategy.h), by default
+  spinning for a while and then calling sched_yield between attempts.
+
+  Jim Teresco, Williams College
+  February, 2005
+
+  Updated for CSIS 330, Siena College, Spring 2012
+*/
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "bench.h"
+#include "placement.h"
+#include "shmseg.h"
+#include "recring.h"
+#include "waitstrategy.h"
+
+#ifndef RING_BYTES
+#define RING_BYTES 4096
+#endif
+#ifndef MIN_LENGTH
+#define MIN_LENGTH 40
+#endif
+#ifndef MAX_LENGTH
+#define MAX_LENGTH 1024
+#endif
+#ifndef NUMBER_OF_ITEMS
+#define NUMBER_OF_ITEMS 30
+#endif
+
+/* what goes in each record: the body follows the header */
+struct message {
+  int number;
+  int length;
+  BENCH_STAMPS(stamp, 1)
+  unsigned char body[];
+};
+
+/* the shared segment is this, then the ring starting on the next
+   cache line */
+typedef struct {
+  BENCH_SHARED(bench)
+  int bad_messages;
+  struct wait_queue not_full;
+  struct wait_queue not_empty;
+} shared_data;
+
+#define RING_OFFSET ((sizeof(shared_data) + CACHE_LINE_SIZE - 1) / \
+		     CACHE_LINE_SIZE * CACHE_LINE_SIZE)
+
+/* the byte the producer puts at position k of message number's body */
+static unsigned char pattern(int number, int k) {
+
+  return (unsigned char)(number * 31 + k);
+}
+
+int main(int argc, char *argv[]) {
+  int i, k;
+  int segment_id;
+  shared_data *data;
+  struct recring *ring;
+  struct message *m;
+  size_t ring_bytes = RING_BYTES, len, segment_size;
+  int min_length = MIN_LENGTH, max_length = MAX_LENGTH, length;
+  long spin;
+  enum wait_policy policy;
+  struct waiter w;
+
+  if (argc > 1) ring_bytes = atol(argv[1]);
+  if (argc > 2) min_length = atoi(argv[2]);
+  if (argc > 3) max_length = atoi(argv[3]);
+  if (min_length < 0 || max_length < min_length) {
+    fprintf(stderr, "%s: need 0 <= min length <= max length\n", argv[0]);
+    exit(1);
+  }
+
+  /* allocate a chunk of shared memory for the ring and everything else */
+  segment_size = RING_OFFSET + recring_size(ring_bytes);
+  segment_id = shmseg_get(IPC_PRIVATE, segment_size, SHM_R|SHM_W);
+  if (segment_id == -1) {
+    perror("shmget");
+    exit(1);
+  }
+
+  /* attach a pointer to the shared memory */
+  data = (shared_data *)shmat(segment_id, NULL, 0);
+  if (data == (shared_data *)-1) {
+    perror("shmat");
+    exit(1);
+  }
+
+  /* bind the segment to the PLACE_NODE node, if set (see placement.h),
+     before anything touches it */
+  place_memory(data, segment_size);
+
+  data->bad_messages = 0;
+  policy = wait_policy_get(WAIT_YIELD);
+  wait_queue_init(&data->not_full, policy);
+  wait_queue_init(&data->not_empty, policy);
+  ring = (struct recring *)((char *)data + RING_OFFSET);
+  if (recring_init(ring, ring_bytes) == -1) {
+    fprintf(stderr, "%s: ring size must be a power of two\n", argv[0]);
+    shmctl(segment_id, IPC_RMID, NULL);
+    exit(1);
+  }
+  if (sizeof(struct message) + max_length > recring_max_record(ring)) {
+    fprintf(stderr, "%s: messages of %d bytes need a ring of more than "
+	    "%ld bytes\n", argv[0], max_length, (long)ring_bytes);
+    shmctl(segment_id, IPC_RMID, NULL);
+    exit(1);
+  }
+
+  if (fork() == 0) {
+    /* child process -- the consumer */
+
+    /* the mapping we inherited still has to be faulted in (if asked
+       to, see shmseg.h) */
+    shmseg_prefault(data, segment_size);
+
+    /* pin and lock as the PLACE_ settings say (see placement.h): memory
+       locks are not inherited across fork, so each process asks */
+    place_init();
+    place_thread(PLACE_CONSUMER, 0);
+
+    /* seed the random number generator on pid */
+    srand(getpid());
+
+    BENCH_CONSUMER_BEGIN(NUMBER_OF_ITEMS);
+    wait_init(&w, policy, &data->not_empty);
+
+    for (i=0; i<NUMBER_OF_ITEMS; i++) {
+
+      /* look for a message */
+      spin = 0;
+      while ((m = (struct message *)recring_peek(ring, &len)) == NULL) {
+	if (spin == 0) {
+	  LOG("C: waiting for message\n");
+	  BENCH_WAITING();
+	}
+	wait_pause(&w, spin++);
+      }
+      wait_done(&w);
+      if (spin > 0) {
+	LOG("C: done waiting (cycled %ld times)\n", spin);
+	BENCH_CONSUMER_WAITED();
+      }
+
+      /* check the message in place */
+      LOG("C: consuming message %d of %d bytes at offset %lu\n", m->number,
+	  m->length, (unsigned long)((unsigned char *)m - ring->data));
+      BENCH_DEQUEUED(m->stamp[0]);
+      if (m->number != i || len != sizeof(struct message) + m->length) {
+	fprintf(stderr, "C: expected message %d, found %d (%lu bytes)\n",
+		i, m->number, (unsigned long)len);
+	data->bad_messages++;
+      }
+      else {
+	for (k=0; k<m->length; k++) {
+	  if (m->body[k] != pattern(m->number, k)) {
+	    fprintf(stderr, "C: message %d is corrupted at byte %d\n",
+		    m->number, k);
+	    data->bad_messages++;
+	    break;
+	  }
+	}
+      }
+      recring_release(ring);
+      wait_notify(&data->not_full);
+
+      /* simulate the cost of consuming the item */
+      CONSUMER_WORK();
+    }
+
+    BENCH_CONSUMER_END(&data->bench, NUMBER_OF_ITEMS, (int)ring_bytes);
+    wait_report("C", &w);
+
+    exit(0);
+  }
+  else {
+    /* parent process -- the producer */
+
+    shmseg_prefault(data, segment_size);
+
+    /* and this one has to pin and lock itself too */
+    place_init();
+    place_thread(PLACE_PRODUCER, 0);
+
+    /* seed the random number generator on pid */
+    srand(getpid());
+
+    BENCH_PRODUCER_BEGIN(&data->bench);
+    wait_init(&w, policy, &data->not_full);
+
+    for (i=0; i<NUMBER_OF_ITEMS; i++) {
+
+      /* simulate the cost of producing the item */
+      PRODUCER_WORK();
+
+      length = min_length + rand() % (max_length - min_length + 1);
+
+      /* get room for the message in the ring */
+      spin = 0;
+      while ((m = (struct message *)
+	      recring_reserve(ring, sizeof(struct message) + length)) == NULL) {
+	if (spin == 0) {
+	  LOG("P: waiting for room for %d bytes\n", length);
+	  BENCH_WAITING();
+	}
+	wait_pause(&w, spin++);
+      }
+      wait_done(&w);
+      if (spin > 0) {
+	LOG("P: done waiting (cycled %ld times)\n", spin);
+	BENCH_PRODUCER_WAITED();
+      }
+
+      /* and produce it right there */
+      m->number = i;
+      m->length = length;
+      for (k=0; k<length; k++) {
+	m->body[k] = pattern(i, k);
+      }
+      LOG("P: produced message %d of %d bytes at offset %lu\n", i, length,
+	  (unsigned long)((unsigned char *)m - ring->data));
+      BENCH_ENQUEUED(m->stamp[0]);
+      recring_commit(ring, sizeof(struct message) + length);
+      wait_notify(&data->not_empty);
+    }
+
+    BENCH_PRODUCER_END(&data->bench);
+    wait_report("P", &w);
+
+    /* all done producing, now wait for the child to exit */
+    wait(NULL);
+  }
+
+  if (data->bad_messages > 0) {
+    fprintf(stderr, "%d bad messages\n", data->bad_messages);
+  }
+  k = data->bad_messages > 0;
+
+  /* detach from shared memory segment */
+  shmdt(data);
+
+  /* free shared memory segment */
+  shmctl(segment_id, IPC_RMID, NULL);
+
+  return k;
+}
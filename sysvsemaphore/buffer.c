@@ -18,20 +18,46 @@
 #include <sys/shm.h>
 #include <sys/sem.h>
 #include <signal.h>
+#ifdef POSIX_SEMAPHORES
+#include <semaphore.h>
+#endif
 
 #include "buffer.h"
+#include "placement.h"
+#include "shmseg.h"
 
 static int segment_id;
 static shared_data *data;
-/* three semaphore IDs */
-static int emptyslots, fullslots, mutex;
+#ifndef POSIX_SEMAPHORES
+/* ID of the semaphore set */
+static int semaphores;
+#endif
 
 /* signal handler that will clean up the shmem */
 void cleanup(int sig) {
   int error = 0;
+#if defined(POSIX_SEMAPHORES) && defined(FANIN)
+  int r;
+#endif
 
   if (sig != -1)
-    printf("Buffer got signal %d, cleaning up and exiting\n", sig);
+    LOG("Buffer got signal %d, cleaning up and exiting\n", sig);
+
+#ifdef POSIX_SEMAPHORES
+  /* the semaphores live in the segment, so free them before it goes */
+  sem_destroy(&data->full_slots);
+#ifdef FANIN
+  for (r=0; r<FANIN_PRODUCERS; r++) {
+    sem_destroy(&data->empty_slots[r]);
+  }
+#else
+  sem_destroy(&data->empty_slots);
+  sem_destroy(&data->mutex);
+  sem_destroy(&data->producer_claim);
+  sem_destroy(&data->consumer_claim);
+#endif
+#endif
+
   /* detach from shared memory segment */
   if (shmdt((void *)data) == -1) {
     perror("shmdt");
@@ -44,37 +70,39 @@ void cleanup(int sig) {
     error = 1;
   }
 
+#ifndef POSIX_SEMAPHORES
   /* free the semaphores */
-  if (semctl(emptyslots, 0, IPC_RMID, NULL) == -1) {
-    perror("semctl (emptyslots)");
-    error = 1;
-  }
-  if (semctl(fullslots, 0, IPC_RMID, NULL) == -1) {
-    perror("semctl (fullslots)");
-    error = 1;
-  }
-  if (semctl(mutex, 0, IPC_RMID, NULL) == -1) {
-    perror("semctl (mutex)");
+  if (semctl(semaphores, 0, IPC_RMID, NULL) == -1) {
+    perror("semctl");
     error = 1;
   }
+#endif
 
   exit(error);
 }
 
 int main(int argc, char *argv[]) {
+#ifndef POSIX_SEMAPHORES
   union semun {
     int     val;            /* value for SETVAL */
     struct  semid_ds *buf;  /* buffer for IPC_STAT & IPC_SET */
     u_short *array;         /* array for GETALL & SETALL */
   } argument;
+  u_short initial[NUMBER_OF_SEMAPHORES];
+#endif
+#ifdef FANIN
+  int r;
+#endif
 
   /* allocate a chunk of shared memory */
   /* This is a "named" shmem chunk -- the same name will be used
      by the producer and consumer processes, and we request read
      and write access, and create the segment (IPC_CREAT).
      Once we allocate it, we can the allocation from the command line
-     with the ipcs command */
-  segment_id = shmget(SHMEM_ID, sizeof(shared_data), SHM_R|SHM_W|IPC_CREAT);
+     with the ipcs command.  shmseg_get puts it on huge pages if
+     SHMSEG_HUGEPAGES is set (see shmseg.h) */
+  segment_id = shmseg_get(SHMEM_ID, SHARED_DATA_SIZE,
+			  SHM_R|SHM_W|IPC_CREAT);
   if (segment_id == -1) {
     perror("shmget");
     exit(1);
@@ -87,8 +115,29 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
+  /* bind the segment to the PLACE_NODE node, if set (see placement.h),
+     before anything touches it */
+  place_memory(data, SHARED_DATA_SIZE);
+
+  /* fault it in and lock it in memory if SHMSEG_PREFAULT is set */
+  shmseg_prefault(data, SHARED_DATA_SIZE);
+
+#ifdef FANIN
+  /* every ring empty and free for a producer to claim */
+  for (r=0; r<FANIN_PRODUCERS; r++) {
+    spsc_ring_init(fanin_ring(data, r), BUFFER_SIZE);
+    atomic_init(&data->producer[r], 0);
+  }
+#else
   data->in = 0;
   data->out = 0;
+#ifdef SLAB
+  /* every block of the slab free */
+  slab_init(shared_slab(data));
+  LOG("Buffer: slab of %d blocks in each of %d classes, %zu bytes\n",
+      SLAB_BLOCKS, SLAB_CLASSES, (size_t)SLAB_SIZE);
+#endif
+#endif
 
   /* trap the crtl-c or kill -TERM that might kill this process so we 
      can clean up.  Note: other signals will be able to kill this job without
@@ -103,41 +152,63 @@ int main(int argc, char *argv[]) {
     cleanup(-1);
   }
 
+#ifdef POSIX_SEMAPHORES
   /* Create the semaphores */
-  /* in each case here, we get a named semaphore using a name that will
-     also be used by the producers and/or consumers, we create an array
-     of 1 semaphore, and create it (IPC_CREAT) with read access for the
-     user (SEM_R), and alter access for the user (SEM_A).  Once created,
-     the semaphores can also be seen with the ipcs command.  */
-  if ((fullslots = semget(FULLSLOTS, 1, SEM_R|SEM_A|IPC_CREAT)) == -1) {
-    perror("semget (fullslots)");
+  /* they are just data in the shared segment: the nonzero second
+     argument (pshared) says they will be used by several processes, and
+     the third is the initial value */
+#ifdef FANIN
+  if (sem_init(&data->full_slots, 1, 0) == -1) {
+    perror("sem_init");
     cleanup(-1);
   }
-  if ((emptyslots = semget(EMPTYSLOTS, 1, SEM_R|SEM_A|IPC_CREAT)) == -1) {
-    perror("semget (emptyslots)");
+  for (r=0; r<FANIN_PRODUCERS; r++) {
+    if (sem_init(&data->empty_slots[r], 1, BUFFER_SIZE) == -1) {
+      perror("sem_init");
+      cleanup(-1);
+    }
+  }
+#else
+  if (sem_init(&data->full_slots, 1, 0) == -1 ||
+      sem_init(&data->empty_slots, 1, BUFFER_SIZE) == -1 ||
+      sem_init(&data->mutex, 1, 1) == -1 ||
+      sem_init(&data->producer_claim, 1, 1) == -1 ||
+      sem_init(&data->consumer_claim, 1, 1) == -1) {
+    perror("sem_init");
     cleanup(-1);
   }
-  if ((mutex = semget(MUTEX, 1, SEM_R|SEM_A|IPC_CREAT)) == -1) {
-    perror("semget (mutex)");
+#endif
+#else
+  /* Create the semaphores */
+  /* we get a named semaphore set using a name that will also be used
+     by the producers and consumers, we create an array of 3 semaphores
+     (FULLSLOTS, EMPTYSLOTS and MUTEX are their indices), and create it
+     (IPC_CREAT) with read access for the user (SEM_R), and alter access
+     for the user (SEM_A).  Once created, the set can also be seen with
+     the ipcs command.  (With FANIN, there is FULLSLOTS and then an
+     EMPTYSLOTS for each ring, see buffer.h.)  */
+  if ((semaphores = semget(SEMAPHORES, NUMBER_OF_SEMAPHORES,
+			   SEM_R|SEM_A|IPC_CREAT)) == -1) {
+    perror("semget");
     cleanup(-1);
   }
 
-  /* set initial values of the semaphores */
-  argument.val = BUFFER_SIZE;
-  if (semctl(emptyslots, 0, SETVAL, argument) == -1) {
-    perror("semctl (emptyslots)");
-    cleanup(-1);
-  }
-  argument.val = 0;
-  if (semctl(fullslots, 0, SETVAL, argument) == -1) {
-    perror("semctl (fullslots)");
-    cleanup(-1);
+  /* set initial values of all of the semaphores at once */
+  initial[FULLSLOTS] = 0;
+#ifdef FANIN
+  for (r=0; r<FANIN_PRODUCERS; r++) {
+    initial[RING_EMPTYSLOTS(r)] = BUFFER_SIZE;
   }
-  argument.val = 1;
-  if (semctl(mutex, 0, SETVAL, argument) == -1) {
-    perror("semctl (mutex)");
+#else
+  initial[EMPTYSLOTS] = BUFFER_SIZE;
+  initial[MUTEX] = 1;
+#endif
+  argument.array = initial;
+  if (semctl(semaphores, 0, SETALL, argument) == -1) {
+    perror("semctl (SETALL)");
     cleanup(-1);
   }
+#endif
 
   /* now sit here and sleep -- awaken only on response to a signal */
   /* the program will terminate when the cleanup function is called,
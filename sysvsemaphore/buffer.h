@@ -7,17 +7,200 @@
   Jim Teresco, Williams College
   March, 2005
 
+  Built with -DPOSIX_SEMAPHORES, the three semaphores are instead
+  process-shared POSIX semaphores (sem_t, initialized with pshared=1)
+  stored right in the shared segment.  A wait or signal on one of those
+  only enters the kernel when a process actually has to sleep or be
+  woken, where every SysV semop() is a system call.  The two builds use
+  different keys, so both can run at the same time.
+
+  Built with -DFANIN, the segment holds one single-producer/single-
+  consumer ring (see spscring.h) per producer instead of one buffer
+  shared by all of them.  Each producer claims a free ring when it
+  starts by putting its pid in the ring's entry of producer[], and
+  from then on is the only one to write to that ring, so producers
+  never wait for each other: there is no mutex and no shared in index
+  at all.  The consumer drains the rings in turn.  Each ring has an
+  empty slots semaphore of its own, which its producer waits on, and
+  one full slots semaphore counts the items in all of the rings
+  together, for the consumer to wait on.  The rings follow the fixed
+  part of the struct in the segment, so SHARED_DATA_SIZE is what to
+  allocate and fanin_ring finds one.  It combines with
+  -DPOSIX_SEMAPHORES, and again each build has its own keys.
+
+  Built with -DSLAB, the items are messages of SLAB_PAYLOAD bytes (or
+  however many the producer is told) instead of ints, and what goes
+  through the buffer is only the handle of each one: the segment has a
+  slab allocator (see slab.h) after the fixed part of the struct,
+  which the buffer sets up.  The producer builds each message right in
+  a block it allocates there, and the consumer reads it where it is
+  and frees the block, so nothing but the 8-byte handle is ever copied.
+  It combines with -DPOSIX_SEMAPHORES but not with -DFANIN, and has its
+  own keys.
 */
 
+#include "bench.h"
+
+#ifdef POSIX_SEMAPHORES
+#include <semaphore.h>
+#endif
+
+#if defined(FANIN) && defined(SLAB)
+#error "-DSLAB does not combine with -DFANIN"
+#endif
+
+#ifdef FANIN
+#include <stdatomic.h>
+#include "spscring.h"
+
+/* the rings need a power of two */
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8
+#endif
+/* how many producers can be attached at once */
+#ifndef FANIN_PRODUCERS
+#define FANIN_PRODUCERS 16
+#endif
+
+typedef struct {
+  BENCH_STAMPS(stamp, FANIN_PRODUCERS * BUFFER_SIZE)
+  BENCH_SHARED(bench)
+  /* pid of the producer using each ring, 0 if it is free */
+  atomic_int producer[FANIN_PRODUCERS];
+#ifdef POSIX_SEMAPHORES
+  sem_t full_slots;
+  sem_t empty_slots[FANIN_PRODUCERS];
+#endif
+  /* the rings, FANIN_RING_SIZE bytes each */
+  _Alignas(CACHE_LINE_SIZE) char rings[];
+} shared_data;
+
+#define FANIN_RING_SIZE spsc_ring_size(BUFFER_SIZE)
+#define SHARED_DATA_SIZE \
+  (sizeof(shared_data) + FANIN_PRODUCERS * FANIN_RING_SIZE)
+
+static inline struct spsc_ring *fanin_ring(shared_data *data, int r) {
+
+  return (struct spsc_ring *)(data->rings + r * FANIN_RING_SIZE);
+}
+
+#ifdef POSIX_SEMAPHORES
+#define SHMEM_ID 96
+#else
+#define SHMEM_ID 95
+#endif
+
+/* the full slots semaphore, then one empty slots semaphore per ring.
+   The full slots count must fit in a semaphore (at most SEMVMX, 32767
+   on Linux), so FANIN_PRODUCERS * BUFFER_SIZE must too */
+#define SEMAPHORES 2066
+#define FULLSLOTS 0
+#define RING_EMPTYSLOTS(r) (1 + (r))
+#define NUMBER_OF_SEMAPHORES (1 + FANIN_PRODUCERS)
+
+#else
+
+#ifndef BUFFER_SIZE
 #define BUFFER_SIZE 5
+#endif
+
+#ifdef SLAB
+#include "slab.h"
+
+/* how big the producer makes each message's payload by default */
+#ifndef SLAB_PAYLOAD
+#define SLAB_PAYLOAD 4096
+#endif
+
+/* what is in a message's block */
+struct slab_message {
+  int item;
+  /* bytes of payload */
+  uint32_t len;
+  unsigned char payload[];
+};
+
+/* the buffer holds handles of messages */
+typedef slab_handle buffer_item;
+#else
+typedef int buffer_item;
+#endif
 
 typedef struct {
-  int buffer[BUFFER_SIZE];
+  buffer_item buffer[BUFFER_SIZE];
+  BENCH_STAMPS(stamp, BUFFER_SIZE)
+  BENCH_SHARED(bench)
   int in;
   int out;
+#ifdef POSIX_SEMAPHORES
+  sem_t full_slots;
+  sem_t empty_slots;
+  sem_t mutex;
+  /* held by a producer while it takes its batch of empty slots, and by
+     a consumer while it takes its batch of full ones */
+  sem_t producer_claim;
+  sem_t consumer_claim;
+#endif
+#ifdef SLAB
+  /* the slab, SLAB_SIZE bytes */
+  _Alignas(CACHE_LINE_SIZE) char slab[];
+#endif
 } shared_data;
 
+#ifdef SLAB
+#define SHARED_DATA_SIZE (sizeof(shared_data) + SLAB_SIZE)
+
+static inline struct slab *shared_slab(shared_data *data) {
+
+  return (struct slab *)data->slab;
+}
+#else
+#define SHARED_DATA_SIZE sizeof(shared_data)
+#endif
+
+#if defined(SLAB) && defined(POSIX_SEMAPHORES)
+#define SHMEM_ID 98
+#elif defined(SLAB)
+#define SHMEM_ID 97
+#elif defined(POSIX_SEMAPHORES)
+#define SHMEM_ID 94
+#else
 #define SHMEM_ID 93
-#define FULLSLOTS 2065
-#define EMPTYSLOTS 2066
-#define MUTEX 2067
+#endif
+
+/* all three semaphores live in one set, so that a wait on a slot
+   semaphore and on the mutex can be done in a single atomic semop() */
+#ifdef SLAB
+#define SEMAPHORES 2067
+#else
+#define SEMAPHORES 2065
+#endif
+/* which semaphore in the set is which */
+#define FULLSLOTS 0
+#define EMPTYSLOTS 1
+#define MUTEX 2
+#define NUMBER_OF_SEMAPHORES 3
+
+#endif
+
+/* the producer and consumer can each move a batch of items per semop()
+   (by adding or subtracting the batch size from EMPTYSLOTS/FULLSLOTS,
+   or with POSIX semaphores, by that many sem_wait()s and sem_post()s).
+   The two batch sizes must add up to at most BUFFER_SIZE+1, or the
+   producer can be left waiting for more empty slots than there are
+   while the consumer waits for more full slots than there are.  POSIX
+   semaphores can only be taken one at a time, so there a producer
+   holds PRODUCER_CLAIM while it takes its batch of empty slots (and a
+   consumer CONSUMER_CLAIM while it takes its full ones), or several
+   could each be left holding part of a batch, waiting for each other's
+   slots.  With -DFANIN neither applies: each producer has empty slots
+   of its own, and the consumer only ever waits for one item at a time
+   and takes whatever else has arrived. */
+
+/* SEM_R and SEM_A are BSD names, Linux only has the octal modes */
+#ifndef SEM_R
+#define SEM_R 0400
+#endif
+#ifndef SEM_A
+#define SEM_A 0200
+#endif
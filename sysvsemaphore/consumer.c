@@ -3,6 +3,18 @@
 
   Consumer implementation
 
+  With -DFANIN (see buffer.h), the consumer waits until there is at
+  least one item in any of the rings, then makes a pass over them,
+  taking up to a batch of items from each.  The third parameter picks
+  the order: rr (the default) visits every ring in turn, starting one
+  further along each pass, and occupancy always goes to whichever ring
+  is fullest, so a producer that is sending a burst gets its ring
+  emptied before it fills up
+
+  With -DSLAB (see buffer.h), the buffer holds the handles of messages
+  in the slab: the consumer reads each message where the producer built
+  it, checks its payload, and frees its block
+
   Jim Teresco, Williams College
   March, 2005
   Updated October 2006
@@ -14,24 +26,77 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
+#ifdef POSIX_SEMAPHORES
+#include <semaphore.h>
+#endif
 
 #include "buffer.h"
+#include "placement.h"
+#include "shmseg.h"
+
+#ifdef SLAB
+/* read the message with handle h in place, count it in *bad if it is
+   not what the producer builds for its item, free its block, and
+   return the item */
+static int take_message(struct slab *slab, struct slab_cache *cache,
+			slab_handle h, int *bad) {
+  struct slab_message *m = (struct slab_message *)slab_ptr(slab, h);
+  int item = m->item;
+  uint32_t j;
+
+  if (sizeof(struct slab_message) + m->len > slab_block_size(slab, h)) {
+    (*bad)++;
+  }
+  else {
+    for (j=0; j<m->len; j++) {
+      if (m->payload[j] != (unsigned char)(item + j)) {
+	(*bad)++;
+	break;
+      }
+    }
+  }
+  slab_free(slab, cache, h);
+  return item;
+}
+#endif
 
 int main(int argc, char *argv[]) {
   int number_of_items;
-  int item_id;
-  int i;
+  int batch;
+  int i, k, n;
   int segment_id;
+  pid_t pid;
   shared_data *data;
-  int used_slot;
+  int items[BUFFER_SIZE];
+  int used_slots[BUFFER_SIZE];
+#ifdef FANIN
+  /* the ring being drained, and where the next round robin pass starts */
+  int r, next = 0, most, pass;
+  int by_occupancy = 0;
+  /* items taken this pass, and ones waited for but not yet taken */
+  int taken, credit;
+  struct spsc_ring *ring;
+  struct spsc_span span;
+  int *slot;
+#endif
+#ifdef SLAB
+  buffer_item handles[BUFFER_SIZE];
+  struct slab *slab;
+  struct slab_cache cache;
+  /* messages that were not what they should be */
+  int bad = 0;
+#endif
 
-  /* semaphore IDs */
-  int emptyslots, fullslots, mutex;
-  /* operation parameter for the semaphore ops */
-  struct sembuf operations[1];
+#ifndef POSIX_SEMAPHORES
+  /* semaphore set ID */
+  int semaphores;
+  /* operation parameters for the semaphore ops -- we do two at once */
+  struct sembuf operations[2];
+#endif
 
   /* first parameter is how many items to consume */
   number_of_items = 10;
@@ -39,99 +104,288 @@ int main(int argc, char *argv[]) {
     number_of_items = atoi(argv[1]);
   }
 
+  /* second parameter is how many items to take from the buffer at once */
+  batch = 1;
+  if (argc > 2) {
+    batch = atoi(argv[2]);
+  }
+  if (batch < 1 || batch > BUFFER_SIZE) {
+    fprintf(stderr, "%s: batch size must be between 1 and %d\n", argv[0],
+	    BUFFER_SIZE);
+    exit(1);
+  }
+
+#ifdef FANIN
+  /* third parameter is the order to drain the rings in */
+  if (argc > 3) {
+    if (strcmp(argv[3], "occupancy") == 0) {
+      by_occupancy = 1;
+    }
+    else if (strcmp(argv[3], "rr") != 0) {
+      fprintf(stderr, "%s: order must be rr or occupancy\n", argv[0]);
+      exit(1);
+    }
+  }
+#endif
+
   /* get access to the chunk of shared memory that is the buffer */
   /* we use the same shared memory ID as the buffer processes,
      and get it for reading and writing, but unlike in the buffer, we don't
      specify the create flag IPC_CREAT */
-  segment_id = shmget(SHMEM_ID, sizeof(shared_data), SHM_R|SHM_W);
+  segment_id = shmget(SHMEM_ID, SHARED_DATA_SIZE, SHM_R|SHM_W);
 
   /* attach a pointer to the shared memory */
   data = (shared_data *)shmat(segment_id, NULL, 0);
 
-  /* get access to the semaphores, again using names but not creating them,
-     since they were created by the buffer process. */
-  if ((fullslots = semget(FULLSLOTS, 1, SEM_R|SEM_A)) == -1) {
-    perror("semget (fullslots)");
-  }
-  if ((emptyslots = semget(EMPTYSLOTS, 1, SEM_R|SEM_A)) == -1) {
-    perror("semget (emptyslots)");
-  }
-  if ((mutex = semget(MUTEX, 1, SEM_R|SEM_A)) == -1) {
-    perror("semget (mutex)");
+  /* fault in our mapping of it now, if SHMSEG_PREFAULT is set */
+  shmseg_prefault(data, SHARED_DATA_SIZE);
+
+#ifdef SLAB
+  slab = shared_slab(data);
+  slab_cache_init(&cache);
+#endif
+
+#ifndef POSIX_SEMAPHORES
+  /* get access to the semaphore set, again using its name but not
+     creating it, since it was created by the buffer process. */
+  if ((semaphores = semget(SEMAPHORES, NUMBER_OF_SEMAPHORES,
+			   SEM_R|SEM_A)) == -1) {
+    perror("semget");
   }
+#endif
   
-  /* seed the random number generator on pid */
-  srand(getpid());
+  /* seed the random number generator on pid (which the log messages
+     use too: getpid() is a system call, so only ask once) */
+  pid = getpid();
+  srand(pid);
+
+  /* pin and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_thread(PLACE_CONSUMER, 0);
   
-  for (i=0; i<number_of_items; i++) {
+  BENCH_CONSUMER_BEGIN(number_of_items);
 
-    /* WAIT(FULLSLOTS); */
-    /* which semaphore in the array? */
-    operations[0].sem_num = 0;
-    /* what to do (wait == subtract 1) */
+#ifdef FANIN
+  for (i=0; i<number_of_items; i+=taken) {
+
+    /* wait until there is something in at least one of the rings */
+    BENCH_WAITING();
+#ifdef POSIX_SEMAPHORES
+    if (sem_wait(&data->full_slots) == -1) {
+      perror("sem_wait (full_slots)");
+    }
+#else
+    operations[0].sem_num = FULLSLOTS;
     operations[0].sem_op = -1;
-    /* no flags set here means wait if necessary (don't just return) */
     operations[0].sem_flg = 0;
-    
-    /* do the actual wait operation */
-    if (semop(fullslots, operations, 1) == -1) {
+    if (semop(semaphores, operations, 1) == -1) {
       perror("semop (wait fullslots)");
     }
-    
-    /* WAIT(MUTEX); */
+#endif
+    BENCH_CONSUMER_WAITED();
+    credit = 1;
+    taken = 0;
+
+    for (pass=0; pass<FANIN_PRODUCERS && i+taken<number_of_items; pass++) {
+
+      /* which ring next? */
+      if (by_occupancy) {
+	most = 0;
+	for (k=0, r=0; k<FANIN_PRODUCERS; k++) {
+	  n = spsc_peek(fanin_ring(data, k), &span);
+	  if (n > most) {
+	    most = n;
+	    r = k;
+	  }
+	}
+	if (most == 0) break;
+      }
+      else {
+	r = (next + pass) % FANIN_PRODUCERS;
+      }
+
+      /* take up to a batch of items from it, straight out of the ring */
+      ring = fanin_ring(data, r);
+      n = spsc_peek(ring, &span);
+      if (n > batch) n = batch;
+      if (n > number_of_items - i - taken) n = number_of_items - i - taken;
+      if (n == 0) continue;
+      for (k=0; k<n; k++) {
+	slot = k < span.first_len ? &span.first[k] :
+	  &span.second[k - span.first_len];
+	items[k] = *slot;
+	used_slots[k] = spsc_slot(ring, slot);
+	BENCH_DEQUEUED(data->stamp[r * BUFFER_SIZE + used_slots[k]]);
+      }
+      spsc_release(ring, n);
+
+      /* SIGNAL(the ring's EMPTYSLOTS) n times, and WAIT(FULLSLOTS) for
+	 however many of these items we have not already waited for.
+	 Those are in the ring, so this only waits if their producer
+	 has not quite got around to its SIGNAL(FULLSLOTS) yet */
+#ifdef POSIX_SEMAPHORES
+      for (k=credit; k<n; k++) {
+	if (sem_wait(&data->full_slots) == -1) {
+	  perror("sem_wait (full_slots)");
+	}
+      }
+      for (k=0; k<n; k++) {
+	sem_post(&data->empty_slots[r]);
+      }
+#else
+      operations[0].sem_num = RING_EMPTYSLOTS(r);
+      operations[0].sem_op = n;
+      operations[0].sem_flg = 0;
+      operations[1].sem_num = FULLSLOTS;
+      operations[1].sem_op = credit - n;
+      operations[1].sem_flg = 0;
+      /* (a sem_op of 0 would mean wait for zero, so leave it out) */
+      if (semop(semaphores, operations, n > credit ? 2 : 1) == -1) {
+	perror("semop (signal emptyslots, wait fullslots)");
+      }
+#endif
+      credit = 0;
+      taken += n;
+
+      for (k=0; k<n; k++) {
+	LOG("%s [%d]: consuming value %d from slot %d of ring %d\n",
+	    argv[0], pid, items[k], used_slots[k], r);
+
+	/* simulate the cost of consuming the item by
+	   sleeping for a small random number of seconds */
+	CONSUMER_WORK();
+      }
+    }
+    next = (next + 1) % FANIN_PRODUCERS;
+
+    /* we waited for an item and did not find it, which should not
+       happen, but give it back rather than lose it */
+    if (credit > 0) {
+#ifdef POSIX_SEMAPHORES
+      sem_post(&data->full_slots);
+#else
+      operations[0].sem_num = FULLSLOTS;
+      operations[0].sem_op = credit;
+      operations[0].sem_flg = 0;
+      semop(semaphores, operations, 1);
+#endif
+    }
+  }
+#else
+  for (i=0; i<number_of_items; i+=n) {
+
+    /* take the next batch (the last one may be short) */
+    n = number_of_items - i < batch ? number_of_items - i : batch;
+
+    /* time the wait (we cannot tell if it actually blocked, so this
+       counts every one) */
+    BENCH_WAITING();
+#ifdef POSIX_SEMAPHORES
+    /* WAIT(FULLSLOTS) n times, then WAIT(MUTEX).  These only make a
+       system call if the process has to go to sleep.  The n waits are
+       made under CONSUMER_CLAIM, so that only one consumer at a time
+       can be part way through taking its batch */
+    if (sem_wait(&data->consumer_claim) == -1) {
+      perror("sem_wait (consumer_claim)");
+    }
+    for (k=0; k<n; k++) {
+      if (sem_wait(&data->full_slots) == -1) {
+	perror("sem_wait (full_slots)");
+      }
+    }
+    sem_post(&data->consumer_claim);
+    if (sem_wait(&data->mutex) == -1) {
+      perror("sem_wait (mutex)");
+    }
+#else
+    /* WAIT(FULLSLOTS) n times and WAIT(MUTEX), as one atomic operation:
+       the process sleeps until both can be done, then does both */
     /* which semaphore in the array? */
-    operations[0].sem_num = 0;
-    /* what to do (wait == subtract 1) */
-    operations[0].sem_op = -1;
+    operations[0].sem_num = FULLSLOTS;
+    /* what to do (wait == subtract, here n at once) */
+    operations[0].sem_op = -n;
     /* no flags set here means wait if necessary (don't just return) */
     operations[0].sem_flg = 0;
+    operations[1].sem_num = MUTEX;
+    operations[1].sem_op = -1;
+    operations[1].sem_flg = 0;
     
     /* do the actual wait operation */
-    if (semop(mutex, operations, 1) == -1) {
-      perror("semop (wait mutex)");
+    if (semop(semaphores, operations, 2) == -1) {
+      perror("semop (wait fullslots, mutex)");
     }
+#endif
+    BENCH_CONSUMER_WAITED();
     
-    item_id = data->buffer[data->out];
-    used_slot = data->out;
+    for (k=0; k<n; k++) {
+#ifdef SLAB
+      handles[k] = data->buffer[data->out];
+#else
+      items[k] = data->buffer[data->out];
+#endif
+      used_slots[k] = data->out;
+      BENCH_DEQUEUED(data->stamp[data->out]);
 
-    data->out = (data->out + 1)%BUFFER_SIZE;
+      data->out = (data->out + 1)%BUFFER_SIZE;
+    }
 
-    /* SIGNAL(MUTEX); */
-    /* which semaphore in the array? */
-    operations[0].sem_num = 0;
-    /* what to do (signal == add 1) */
-    operations[0].sem_op = 1;
-    /* no flags set here means wait if necessary (don't just return) */
-    operations[0].sem_flg = 0;
-    
-    /* do the actual wait operation */
-    if (semop(mutex, operations, 1) == -1) {
-      perror("semop (signal mutex)");
+#ifdef POSIX_SEMAPHORES
+    /* SIGNAL(MUTEX), then SIGNAL(EMPTYSLOTS) n times.  These only make a
+       system call if there is a process to wake up */
+    sem_post(&data->mutex);
+    for (k=0; k<n; k++) {
+      sem_post(&data->empty_slots);
     }
-      
-    /* SIGNAL(EMPTYSLOTS); */
-    /* which semaphore in the array? */
-    operations[0].sem_num = 0;
-    /* what to do (signal == add 1) */
+#else
+    /* SIGNAL(MUTEX) and SIGNAL(EMPTYSLOTS) n times, again as one
+       operation */
+    operations[0].sem_num = MUTEX;
+    /* what to do (signal == add) */
     operations[0].sem_op = 1;
-    /* no flags set here means wait if necessary (don't just return) */
     operations[0].sem_flg = 0;
+    operations[1].sem_num = EMPTYSLOTS;
+    operations[1].sem_op = n;
+    operations[1].sem_flg = 0;
     
-    /* do the actual wait operation */
-    if (semop(emptyslots, operations, 1) == -1) {
-      perror("semop (signal emptyslots)");
+    /* do the actual signal operation */
+    if (semop(semaphores, operations, 2) == -1) {
+      perror("semop (signal mutex, emptyslots)");
     }
+#endif
     
-    printf("%s [%d]: consuming value %d from slot %d\n", 
-	   argv[0], getpid(), item_id, used_slot);
+    for (k=0; k<n; k++) {
+#ifdef SLAB
+      /* the message is still where the producer built it */
+      items[k] = take_message(slab, &cache, handles[k], &bad);
+#endif
+      LOG("%s [%d]: consuming value %d from slot %d\n", 
+	  argv[0], pid, items[k], used_slots[k]);
     
-    /* simulate the cost of producing the item by 
-       sleeping for a small random number of seconds */
-    sleep(rand()%5+1);
+      /* simulate the cost of consuming the item by 
+	 sleeping for a small random number of seconds */
+      CONSUMER_WORK();
+    }
     
   }
+
+#endif
+
+  BENCH_CONSUMER_END(&data->bench, number_of_items, BUFFER_SIZE);
+
+#ifdef SLAB
+  /* the blocks we kept for ourselves go back to the slab */
+  slab_cache_flush(slab, &cache);
+#endif
+
   /* detach from shared memory segment */
   shmdt(data);
-  
+
+#ifdef SLAB
+  if (bad > 0) {
+    fprintf(stderr, "%s: %d messages were not what they should be\n",
+	    argv[0], bad);
+    return 1;
+  }
+#endif
   return 0;
 }
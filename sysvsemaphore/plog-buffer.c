@@ -0,0 +1,92 @@
+/*
+  Producer-consumer example with a persistent log
+
+  The buffer process: creates the log file if there is none yet (see
+  plog.h), or else picks up the one that is there, whatever is in it,
+  and puts it in order after whatever stopped the processes that last
+  used it.  Unlike buffer, it leaves the log alone when it is killed,
+  so starting it again carries on with every item and every consumer
+  offset where they were.  Remove the file to start over.
+
+  Start it before any producers or consumers, and not while any are
+  running.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include "plog.h"
+#include "placement.h"
+
+static struct plog_header *log_header;
+static size_t log_size;
+/* copies of the consumers' names, since LOG may only keep a pointer to
+   them until exit (see eventlog.h), after the log is unmapped */
+static char consumer_names[PLOG_CONSUMERS][PLOG_NAME_MAX];
+
+/* signal handler that lets go of the log, but keeps it */
+void cleanup(int sig) {
+  int error = 0;
+
+  if (sig != -1)
+    LOG("Buffer got signal %d, leaving the log and exiting\n", sig);
+
+  if (munmap(log_header, log_size) == -1) {
+    perror("munmap");
+    error = 1;
+  }
+
+  exit(error);
+}
+
+int main(int argc, char *argv[]) {
+  int i;
+
+  /* map the log, creating it if need be */
+  log_header = plog_map(1, &log_size);
+  if (log_header == NULL) {
+    exit(1);
+  }
+
+  /* bind it to the PLACE_NODE node, if set (see placement.h) */
+  place_memory(log_header, log_size);
+
+  plog_recover(log_header);
+  LOG("Log %s: %u segments of %u items, holding positions %" PRIu64
+      " up to %" PRIu64 "\n", plog_path(), log_header->segments,
+      log_header->segment_items, atomic_load(&log_header->base),
+      atomic_load(&log_header->committed));
+  for (i=0; i<PLOG_CONSUMERS; i++) {
+    if (log_header->consumer[i].name[0] != '\0') {
+      memcpy(consumer_names[i], log_header->consumer[i].name, PLOG_NAME_MAX);
+      consumer_names[i][PLOG_NAME_MAX - 1] = '\0';
+      LOG("Consumer %s is at position %" PRIu64 "\n", consumer_names[i],
+	  atomic_load(&log_header->consumer[i].offset));
+    }
+  }
+
+  /* trap the crtl-c or kill -TERM that might kill this process so we
+     can let go of the log cleanly.  Note: being killed any other way
+     loses nothing either, since the log is all in the file */
+  if (signal(SIGINT, cleanup) == SIG_ERR) {
+    perror("signal");
+    cleanup(-1);
+  }
+  if (signal(SIGTERM, cleanup) == SIG_ERR) {
+    perror("signal");
+    cleanup(-1);
+  }
+
+  /* now sit here and sleep -- awaken only on response to a signal */
+  while (1) {
+    sleep(100);
+  }
+
+  /* this should never happen */
+  return 1;
+}
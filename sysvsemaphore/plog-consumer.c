@@ -0,0 +1,161 @@
+/*
+  Producer-consumer example with a persistent log
+
+  Consumer implementation: reads items from the log (see plog.h) under
+  a name, and carries on from where the last consumer with that name
+  stopped
+
+  Usage: plog-consumer name [items] [batch]
+         plog-consumer -d name
+
+  The second form removes the consumer called name from the log, so
+  that segments are no longer kept for it.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+
+#include "plog.h"
+#include "placement.h"
+
+int main(int argc, char *argv[]) {
+  const char *name;
+  int number_of_items;
+  int batch;
+  int i, k, n;
+  int nobody;
+  pid_t pid;
+  struct plog_header *h;
+  struct plog_consumer *c;
+  size_t size;
+  uint64_t offset, committed;
+  long spin;
+  struct waiter w;
+  struct plog_record *record;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s name [items] [batch]\n"
+	    "       %s -d name\n", argv[0], argv[0]);
+    exit(1);
+  }
+
+  /* map the log the buffer process set up */
+  h = plog_map(0, &size);
+  if (h == NULL) {
+    exit(1);
+  }
+
+  if (strcmp(argv[1], "-d") == 0) {
+    if (argc < 3 || plog_consumer_remove(h, argv[2]) == -1) {
+      fprintf(stderr, "%s: no such consumer, or it is running\n", argv[0]);
+      exit(1);
+    }
+    /* it may have been the one holding everything up */
+    plog_reclaim(h);
+    munmap(h, size);
+    return 0;
+  }
+
+  /* first parameter is the name to consume under */
+  name = argv[1];
+
+  /* second parameter is how many items to consume */
+  number_of_items = 10;
+  if (argc > 2) {
+    number_of_items = atoi(argv[2]);
+  }
+
+  /* third parameter is how many items to take from the log at once */
+  batch = 1;
+  if (argc > 3) {
+    batch = atoi(argv[3]);
+  }
+  if (batch < 1 || batch > h->segment_items) {
+    fprintf(stderr, "%s: batch size must be between 1 and %u\n", argv[0],
+	    h->segment_items);
+    exit(1);
+  }
+
+  /* seed the random number generator on pid (which the log messages
+     use too: getpid() is a system call, so only ask once) */
+  pid = getpid();
+  srand(pid);
+
+  /* find our entry, and make sure nobody else is using it: two
+     processes moving the same offset would each skip items */
+  c = plog_consumer_get(h, name);
+  if (c == NULL) {
+    fprintf(stderr, "%s: no room for another consumer\n", argv[0]);
+    exit(1);
+  }
+  nobody = 0;
+  while (!atomic_compare_exchange_strong(&c->pid, &nobody, pid)) {
+    /* one that was killed before it could say it was done no longer
+       counts */
+    if (kill(nobody, 0) == -1 && errno == ESRCH) continue;
+    fprintf(stderr, "%s: process %d is already consuming as %s\n",
+	    argv[0], nobody, name);
+    exit(1);
+  }
+  offset = atomic_load(&c->offset);
+  LOG("%s [%d]: consuming as %s from position %" PRIu64 "\n",
+      argv[0], pid, name, offset);
+
+  /* pin and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_thread(PLACE_CONSUMER, 0);
+
+  wait_init(&w, wait_policy_get(WAIT_PARK), &h->written);
+
+  BENCH_CONSUMER_BEGIN(number_of_items);
+
+  for (i=0; i<number_of_items; i+=n) {
+
+    /* wait for something past our offset to be committed */
+    spin = 0;
+    while ((committed = atomic_load(&h->committed)) == offset) {
+      if (spin == 0) {
+	LOG("%s [%d]: waiting for items\n", argv[0], pid);
+	BENCH_WAITING();
+      }
+      wait_pause(&w, spin++);
+    }
+    wait_done(&w);
+    if (spin > 0) BENCH_CONSUMER_WAITED();
+
+    /* read up to a batch of them, right where they are in the log */
+    n = committed - offset > (uint64_t)batch ? batch : committed - offset;
+    if (n > number_of_items - i) n = number_of_items - i;
+    for (k=0; k<n; k++) {
+      record = plog_record(h, offset + k);
+      BENCH_DEQUEUED(record->stamp[0]);
+      LOG("%s [%d]: consuming value %d at position %" PRIu64 "\n",
+	  argv[0], pid, record->value, offset + k);
+
+      /* simulate the cost of consuming the item by
+	 sleeping for a small random number of seconds */
+      CONSUMER_WORK();
+    }
+
+    /* done with them: move our offset past them, which is what lets
+       their segment be reclaimed, and is kept if we stop now.  Nothing
+       can be reclaimed unless we just finished a segment */
+    offset += n;
+    atomic_store(&c->offset, offset);
+    if (offset % h->segment_items < (uint64_t)n) plog_reclaim(h);
+  }
+
+  BENCH_CONSUMER_END(&h->bench, number_of_items, plog_capacity(h));
+  wait_report(argv[0], &w);
+
+  /* let the next consumer with this name carry on from here */
+  atomic_store(&c->pid, 0);
+  munmap(h, size);
+
+  return 0;
+}
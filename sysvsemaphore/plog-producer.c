@@ -0,0 +1,141 @@
+/*
+  Producer-consumer example with a persistent log
+
+  Producer implementation: appends items to the log (see plog.h)
+
+  Usage: plog-producer [items] [first item id] [batch]
+
+  Any number of producers can append at once.  Each claims room for a
+  batch of items by moving reserved forward, writes them straight into
+  the mapped file, and then, once the producers that claimed room
+  before it have committed theirs, commits them for the consumers.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "plog.h"
+#include "placement.h"
+
+int main(int argc, char *argv[]) {
+  int number_of_items;
+  int item_id;
+  int batch;
+  int i, k, n;
+  pid_t pid;
+  struct plog_header *h;
+  size_t size;
+  uint64_t pos, committed;
+  long spin;
+  struct waiter room, turn;
+  struct plog_record *record;
+
+  /* first parameter is how many items to produce */
+  number_of_items = 10;
+  if (argc > 1) {
+    number_of_items = atoi(argv[1]);
+  }
+
+  /* second parameter is the starting ID of items (they're just ints) */
+  item_id = 1;
+  if (argc > 2) {
+    item_id = atoi(argv[2]);
+  }
+
+  /* third parameter is how many items to append at once */
+  batch = 1;
+  if (argc > 3) {
+    batch = atoi(argv[3]);
+  }
+
+  /* map the log the buffer process set up */
+  h = plog_map(0, &size);
+  if (h == NULL) {
+    exit(1);
+  }
+  if (batch < 1 || batch > h->segment_items) {
+    fprintf(stderr, "%s: batch size must be between 1 and %u\n", argv[0],
+	    h->segment_items);
+    exit(1);
+  }
+
+  /* seed the random number generator on pid (which the log messages
+     use too: getpid() is a system call, so only ask once) */
+  pid = getpid();
+  srand(pid);
+
+  /* pin and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_thread(PLACE_PRODUCER, 0);
+
+  wait_init(&room, wait_policy_get(WAIT_PARK), &h->reclaimed);
+  wait_init(&turn, wait_policy_get(WAIT_PARK), &h->written);
+
+  BENCH_PRODUCER_BEGIN(&h->bench);
+
+  for (i=0; i<number_of_items; i+=n) {
+
+    /* the next batch (the last one may be short) */
+    n = number_of_items - i < batch ? number_of_items - i : batch;
+
+    /* claim room for it, waiting for segments to be reclaimed if the
+       ring is full */
+    spin = 0;
+    pos = atomic_load(&h->reserved);
+    for (;;) {
+      if (pos + n <= atomic_load(&h->base) + plog_capacity(h)) {
+	if (atomic_compare_exchange_weak(&h->reserved, &pos, pos + n)) break;
+	/* someone else claimed it, and pos is now what they left */
+	continue;
+      }
+      if (spin == 0) {
+	LOG("%s [%d]: waiting for room\n", argv[0], pid);
+	BENCH_WAITING();
+      }
+      wait_pause(&room, spin++);
+      pos = atomic_load(&h->reserved);
+    }
+    wait_done(&room);
+    if (spin > 0) BENCH_PRODUCER_WAITED();
+
+    for (k=0; k<n; k++) {
+
+      /* simulate the cost of producing the item by
+	 sleeping for a small random number of seconds */
+      PRODUCER_WORK();
+
+      LOG("%s [%d]: adding item %d at position %" PRIu64 "\n",
+	  argv[0], pid, item_id + k, pos + k);
+      record = plog_record(h, pos + k);
+      record->value = item_id + k;
+      BENCH_ENQUEUED(record->stamp[0]);
+    }
+
+    /* commit them, once everything before them is committed */
+    spin = 0;
+    while ((committed = atomic_load(&h->committed)) != pos) {
+      if (spin == 0) {
+	LOG("%s [%d]: waiting for position %" PRIu64 " to be committed\n",
+	    argv[0], pid, committed);
+      }
+      wait_pause(&turn, spin++);
+    }
+    wait_done(&turn);
+    atomic_store(&h->committed, pos + n);
+    wait_notify(&h->written);
+
+    /* bump up item ID for next batch to be produced */
+    item_id += n;
+  }
+
+  BENCH_PRODUCER_END(&h->bench);
+  wait_report(argv[0], &room);
+  wait_report(argv[0], &turn);
+
+  munmap(h, size);
+
+  return 0;
+}
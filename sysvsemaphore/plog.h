@@ -0,0 +1,336 @@
+/*
+  Producer-consumer example with a persistent log
+
+  Shared data structure for plog-buffer, plog-producer and
+  plog-consumer, which keep the items in an append-only log in a file
+  that all of them mmap, instead of in a SysV segment that goes away
+  with the buffer process.  Items are read and written right where they
+  sit in the mapping, so they move at memory speed through the page
+  cache with no read() or write() calls, and whatever is in the file
+  when a process stops is exactly what the next one maps.
+
+  The log is a sequence of positions 0, 1, 2, ... that only grows.
+  Position p is stored in segment p / segment_items of the log, and the
+  file holds the last few segments in a ring of segment slots, so
+  segment s lives in slot s % segments.  Three positions in the header
+  say what is where:
+
+    base       the first position still kept (always the start of a
+               segment): everything before it has been reclaimed
+    committed  everything before this has been written and can be read
+    reserved   everything before this has been claimed by a producer,
+               which may still be writing it
+
+  A producer appends by moving reserved forward with a compare-and-
+  swap, writing its items, then waiting for the producers before it to
+  commit theirs and moving committed forward, so committed only ever
+  covers complete items.
+
+  Each consumer has a name, and an entry in the header with its offset,
+  the position of the next item it will read, which it moves forward
+  once it has consumed the items before it.  Every consumer reads every
+  item, at its own pace, and the offset stays in the file when the
+  consumer stops, so one started again under the same name carries on
+  where the last left off (one that had not finished consuming an item
+  when it was killed gets that item again, and one killed before it
+  could say it was done does not keep the next from starting).  A
+  segment is reclaimed, and its slot reused, only once every consumer's
+  offset has passed it, so producers wait for the slowest consumer when
+  the ring is full; a consumer that will not be back should be removed
+  (plog-consumer -d name) so that it does not hold everything up.  A
+  reclaimed segment's whole pages are handed back to the file system
+  (MADV_REMOVE) until they are next written.
+
+  Producers and consumers wait (for room, for earlier producers to
+  commit, for new items) as WAIT_POLICY says (see waitstrategy.h), by
+  default spinning for a while and then sleeping on a futex in the
+  mapping.
+
+  The file is PLOG_FILE, or prodcons.plog in the current directory.
+  plog-buffer creates it, with PLOG_SEGMENTS segments of BUFFER_SIZE
+  items, if it does not exist; a file that does exist keeps the shape
+  it was made with.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+#include "waitstrategy.h"
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 5
+#endif
+#ifndef PLOG_SEGMENTS
+#define PLOG_SEGMENTS 4
+#endif
+/* most consumer names, and longest name */
+#define PLOG_CONSUMERS 16
+#define PLOG_NAME_MAX 32
+
+#define PLOG_MAGIC 0x504c4f47
+#define PLOG_VERSION 1
+/* the records start here, a page into the file */
+#define PLOG_HEADER_SIZE 4096
+
+struct plog_record {
+  int value;
+  BENCH_STAMPS(stamp, 1)
+};
+
+struct plog_consumer {
+  /* "" if the entry is free */
+  char name[PLOG_NAME_MAX];
+  /* position of the next item this consumer will read */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t offset;
+  /* pid of the process consuming under this name, 0 if none */
+  atomic_int pid;
+};
+
+struct plog_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t segment_items;
+  uint32_t segments;
+  BENCH_SHARED(bench)
+  /* held while registering a consumer or reclaiming segments */
+  atomic_int lock;
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t base;
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t committed;
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t reserved;
+  /* consumers wait here for items, producers for earlier producers */
+  _Alignas(CACHE_LINE_SIZE) struct wait_queue written;
+  /* producers wait here for room */
+  _Alignas(CACHE_LINE_SIZE) struct wait_queue reclaimed;
+  struct plog_consumer consumer[PLOG_CONSUMERS];
+};
+
+_Static_assert(sizeof(struct plog_header) <= PLOG_HEADER_SIZE,
+	       "plog header does not fit");
+
+static inline const char *plog_path(void) {
+  char *path = getenv("PLOG_FILE");
+
+  return path != NULL && path[0] != '\0' ? path : "prodcons.plog";
+}
+
+static inline size_t plog_file_size(uint32_t segment_items,
+				    uint32_t segments) {
+
+  return PLOG_HEADER_SIZE +
+    (size_t)segment_items * segments * sizeof(struct plog_record);
+}
+
+/* how many items the ring of segments holds */
+static inline uint64_t plog_capacity(struct plog_header *h) {
+
+  return (uint64_t)h->segment_items * h->segments;
+}
+
+/* where position pos is stored */
+static inline struct plog_record *plog_record(struct plog_header *h,
+					      uint64_t pos) {
+  struct plog_record *records =
+    (struct plog_record *)((char *)h + PLOG_HEADER_SIZE);
+
+  return &records[pos % plog_capacity(h)];
+}
+
+/* map the log file, creating it first if create is set and it does not
+   exist yet.  Returns NULL, having said why, if it cannot */
+static inline struct plog_header *plog_map(int create, size_t *size) {
+  const char *path = plog_path();
+  struct plog_header *h;
+  struct stat st;
+  int fd, fresh;
+
+  fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0600);
+  if (fd == -1) {
+    perror(path);
+    return NULL;
+  }
+  if (fstat(fd, &st) == -1) {
+    perror(path);
+    close(fd);
+    return NULL;
+  }
+  fresh = st.st_size == 0;
+  if (fresh) {
+    if (!create) {
+      fprintf(stderr, "%s: log is empty, start plog-buffer first\n", path);
+      close(fd);
+      return NULL;
+    }
+    st.st_size = plog_file_size(BUFFER_SIZE, PLOG_SEGMENTS);
+    if (ftruncate(fd, st.st_size) == -1) {
+      perror(path);
+      close(fd);
+      return NULL;
+    }
+  }
+
+  /* the mapping stays valid after the file is closed */
+  h = (struct plog_header *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == (struct plog_header *)MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  if (fresh) {
+    /* ftruncate filled it with zeros, which is most of what we want */
+    h->segment_items = BUFFER_SIZE;
+    h->segments = PLOG_SEGMENTS;
+    h->version = PLOG_VERSION;
+    atomic_store(&h->base, 0);
+    atomic_store(&h->committed, 0);
+    atomic_store(&h->reserved, 0);
+    h->magic = PLOG_MAGIC;
+  }
+  else if (h->magic != PLOG_MAGIC || h->version != PLOG_VERSION ||
+	   (size_t)st.st_size != plog_file_size(h->segment_items,
+						h->segments)) {
+    fprintf(stderr, "%s: not a log file, or not a whole one\n", path);
+    munmap(h, st.st_size);
+    return NULL;
+  }
+  *size = st.st_size;
+  return h;
+}
+
+static inline void plog_lock(struct plog_header *h) {
+  int unlocked;
+  long spin = 0;
+
+  for (;;) {
+    unlocked = 0;
+    if (atomic_compare_exchange_weak(&h->lock, &unlocked, 1)) return;
+    if (spin++ < WAIT_SPIN_LIMIT) cpu_relax();
+    else sched_yield();
+  }
+}
+
+static inline void plog_unlock(struct plog_header *h) {
+
+  atomic_store(&h->lock, 0);
+}
+
+/* the entry for consumer name, making one starting at the oldest item
+   still kept if there is none.  Returns NULL if all are taken */
+static inline struct plog_consumer *plog_consumer_get(struct plog_header *h,
+						      const char *name) {
+  struct plog_consumer *c, *free_entry = NULL;
+  int i;
+
+  plog_lock(h);
+  for (i=0; i<PLOG_CONSUMERS; i++) {
+    c = &h->consumer[i];
+    if (strncmp(c->name, name, PLOG_NAME_MAX - 1) == 0) {
+      plog_unlock(h);
+      return c;
+    }
+    if (c->name[0] == '\0' && free_entry == NULL) free_entry = c;
+  }
+  if (free_entry != NULL) {
+    /* under the lock, nothing can be reclaimed while we join */
+    atomic_store(&free_entry->offset, atomic_load(&h->base));
+    atomic_store(&free_entry->pid, 0);
+    strncpy(free_entry->name, name, PLOG_NAME_MAX - 1);
+  }
+  plog_unlock(h);
+  return free_entry;
+}
+
+/* forget consumer name.  Returns 0, or -1 if there is no such consumer
+   or it is running */
+static inline int plog_consumer_remove(struct plog_header *h,
+				       const char *name) {
+  struct plog_consumer *c;
+  int i;
+
+  plog_lock(h);
+  for (i=0; i<PLOG_CONSUMERS; i++) {
+    c = &h->consumer[i];
+    if (c->name[0] != '\0' &&
+	strncmp(c->name, name, PLOG_NAME_MAX - 1) == 0 &&
+	atomic_load(&c->pid) == 0) {
+      memset(c->name, 0, PLOG_NAME_MAX);
+      plog_unlock(h);
+      return 0;
+    }
+  }
+  plog_unlock(h);
+  return -1;
+}
+
+/* reclaim every segment that all of the consumers are done with, and
+   wake any producers waiting for room */
+static inline void plog_reclaim(struct plog_header *h) {
+  uint64_t min, offset, base, new_base, start, end, page;
+  int i;
+
+  plog_lock(h);
+  min = atomic_load(&h->committed);
+  for (i=0; i<PLOG_CONSUMERS; i++) {
+    if (h->consumer[i].name[0] == '\0') continue;
+    offset = atomic_load(&h->consumer[i].offset);
+    if (offset < min) min = offset;
+  }
+  base = atomic_load(&h->base);
+  new_base = min - min % h->segment_items;
+  if (new_base <= base) {
+    plog_unlock(h);
+    return;
+  }
+
+  /* give the whole pages of the reclaimed slots back to the file system
+     (the slots are a contiguous stretch of the ring, unless it wraps) */
+  page = (uint64_t)sysconf(_SC_PAGESIZE);
+  while (base < new_base) {
+    start = (uint64_t)plog_record(h, base);
+    if (new_base - base > plog_capacity(h) - base % plog_capacity(h)) {
+      end = (uint64_t)plog_record(h, 0) +
+	plog_capacity(h) * sizeof(struct plog_record);
+      base += plog_capacity(h) - base % plog_capacity(h);
+    }
+    else {
+      end = start + (new_base - base) * sizeof(struct plog_record);
+      base = new_base;
+    }
+    start = (start + page - 1) & ~(page - 1);
+    end &= ~(page - 1);
+    if (start < end) madvise((void *)start, end - start, MADV_REMOVE);
+  }
+
+  atomic_store(&h->base, new_base);
+  plog_unlock(h);
+  wait_notify(&h->reclaimed);
+}
+
+/* put the log back in order after a restart, when nothing else has it
+   mapped: forget anything a producer claimed but never committed, and
+   anyone who was waiting or consuming */
+static inline void plog_recover(struct plog_header *h) {
+  int i;
+
+  atomic_store(&h->reserved, atomic_load(&h->committed));
+  atomic_store(&h->lock, 0);
+  /* anyone may park, whatever the buffer's own WAIT_POLICY says */
+  wait_queue_init(&h->written, WAIT_PARK);
+  wait_queue_init(&h->reclaimed, WAIT_PARK);
+  for (i=0; i<PLOG_CONSUMERS; i++) {
+    atomic_store(&h->consumer[i].pid, 0);
+  }
+}
@@ -3,6 +3,14 @@
 
   Producer implementation
 
+  With -DFANIN (see buffer.h), each producer claims a ring of its own
+  when it starts and gives it back when it is done, and never takes
+  the mutex
+
+  With -DSLAB (see buffer.h), each item is built as a message in a
+  block of the slab, and only its handle goes into the buffer.  The
+  fourth parameter is how many bytes of payload each message has
+
   Jim Teresco, Williams College
   March, 2005
   Updated March 2008, Mount Holyoke College
@@ -16,20 +24,72 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
+#ifdef POSIX_SEMAPHORES
+#include <semaphore.h>
+#endif
+#ifdef SLAB
+#include <sched.h>
+#endif
 
 #include "buffer.h"
+#include "placement.h"
+#include "shmseg.h"
+
+#ifdef SLAB
+/* build the message for item, with payload bytes of payload, right in
+   a block of the slab, and return its handle */
+static slab_handle build_message(struct slab *slab, struct slab_cache *cache,
+				 int item, size_t payload) {
+  slab_handle h;
+  struct slab_message *m;
+  size_t j;
+
+  while ((h = slab_alloc(slab, cache, sizeof(struct slab_message) +
+			 payload)) == SLAB_NONE) {
+    /* every block is in use: wait for the consumer to free some */
+    sched_yield();
+  }
+  m = (struct slab_message *)slab_ptr(slab, h);
+  m->item = item;
+  m->len = payload;
+  for (j=0; j<payload; j++) {
+    m->payload[j] = (unsigned char)(item + j);
+  }
+  return h;
+}
+#endif
 
 int main(int argc, char *argv[]) {
   int number_of_items;
   int item_id;
-  int i;
+  int batch;
+  int i, k, n;
   int segment_id;
+  pid_t pid;
   shared_data *data;
+  int items[BUFFER_SIZE];
+#ifdef FANIN
+  /* which ring is ours */
+  int ring_number, expected;
+  struct spsc_ring *ring;
+  struct spsc_span span;
+  int *slot;
+#endif
+#ifdef SLAB
+  /* the handles of the messages built for items[] */
+  buffer_item handles[BUFFER_SIZE];
+  struct slab *slab;
+  struct slab_cache cache;
+  size_t payload;
+#endif
 
-  /* semaphore IDs */
-  int emptyslots, fullslots, mutex;
-  /* operation parameter for the semaphore ops */
-  struct sembuf operations[1];
+#ifndef POSIX_SEMAPHORES
+  /* semaphore set ID */
+  int semaphores;
+  /* operation parameters for the semaphore ops -- we do two at once
+     (or with FANIN, just one) */
+  struct sembuf operations[2];
+#endif
 
   /* first parameter is how many items to produce */
   number_of_items = 10;
@@ -43,102 +103,247 @@ int main(int argc, char *argv[]) {
     item_id = atoi(argv[2]);
   }
 
+  /* third parameter is how many items to put into the buffer at once */
+  batch = 1;
+  if (argc > 3) {
+    batch = atoi(argv[3]);
+  }
+  if (batch < 1 || batch > BUFFER_SIZE) {
+    fprintf(stderr, "%s: batch size must be between 1 and %d\n", argv[0],
+	    BUFFER_SIZE);
+    exit(1);
+  }
+
+#ifdef SLAB
+  /* fourth parameter is how many bytes of payload each message has */
+  payload = SLAB_PAYLOAD;
+  if (argc > 4) {
+    payload = atol(argv[4]);
+  }
+  if (sizeof(struct slab_message) + payload >
+      slab_class_size(SLAB_CLASSES - 1)) {
+    fprintf(stderr, "%s: payload can be at most %zu bytes\n", argv[0],
+	    (size_t)(slab_class_size(SLAB_CLASSES - 1) -
+		     sizeof(struct slab_message)));
+    exit(1);
+  }
+#endif
+
   /* get access to the chunk of shared memory that is the buffer */
   /* we use the same shared memory ID as the buffer processes,
      and get it for reading and writing, but unlike in the buffer, we don't
      specify the create flag IPC_CREAT */
-  segment_id = shmget(SHMEM_ID, sizeof(shared_data), SHM_R|SHM_W);
+  segment_id = shmget(SHMEM_ID, SHARED_DATA_SIZE, SHM_R|SHM_W);
 
   /* attach a pointer to the shared memory */
   data = (shared_data *)shmat(segment_id, NULL, 0);
 
-  /* get access to the semaphores, again using names but not creating them,
-     since they were created by the buffer process. */
-  if ((fullslots = semget(FULLSLOTS, 1, SEM_R|SEM_A)) == -1) {
-    perror("semget (fullslots)");
+  /* fault in our mapping of it now, if SHMSEG_PREFAULT is set */
+  shmseg_prefault(data, SHARED_DATA_SIZE);
+
+#ifdef SLAB
+  slab = shared_slab(data);
+  slab_cache_init(&cache);
+#endif
+
+#ifndef POSIX_SEMAPHORES
+  /* get access to the semaphore set, again using its name but not
+     creating it, since it was created by the buffer process. */
+  if ((semaphores = semget(SEMAPHORES, NUMBER_OF_SEMAPHORES,
+			   SEM_R|SEM_A)) == -1) {
+    perror("semget");
   }
-  if ((emptyslots = semget(EMPTYSLOTS, 1, SEM_R|SEM_A)) == -1) {
-    perror("semget (emptyslots)");
+#endif
+  
+  /* seed the random number generator on pid (which the log messages
+     use too: getpid() is a system call, so only ask once) */
+  pid = getpid();
+  srand(pid);
+
+#ifdef FANIN
+  /* claim the first free ring by putting our pid in its entry */
+  for (ring_number=0; ring_number<FANIN_PRODUCERS; ring_number++) {
+    expected = 0;
+    if (atomic_compare_exchange_strong(&data->producer[ring_number],
+				       &expected, pid)) break;
   }
-  if ((mutex = semget(MUTEX, 1, SEM_R|SEM_A)) == -1) {
-    perror("semget (mutex)");
+  if (ring_number == FANIN_PRODUCERS) {
+    fprintf(stderr, "%s: all %d rings are in use\n", argv[0],
+	    FANIN_PRODUCERS);
+    exit(1);
   }
+  ring = fanin_ring(data, ring_number);
+  LOG("%s [%d]: using ring %d\n", argv[0], pid, ring_number);
+#endif
+
+  /* pin and lock as the PLACE_ settings say (see placement.h) */
+  place_init();
+  place_thread(PLACE_PRODUCER, 0);
   
-  /* seed the random number generator on pid */
-  srand(getpid());
-  
-  for (i=0; i<number_of_items; i++) {
+  BENCH_PRODUCER_BEGIN(&data->bench);
 
-    /* simulate the cost of producing the item by 
-       sleeping for a small random number of seconds */
-    sleep(rand()%4+1);
-    
-    /* put the produced value in the buffer when there's space */
-    printf("%s [%d]: produced %d\n", argv[0], getpid(), item_id);
+  for (i=0; i<number_of_items; i+=n) {
+
+    /* produce the next batch (the last one may be short) */
+    n = number_of_items - i < batch ? number_of_items - i : batch;
+    for (k=0; k<n; k++) {
+
+      /* simulate the cost of producing the item by 
+	 sleeping for a small random number of seconds */
+      PRODUCER_WORK();
+
+      items[k] = item_id + k;
+#ifdef SLAB
+      handles[k] = build_message(slab, &cache, items[k], payload);
+#endif
+      LOG("%s [%d]: produced %d\n", argv[0], pid, items[k]);
+    }
     
-    /* WAIT(EMPTYSLOTS); */
-    /* which semaphore in the array? */
-    operations[0].sem_num = 0;
-    /* what to do (wait == subtract 1) */
-    operations[0].sem_op = -1;
-    /* no flags set here means wait if necessary (don't just return) */
+    /* put the produced values in the buffer when there's space */
+
+    /* time the wait (we cannot tell if it actually blocked, so this
+       counts every one) */
+    BENCH_WAITING();
+#if defined(FANIN) && defined(POSIX_SEMAPHORES)
+    /* WAIT(our ring's EMPTYSLOTS) n times.  No mutex: nobody else
+       writes to our ring */
+    for (k=0; k<n; k++) {
+      if (sem_wait(&data->empty_slots[ring_number]) == -1) {
+	perror("sem_wait (empty_slots)");
+      }
+    }
+#elif defined(FANIN)
+    /* WAIT(our ring's EMPTYSLOTS) n times.  No mutex: nobody else
+       writes to our ring */
+    operations[0].sem_num = RING_EMPTYSLOTS(ring_number);
+    operations[0].sem_op = -n;
     operations[0].sem_flg = 0;
-    
-    /* do the actual wait operation */
-    if (semop(emptyslots, operations, 1) == -1) {
+    if (semop(semaphores, operations, 1) == -1) {
       perror("semop (wait emptyslots)");
     }
-    
-    /* WAIT(MUTEX); */
+#elif defined(POSIX_SEMAPHORES)
+    /* WAIT(EMPTYSLOTS) n times, then WAIT(MUTEX).  These only make a
+       system call if the process has to go to sleep.  The n waits are
+       made under PRODUCER_CLAIM, so that only one producer at a time
+       can be part way through taking its batch */
+    if (sem_wait(&data->producer_claim) == -1) {
+      perror("sem_wait (producer_claim)");
+    }
+    for (k=0; k<n; k++) {
+      if (sem_wait(&data->empty_slots) == -1) {
+	perror("sem_wait (empty_slots)");
+      }
+    }
+    sem_post(&data->producer_claim);
+    if (sem_wait(&data->mutex) == -1) {
+      perror("sem_wait (mutex)");
+    }
+#else
+    /* WAIT(EMPTYSLOTS) n times and WAIT(MUTEX), as one atomic operation:
+       the process sleeps until both can be done, then does both */
     /* which semaphore in the array? */
-    operations[0].sem_num = 0;
-    /* what to do (wait == subtract 1) */
-    operations[0].sem_op = -1;
+    operations[0].sem_num = EMPTYSLOTS;
+    /* what to do (wait == subtract, here n at once) */
+    operations[0].sem_op = -n;
     /* no flags set here means wait if necessary (don't just return) */
     operations[0].sem_flg = 0;
+    operations[1].sem_num = MUTEX;
+    operations[1].sem_op = -1;
+    operations[1].sem_flg = 0;
     
     /* do the actual wait operation */
-    if (semop(mutex, operations, 1) == -1) {
-      perror("semop (wait mutex)");
+    if (semop(semaphores, operations, 2) == -1) {
+      perror("semop (wait emptyslots, mutex)");
     }
+#endif
+    BENCH_PRODUCER_WAITED();
+
+#ifdef FANIN
+    /* there are n free slots in our ring now: write the items straight
+       into them, and make them all visible to the consumer at once */
+    spsc_reserve(ring, n, &span);
+    for (k=0; k<n; k++) {
+      slot = k < span.first_len ? &span.first[k] :
+	&span.second[k - span.first_len];
+      LOG("%s [%d]: adding item %d at slot %d of ring %d\n",
+	  argv[0], pid, items[k], spsc_slot(ring, slot), ring_number);
+
+      *slot = items[k];
+      BENCH_ENQUEUED(data->stamp[ring_number * BUFFER_SIZE +
+				 spsc_slot(ring, slot)]);
+    }
+    spsc_commit(ring, n);
+#else
+    for (k=0; k<n; k++) {
+      LOG("%s [%d]: adding item %d at slot %d\n", 
+	  argv[0], pid, items[k], data->in);
     
-    printf("%s [%d]: adding item %d at slot %d\n", 
-	   argv[0], getpid(), item_id, data->in);
-    
-    data->buffer[data->in] = item_id;
+#ifdef SLAB
+      /* only the handle: the message stays where it was built */
+      data->buffer[data->in] = handles[k];
+#else
+      data->buffer[data->in] = items[k];
+#endif
+      BENCH_ENQUEUED(data->stamp[data->in]);
     
-    data->in = (data->in + 1)%BUFFER_SIZE;
+      data->in = (data->in + 1)%BUFFER_SIZE;
+    }
+#endif
     
-    /* SIGNAL(MUTEX); */
-    /* which semaphore in the array? */
-    operations[0].sem_num = 0;
-    /* what to do (signal == add 1) */
-    operations[0].sem_op = 1;
-    /* no flags set here means wait if necessary (don't just return) */
+#if defined(FANIN) && defined(POSIX_SEMAPHORES)
+    /* SIGNAL(FULLSLOTS) n times */
+    for (k=0; k<n; k++) {
+      sem_post(&data->full_slots);
+    }
+#elif defined(FANIN)
+    /* SIGNAL(FULLSLOTS) n times */
+    operations[0].sem_num = FULLSLOTS;
+    operations[0].sem_op = n;
     operations[0].sem_flg = 0;
-    
-    /* do the actual wait operation */
-    if (semop(mutex, operations, 1) == -1) {
-      perror("semop (signal mutex)");
+    if (semop(semaphores, operations, 1) == -1) {
+      perror("semop (signal fullslots)");
     }
-      
-    /* SIGNAL(FULLSLOTS); */
-    /* which semaphore in the array? */
-    operations[0].sem_num = 0;
-    /* what to do (signal == add 1) */
+#elif defined(POSIX_SEMAPHORES)
+    /* SIGNAL(MUTEX), then SIGNAL(FULLSLOTS) n times.  These only make a
+       system call if there is a process to wake up */
+    sem_post(&data->mutex);
+    for (k=0; k<n; k++) {
+      sem_post(&data->full_slots);
+    }
+#else
+    /* SIGNAL(MUTEX) and SIGNAL(FULLSLOTS) n times, again as one
+       operation */
+    operations[0].sem_num = MUTEX;
+    /* what to do (signal == add) */
     operations[0].sem_op = 1;
-    /* no flags set here means wait if necessary (don't just return) */
     operations[0].sem_flg = 0;
+    operations[1].sem_num = FULLSLOTS;
+    operations[1].sem_op = n;
+    operations[1].sem_flg = 0;
     
-    /* do the actual wait operation */
-    if (semop(fullslots, operations, 1) == -1) {
-      perror("semop (signal fullslots)");
+    /* do the actual signal operation */
+    if (semop(semaphores, operations, 2) == -1) {
+      perror("semop (signal mutex, fullslots)");
     }
+#endif
     
-    /* bump up item ID for next item to be produced */
-    item_id++;
+    /* bump up item ID for next batch to be produced */
+    item_id += n;
     
   }
+
+  BENCH_PRODUCER_END(&data->bench);
+
+#ifdef FANIN
+  /* the ring is free for another producer (which will carry on where
+     we left off, after anything we left in it) */
+  atomic_store(&data->producer[ring_number], 0);
+#endif
+#ifdef SLAB
+  /* the blocks we kept for ourselves go back to the slab */
+  slab_cache_flush(slab, &cache);
+#endif
+
   /* detach from shared memory segment */
   shmdt(data);
   